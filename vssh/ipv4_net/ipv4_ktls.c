@@ -0,0 +1,88 @@
+#include "ipv4_net_config.h"
+#include "ipv4_ktls.h"
+#include "ipv4_session.h"
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+// Key, salt and initial vector of a direction in the order of the crypto info
+#define KTLS_KEY_MATERIAL_SIZE                        \
+    (TLS_CIPHER_AES_GCM_256_KEY_SIZE + TLS_CIPHER_AES_GCM_256_SALT_SIZE + TLS_CIPHER_AES_GCM_256_IV_SIZE)
+
+static int ipv4_ktls_set(int socket_fd, int direction, const unsigned char *secret, size_t secret_size, const char *label)
+{
+    unsigned char material[KTLS_KEY_MATERIAL_SIZE];
+    if (ipv4_session_derive(material, sizeof(material), secret, secret_size, NULL, 0, label) == -1)
+        return -1;
+
+    struct tls12_crypto_info_aes_gcm_256 info;
+    memset(&info, 0, sizeof(info));
+
+    info.info.version     = TLS_1_3_VERSION;
+    info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+
+    memcpy(info.key,  material, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+    memcpy(info.salt, material + TLS_CIPHER_AES_GCM_256_KEY_SIZE, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+    memcpy(info.iv,   material + TLS_CIPHER_AES_GCM_256_KEY_SIZE + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+
+    int retval = setsockopt(socket_fd, SOL_TLS, direction, &info, sizeof(info));
+
+    memset(material, 0, sizeof(material));
+    memset(&info, 0, sizeof(info));
+
+    return retval;
+}
+
+int ipv4_ktls_attach(int socket_fd)
+{
+    if (IPV4_KTLS_ENABLED == 0)
+        return -1;
+
+    // The upper layer passes data through as it is until the keys are set
+    return setsockopt(socket_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+}
+
+int ipv4_ktls_install(int socket_fd, const unsigned char *secret, size_t secret_size, int is_initiator)
+{
+    if (secret == NULL || secret_size == 0)
+        return -1;
+
+    // The initiator is the server: it sends with the server key and receives with the client one
+    const char *tx_label = is_initiator ? "vssh ktls server" : "vssh ktls client";
+    const char *rx_label = is_initiator ? "vssh ktls client" : "vssh ktls server";
+
+    if (ipv4_ktls_set(socket_fd, TLS_TX, secret, secret_size, tx_label) == -1)
+        return -1;
+
+    return ipv4_ktls_set(socket_fd, TLS_RX, secret, secret_size, rx_label);
+}
+
+ssize_t ipv4_ktls_sendfile(int socket_fd, int file_fd, off_t offset, size_t n_bytes)
+{
+    size_t n_sent_bytes = 0;
+    while (n_sent_bytes < n_bytes)
+    {
+        ssize_t n_bytes_once = sendfile(socket_fd, file_fd, &offset, n_bytes - n_sent_bytes);
+        if (n_bytes_once == -1 && errno == EINTR)
+            continue;
+        if (n_bytes_once <= 0)
+            return -1;
+
+        n_sent_bytes += n_bytes_once;
+    }
+
+    return n_sent_bytes;
+}
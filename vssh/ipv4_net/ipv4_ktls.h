@@ -0,0 +1,23 @@
+#ifndef IPV4_KTLS_H_
+#define IPV4_KTLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Kernel TLS of TCP connections
+ *
+ * Once both sides of a TCP connection have the "tls" upper layer, keys
+ * derived from the DH secret are given to the kernel: it frames what is
+ * sent into AES-GCM records and opens received ones, so the secure API
+ * moves plain data and files go from the page cache with sendfile(). A
+ * key of its own is derived for each direction. Without kernel support
+ * the connection stays with the encryption of the secure API.
+ */
+
+int     ipv4_ktls_attach (int socket_fd);
+int     ipv4_ktls_install(int socket_fd, const unsigned char *secret, size_t secret_size, int is_initiator);
+
+ssize_t ipv4_ktls_sendfile(int socket_fd, int file_fd, off_t offset, size_t n_bytes);
+
+#endif // !IPV4_KTLS_H_
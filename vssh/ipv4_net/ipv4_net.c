@@ -8,8 +8,84 @@
 #include <openssl/err.h>
 #include <openssl/dh.h>
 #include <openssl/bn.h>
+#include <openssl/rand.h>
 #include <openssl/engine.h>
-#include <openssl/aes.h>
+#include <sys/mman.h>
+
+// Chunks of files are whole pieces sent by the buffer functions
+#define IPV4_FILE_CHUNK_SIZE        (IPV4_FILE_N_CHUNK_PIECES * PACKET_DATA_SIZE)
+#define IPV4_SECURE_PIECE_SIZE      (PACKET_DATA_SIZE - IPV4_SESSION_TAG_SIZE)
+#define IPV4_FILE_CHUNK_SIZE_SECURE (IPV4_FILE_N_CHUNK_PIECES * IPV4_SECURE_PIECE_SIZE)
+
+static ssize_t ipv4_send_file_chunks(int socket_fd, int file_fd, size_t file_size, int connection_type, ipv4_session *session);
+
+static ssize_t ipv4_pwrite(int file_fd, const void *buffer, size_t n_bytes, off_t offset)
+{
+    size_t n_written_bytes = 0;
+    while (n_written_bytes < n_bytes)
+    {
+        ssize_t n_bytes_once = pwrite(file_fd, (const char *) buffer + n_written_bytes, n_bytes - n_written_bytes, offset + n_written_bytes);
+        if (n_bytes_once == -1 && errno == EINTR)
+            continue;
+        if (n_bytes_once <= 0)
+            return -1;
+
+        n_written_bytes += n_bytes_once;
+    }
+
+    return n_written_bytes;
+}
+
+static ssize_t ipv4_send_all(int socket_fd, const void *buffer, size_t n_bytes)
+{
+    size_t n_sent_bytes = 0;
+    while (n_sent_bytes < n_bytes)
+    {
+        ssize_t n_bytes_once = send(socket_fd, (const char *) buffer + n_sent_bytes, n_bytes - n_sent_bytes, 0);
+        if (n_bytes_once == -1 && errno == EINTR)
+            continue;
+        if (n_bytes_once <= 0)
+            return -1;
+
+        n_sent_bytes += n_bytes_once;
+    }
+
+    return n_sent_bytes;
+}
+
+static ssize_t ipv4_recv_all(int socket_fd, void *buffer, size_t n_bytes)
+{
+    size_t n_recv_bytes = 0;
+    while (n_recv_bytes < n_bytes)
+    {
+        ssize_t n_bytes_once = recv(socket_fd, (char *) buffer + n_recv_bytes, n_bytes - n_recv_bytes, MSG_WAITALL);
+        if (n_bytes_once == -1 && errno == EINTR)
+            continue;
+        if (n_bytes_once == -1)
+            return -1;
+        if (n_bytes_once == 0) // connection is closed
+            break;
+
+        n_recv_bytes += n_bytes_once;
+    }
+
+    return n_recv_bytes;
+}
+
+// A piece of the secure API is taken whole from a stream, as it is decrypted whole
+static ssize_t ipv4_read_piece(int socket_fd, void *buffer, size_t n_bytes, int connection_type)
+{
+    if (connection_type == SOCK_STREAM)
+        return ipv4_recv_all(socket_fd, buffer, n_bytes);
+
+    return read(socket_fd, buffer, n_bytes);
+}
+
+// The kernel encrypts records of a TCP connection with its keys set, the secure API moves plain data then
+static int ipv4_is_ktls(const ipv4_session *session, int connection_type)
+{
+    return connection_type == SOCK_STREAM && session != NULL && session->is_ktls;
+}
 
 int ipv4_socket(int type, int optname)
 {
@@ -166,24 +242,9 @@ ssize_t ipv4_receive_message(int socket_fd, void *buffer, size_t n_bytes, int co
         return -1;
 }
 
-ssize_t ipv4_send_buffer(int socket_fd, const void *buffer, size_t n_bytes, int msg_type,
-                         uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
-                         char *spare_buffer2, size_t spare_buffer_size2, int connection_type)
+// Data of a buffer without its control message
+static ssize_t ipv4_send_data(int socket_fd, const void *buffer, size_t n_bytes, int connection_type)
 {
-    if (buffer == NULL)
-        return -1;
-
-    if (connection_type != SOCK_STREAM && connection_type != SOCK_DGRAM && connection_type != SOCK_STREAM_UDT)
-        return -1;
-
-    if (msg_type == -1)
-        msg_type = IPV4_BUF_HEADER_TYPE;
-
-    int ctl_msg_state = ipv4_send_ctl_message(socket_fd, msg_type, n_bytes, spare_fields, spare_fields_size, 
-                                              spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type);
-    if (ctl_msg_state == -1)
-        return -1;
-
     ssize_t n_sent_bytes = 0;
     size_t n_iters = n_bytes / PACKET_DATA_SIZE;
     size_t n_remaining_bytes = n_bytes % PACKET_DATA_SIZE;
@@ -222,6 +283,27 @@ ssize_t ipv4_send_buffer(int socket_fd, const void *buffer, size_t n_bytes, int
     return n_sent_bytes;
 }
 
+ssize_t ipv4_send_buffer(int socket_fd, const void *buffer, size_t n_bytes, int msg_type,
+                         uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
+                         char *spare_buffer2, size_t spare_buffer_size2, int connection_type)
+{
+    if (buffer == NULL)
+        return -1;
+
+    if (connection_type != SOCK_STREAM && connection_type != SOCK_DGRAM && connection_type != SOCK_STREAM_UDT)
+        return -1;
+
+    if (msg_type == -1)
+        msg_type = IPV4_BUF_HEADER_TYPE;
+
+    int ctl_msg_state = ipv4_send_ctl_message(socket_fd, msg_type, n_bytes, spare_fields, spare_fields_size, 
+                                              spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type);
+    if (ctl_msg_state == -1)
+        return -1;
+
+    return ipv4_send_data(socket_fd, buffer, n_bytes, connection_type);
+}
+
 ssize_t ipv4_receive_buffer(int socket_fd, void *buffer, size_t n_bytes, int connection_type)
 {
     if (buffer == NULL)
@@ -230,6 +312,10 @@ ssize_t ipv4_receive_buffer(int socket_fd, void *buffer, size_t n_bytes, int con
     if (connection_type != SOCK_STREAM && connection_type != SOCK_DGRAM && connection_type != SOCK_STREAM_UDT)
         return -1;
 
+    // read() of a stream may return less than asked
+    if (connection_type == SOCK_STREAM)
+        return (ipv4_recv_all(socket_fd, buffer, n_bytes) == n_bytes) ? n_bytes : -1;
+
     ssize_t n_recv_bytes = 0;
     size_t n_iters = n_bytes / PACKET_DATA_SIZE;
     size_t n_remaining_bytes = n_bytes % PACKET_DATA_SIZE;
@@ -272,53 +358,50 @@ ssize_t ipv4_send_file(int socket_fd, int file_fd, uint32_t *spare_fields, size_
                        char *spare_buffer1, size_t spare_buffer_size1, char *spare_buffer2, size_t spare_buffer_size2, int connection_type)
 {
     off_t file_size = get_file_size(file_fd);
-
-    char *buffer = malloc(file_size + 1);
-    if (buffer == NULL)
+    if (file_size == -1)
         return -1;
 
-    buffer[file_size + 1] = 0;
-
-    ssize_t read_error = read(file_fd, buffer, file_size);
-    if (read_error == -1)
-        return -1;
-
-    ssize_t sent_bytes = ipv4_send_buffer(socket_fd, buffer, file_size, IPV4_FILE_HEADER_TYPE, spare_fields, spare_fields_size,
-                                          spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type);
-    if (sent_bytes == -1)
+    int ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_FILE_HEADER_TYPE, file_size, spare_fields, spare_fields_size,
+                                              spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type);
+    if (ctl_msg_state == -1)
         return -1;
 
-    free(buffer);
-
-    return sent_bytes;
+    return ipv4_send_file_chunks(socket_fd, file_fd, file_size, connection_type, NULL);
 }
 
 ssize_t ipv4_receive_file(int socket_fd, int file_fd, size_t n_bytes, int connection_type)
 {
-    char *buffer = malloc(n_bytes + 1);
+    char *buffer = malloc(IPV4_FILE_CHUNK_SIZE);
     if (buffer == NULL)
         return -1;
 
-    buffer[n_bytes + 1] = 0;
+    // Every chunk reaches the file as soon as it is received, only the bytes really received
+    ssize_t n_recv_bytes = 0;
+    while (n_recv_bytes < n_bytes)
+    {
+        size_t n_chunk_bytes = (n_bytes - n_recv_bytes > IPV4_FILE_CHUNK_SIZE) ? IPV4_FILE_CHUNK_SIZE : n_bytes - n_recv_bytes;
 
-    ssize_t sent_bytes = ipv4_receive_buffer(socket_fd, buffer, n_bytes, connection_type);
-    if (sent_bytes == -1)
-        return -1;
+        ssize_t n_chunk_recv_bytes = ipv4_receive_buffer(socket_fd, buffer, n_chunk_bytes, connection_type);
+        if (n_chunk_recv_bytes <= 0 || ipv4_pwrite(file_fd, buffer, n_chunk_recv_bytes, n_recv_bytes) == -1)
+        {
+            free(buffer);
+            return -1;
+        }
 
-    ssize_t read_error = write(file_fd, buffer, n_bytes);
-    if (read_error == -1)
-        return -1;
+        n_recv_bytes += n_chunk_recv_bytes;
+    }
 
     free(buffer);
 
-    return sent_bytes;
+    return n_recv_bytes;
 }
 
 // Secured API
 
-int ipv4_send_ctl_message_secure(int socket_fd, uint64_t msg_type, uint64_t msg_length, 
-                                 uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
-                                 char *spare_buffer2, size_t spare_buffer_size2, int connection_type, unsigned char *key)
+// Sending side of the session is locked by the caller
+static int ipv4_send_ctl_message_locked(int socket_fd, uint64_t msg_type, uint64_t msg_length,
+                                        uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
+                                        char *spare_buffer2, size_t spare_buffer_size2, int connection_type, ipv4_session *session)
 {
     if (spare_fields != NULL && spare_fields_size > IPV4_SPARE_FIELDS)
         return -1;
@@ -338,8 +421,13 @@ int ipv4_send_ctl_message_secure(int socket_fd, uint64_t msg_type, uint64_t msg_
     if (spare_buffer2 != NULL)
         memcpy(message.spare_buffer2, spare_buffer2, spare_buffer_size2 * sizeof(spare_buffer2[0]));
 
-    unsigned char encrypted_message[sizeof(ipv4_ctl_message) + AES_BLOCK_SIZE];
-    int ciphertext_len = encrypt_AES((unsigned char *) &message, sizeof(ipv4_ctl_message), encrypted_message, key);
+    if (ipv4_is_ktls(session, connection_type))
+        return ipv4_send_all(socket_fd, &message, sizeof(ipv4_ctl_message));
+
+    unsigned char encrypted_message[sizeof(ipv4_ctl_message) + IPV4_SESSION_TAG_SIZE];
+    int ciphertext_len = ipv4_session_encrypt(session, (unsigned char *) &message, sizeof(ipv4_ctl_message), encrypted_message);
+    if (ciphertext_len == -1)
+        return -1;
 
     if (connection_type == SOCK_STREAM || connection_type == SOCK_DGRAM)
         return send(socket_fd, encrypted_message, ciphertext_len, 0);
@@ -349,97 +437,184 @@ int ipv4_send_ctl_message_secure(int socket_fd, uint64_t msg_type, uint64_t msg_
         return -1;
 }
 
-ssize_t ipv4_send_message_secure(int socket_fd, const void *buffer, size_t n_bytes, int connection_type, unsigned char *key)
+int ipv4_send_ctl_message_secure(int socket_fd, uint64_t msg_type, uint64_t msg_length,
+                                 uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
+                                 char *spare_buffer2, size_t spare_buffer_size2, int connection_type, ipv4_session *session)
 {
-    if (buffer == NULL)
+    if (ipv4_session_lock(session, IPV4_SESSION_TX) == -1)
         return -1;
 
-    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_MSG_HEADER_TYPE, n_bytes, NULL, 0, NULL, 0, NULL, 0, connection_type, key);
+    int ctl_msg_state = ipv4_send_ctl_message_locked(socket_fd, msg_type, msg_length, spare_fields, spare_fields_size,
+                                                     spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type, session);
+    ipv4_session_unlock(session, IPV4_SESSION_TX);
+
+    return ctl_msg_state;
+}
+
+static ssize_t ipv4_send_message_locked(int socket_fd, const void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    int ctl_msg_state = ipv4_send_ctl_message_locked(socket_fd, IPV4_MSG_HEADER_TYPE, n_bytes, NULL, 0, NULL, 0, NULL, 0, connection_type, session);
     if (ctl_msg_state == -1)
         return -1;
 
-    unsigned char *encrypted_buffer = malloc(n_bytes + AES_BLOCK_SIZE);
+    if (ipv4_is_ktls(session, connection_type))
+        return ipv4_send_all(socket_fd, buffer, n_bytes);
+
+    unsigned char *encrypted_buffer = ipv4_pool_get(n_bytes + IPV4_SESSION_TAG_SIZE);
     if (encrypted_buffer == NULL)
         return -1;
 
-    int ciphertext_len = encrypt_AES(buffer, n_bytes, encrypted_buffer, key);
+    int ciphertext_len = ipv4_session_encrypt(session, buffer, n_bytes, encrypted_buffer);
 
     ssize_t send_state = -1;
-    if (connection_type == SOCK_STREAM || connection_type == SOCK_DGRAM)
+    if (ciphertext_len == -1)
+        send_state = -1;
+    else if (connection_type == SOCK_STREAM || connection_type == SOCK_DGRAM)
         send_state = send(socket_fd, encrypted_buffer, ciphertext_len, 0);
     else if (connection_type == SOCK_STREAM_UDT)
         send_state = udt_send(socket_fd, (char *) encrypted_buffer, ciphertext_len);
-    else
-    {
-        free(encrypted_buffer);
-        return -1;
-    }
 
-    free(encrypted_buffer);
+    ipv4_pool_put(encrypted_buffer);
 
     return send_state;
 }
 
-ssize_t ipv4_receive_message_secure(int socket_fd, void *buffer, size_t n_bytes, int connection_type, unsigned char *key)
+// The header and its record go on the wire one right after the other
+ssize_t ipv4_send_message_secure(int socket_fd, const void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
 {
     if (buffer == NULL)
         return -1;
 
-    ssize_t n_encrypted_bytes_rem = n_bytes % AES_BLOCK_SIZE;
-    ssize_t n_encrypted_bytes = n_bytes - n_encrypted_bytes_rem + AES_BLOCK_SIZE;
-
-    unsigned char *encrypted_buffer = malloc(n_encrypted_bytes);
-    if (encrypted_buffer == NULL)
+    if (ipv4_session_lock(session, IPV4_SESSION_TX) == -1)
         return -1;
 
-    unsigned char *decrypted_buffer = malloc(n_encrypted_bytes);
-    if (decrypted_buffer == NULL)
+    ssize_t send_state = ipv4_send_message_locked(socket_fd, buffer, n_bytes, connection_type, session);
+    ipv4_session_unlock(session, IPV4_SESSION_TX);
+
+    return send_state;
+}
+
+static ssize_t ipv4_receive_message_locked(int socket_fd, void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    if (ipv4_is_ktls(session, connection_type))
+        return ipv4_recv_all(socket_fd, buffer, n_bytes);
+
+    ssize_t n_encrypted_bytes = n_bytes + IPV4_SESSION_TAG_SIZE;
+
+    unsigned char *encrypted_buffer = ipv4_pool_get(n_encrypted_bytes);
+    if (encrypted_buffer == NULL)
         return -1;
 
     ssize_t read_state = -1;
     if (connection_type == SOCK_STREAM || connection_type == SOCK_DGRAM)
-        read_state = read(socket_fd, encrypted_buffer, n_encrypted_bytes);
+        read_state = ipv4_read_piece(socket_fd, encrypted_buffer, n_encrypted_bytes, connection_type);
     else if (connection_type == SOCK_STREAM_UDT)
         read_state = udt_recv(socket_fd, (char *) encrypted_buffer, n_encrypted_bytes);
-    else
-    {
-        free(encrypted_buffer);
-        free(decrypted_buffer);
+
+    // A record is opened right into the buffer, it is never longer than expected
+    int decryptedtext_len = -1;
+    if (read_state > 0)
+        decryptedtext_len = ipv4_session_decrypt(session, encrypted_buffer, read_state, buffer);
+
+    ipv4_pool_put(encrypted_buffer);
+
+    return decryptedtext_len;
+}
+
+ssize_t ipv4_receive_message_secure(int socket_fd, void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    if (buffer == NULL)
         return -1;
-    }
-        
-    if (read_state == -1)
+
+    if (ipv4_session_lock(session, IPV4_SESSION_RX) == -1)
         return -1;
 
-    int decryptedtext_len = decrypt_AES(encrypted_buffer, n_encrypted_bytes, decrypted_buffer, key);
-    memcpy(buffer, decrypted_buffer, n_bytes);
-    
-    free(encrypted_buffer);
-    free(decrypted_buffer);
+    ssize_t recv_state = ipv4_receive_message_locked(socket_fd, buffer, n_bytes, connection_type, session);
+    ipv4_session_unlock(session, IPV4_SESSION_RX);
 
-    return decryptedtext_len;
+    return recv_state;
 }
 
-int ipv4_close_secure(int socket_fd, int connection_type, unsigned char *key)
+// The session ends with its connection
+int ipv4_close_secure(int socket_fd, int connection_type, ipv4_session *session)
 {
+    int close_state = -1;
+
     if (connection_type == SOCK_STREAM_UDT)
-        return udt_close(socket_fd);
+        close_state = udt_close(socket_fd);
     else
     {
-        int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, SOCK_STREAM, key);
+        int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, SOCK_STREAM, session);
+        close_state = close(socket_fd);
+
         if (ctl_msg_state == -1)
-        {
-            close(socket_fd);
+            close_state = -1;
+    }
+
+    ipv4_session_destroy(session);
+
+    return close_state;
+}
+
+// Every piece is encrypted right into the payload of a packet of its own
+static ssize_t ipv4_send_buffer_secure_udt(int socket_fd, const unsigned char *buffer, size_t n_bytes, ipv4_session *session)
+{
+    ssize_t n_sent_bytes = 0;
+
+    while (n_sent_bytes < n_bytes)
+    {
+        size_t capacity = 0;
+        char *payload = udt_send_reserve(socket_fd, &capacity);
+        if (payload == NULL)
             return -1;
-        }
 
-        return close(socket_fd);
+        // The tag takes the end of the payload
+        size_t n_piece_bytes = capacity - IPV4_SESSION_TAG_SIZE;
+        if (n_piece_bytes > n_bytes - n_sent_bytes)
+            n_piece_bytes = n_bytes - n_sent_bytes;
+
+        int ciphertext_len = ipv4_session_encrypt(session, buffer + n_sent_bytes, n_piece_bytes, (unsigned char *) payload);
+        if (udt_send_commit(socket_fd, ciphertext_len) <= 0)
+            return -1;
+
+        n_sent_bytes += n_piece_bytes;
     }
+
+    return n_sent_bytes;
+}
+
+// Data of a buffer without its control message, the sending side of the session is locked by the caller
+static ssize_t ipv4_send_data_secure(int socket_fd, const void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    if (connection_type == SOCK_STREAM_UDT)
+        return ipv4_send_buffer_secure_udt(socket_fd, buffer, n_bytes, session);
+
+    if (ipv4_is_ktls(session, connection_type))
+        return ipv4_send_all(socket_fd, buffer, n_bytes);
+
+    ssize_t n_sent_bytes = 0;
+    unsigned char encrypted_buffer[PACKET_DATA_SIZE];
+
+    while (n_sent_bytes < n_bytes)
+    {
+        size_t n_piece_bytes = (n_bytes - n_sent_bytes < IPV4_SECURE_PIECE_SIZE) ? n_bytes - n_sent_bytes : IPV4_SECURE_PIECE_SIZE;
+
+        int ciphertext_len = ipv4_session_encrypt(session, (const unsigned char *) buffer + n_sent_bytes, n_piece_bytes, encrypted_buffer);
+        if (ciphertext_len == -1)
+            return -1;
+
+        if (ipv4_send_all(socket_fd, encrypted_buffer, ciphertext_len) <= 0)
+            return -1;
+
+        n_sent_bytes += n_piece_bytes;
+    }
+
+    return n_sent_bytes;
 }
 
 ssize_t ipv4_send_buffer_secure(int socket_fd, const void *buffer, size_t n_bytes, int msg_type,
                                 uint32_t *spare_fields, size_t spare_fields_size, char *spare_buffer1, size_t spare_buffer_size1,
-                                char *spare_buffer2, size_t spare_buffer_size2, int connection_type, unsigned char *key)
+                                char *spare_buffer2, size_t spare_buffer_size2, int connection_type, ipv4_session *session)
 {
     if (buffer == NULL)
         return -1;
@@ -450,55 +625,79 @@ ssize_t ipv4_send_buffer_secure(int socket_fd, const void *buffer, size_t n_byte
     if (msg_type == -1)
         msg_type = IPV4_BUF_HEADER_TYPE;
 
-    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, msg_type, n_bytes, spare_fields, spare_fields_size, 
-                                                     spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type, key);
-    if (ctl_msg_state == -1)
+    if (ipv4_session_lock(session, IPV4_SESSION_TX) == -1)
         return -1;
 
-    ssize_t n_sent_bytes = 0;
-    size_t n_iters = n_bytes / (PACKET_DATA_SIZE - AES_BLOCK_SIZE);
-    size_t n_remaining_bytes = n_bytes % (PACKET_DATA_SIZE - AES_BLOCK_SIZE);
-    
-    const unsigned char *cur_pos = buffer;
+    ssize_t send_state = ipv4_send_ctl_message_locked(socket_fd, msg_type, n_bytes, spare_fields, spare_fields_size,
+                                                      spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type, session);
+    if (send_state != -1)
+        send_state = ipv4_send_data_secure(socket_fd, buffer, n_bytes, connection_type, session);
+
+    ipv4_session_unlock(session, IPV4_SESSION_TX);
+
+    return send_state;
+}
+
+// Pieces come as messages of one packet, the size of a piece is the length of its message
+static ssize_t ipv4_receive_buffer_secure_udt(int socket_fd, unsigned char *buffer, size_t n_bytes, ipv4_session *session)
+{
+    ssize_t n_recv_bytes = 0;
+
     unsigned char encrypted_buffer[PACKET_DATA_SIZE];
 
-    for (size_t i = 0; i < n_iters; ++i)
+    while (n_recv_bytes < n_bytes)
     {
-        int ciphertext_len = encrypt_AES(cur_pos, PACKET_DATA_SIZE - AES_BLOCK_SIZE, encrypted_buffer, key);
-
-        ssize_t n_bytes = 0;
-        if (connection_type == SOCK_STREAM_UDT)
-            n_bytes = udt_send(socket_fd, (char *) encrypted_buffer, ciphertext_len);
-        else
-            n_bytes = send(socket_fd, encrypted_buffer, ciphertext_len, 0);
+        ssize_t n_encrypted_bytes = udt_recv(socket_fd, (char *) encrypted_buffer, PACKET_DATA_SIZE);
+        if (n_encrypted_bytes <= IPV4_SESSION_TAG_SIZE || n_encrypted_bytes - IPV4_SESSION_TAG_SIZE > n_bytes - n_recv_bytes)
+            return -1;
 
-        if (n_bytes <= 0)
+        int decryptedtext_len = ipv4_session_decrypt(session, encrypted_buffer, n_encrypted_bytes, buffer + n_recv_bytes);
+        if (decryptedtext_len == -1)
+        {
+            syslog(LOG_ERR, "decrypt error");
             return -1;
+        }
 
-        n_sent_bytes += PACKET_DATA_SIZE - AES_BLOCK_SIZE;
-        cur_pos      += PACKET_DATA_SIZE - AES_BLOCK_SIZE;
+        n_recv_bytes += decryptedtext_len;
     }
 
-    if (n_remaining_bytes > 0)
+    return n_recv_bytes;
+}
+
+// Receiving side of the session is locked by the caller
+static ssize_t ipv4_receive_data_secure(int socket_fd, void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    if (connection_type == SOCK_STREAM_UDT)
+        return ipv4_receive_buffer_secure_udt(socket_fd, buffer, n_bytes, session);
+
+    if (ipv4_is_ktls(session, connection_type))
+        return (ipv4_recv_all(socket_fd, buffer, n_bytes) == n_bytes) ? n_bytes : -1;
+
+    ssize_t n_recv_bytes = 0;
+    unsigned char encrypted_buffer[PACKET_DATA_SIZE];
+
+    while (n_recv_bytes < n_bytes)
     {
-        int ciphertext_len = encrypt_AES(cur_pos, n_remaining_bytes, encrypted_buffer, key);
+        size_t n_piece_bytes = (n_bytes - n_recv_bytes < IPV4_SECURE_PIECE_SIZE) ? n_bytes - n_recv_bytes : IPV4_SECURE_PIECE_SIZE;
+        ssize_t n_encrypted_bytes = n_piece_bytes + IPV4_SESSION_TAG_SIZE;
 
-        ssize_t n_bytes = 0;
-        if (connection_type == SOCK_STREAM_UDT)
-            n_bytes = udt_send(socket_fd, (char *) encrypted_buffer, ciphertext_len);
-        else
-            n_bytes = send(socket_fd, encrypted_buffer, ciphertext_len, 0);
+        if (ipv4_read_piece(socket_fd, encrypted_buffer, n_encrypted_bytes, connection_type) != n_encrypted_bytes)
+            return -1;
 
-        if (n_bytes <= 0)
+        int decryptedtext_len = ipv4_session_decrypt(session, encrypted_buffer, n_encrypted_bytes, (unsigned char *) buffer + n_recv_bytes);
+        if (decryptedtext_len == -1)
+        {
+            syslog(LOG_ERR, "decrypt error");
             return -1;
+        }
 
-        n_sent_bytes += n_remaining_bytes;
+        n_recv_bytes += n_piece_bytes;
     }
 
-    return n_sent_bytes;
+    return n_recv_bytes;
 }
 
-ssize_t ipv4_receive_buffer_secure(int socket_fd, void *buffer, size_t n_bytes, int connection_type, unsigned char *key)
+ssize_t ipv4_receive_buffer_secure(int socket_fd, void *buffer, size_t n_bytes, int connection_type, ipv4_session *session)
 {
     if (buffer == NULL)
         return -1;
@@ -506,160 +705,447 @@ ssize_t ipv4_receive_buffer_secure(int socket_fd, void *buffer, size_t n_bytes,
     if (connection_type != SOCK_STREAM && connection_type != SOCK_DGRAM && connection_type != SOCK_STREAM_UDT)
         return -1;
 
-    ssize_t n_recv_bytes = 0;
-    size_t n_iters = n_bytes / (PACKET_DATA_SIZE - AES_BLOCK_SIZE);
-    size_t n_remaining_bytes = n_bytes % (PACKET_DATA_SIZE - AES_BLOCK_SIZE);
+    if (ipv4_session_lock(session, IPV4_SESSION_RX) == -1)
+        return -1;
 
-    char unsigned *cur_pos = buffer;
-    unsigned char encrypted_buffer[PACKET_DATA_SIZE];
-    unsigned char decrypted_buffer[PACKET_DATA_SIZE];
+    ssize_t recv_state = ipv4_receive_data_secure(socket_fd, buffer, n_bytes, connection_type, session);
+    ipv4_session_unlock(session, IPV4_SESSION_RX);
+
+    return recv_state;
+}
 
-    ssize_t n_encrypted_bytes_rem = (PACKET_DATA_SIZE - AES_BLOCK_SIZE) % AES_BLOCK_SIZE;
-    ssize_t n_encrypted_bytes = PACKET_DATA_SIZE - n_encrypted_bytes_rem;
+// Chunks of a large file are sent right from its mapping: the pages are read ahead by the
+// kernel and never copied, smaller files (or ones that can't be mapped) are read chunk by chunk.
+// Chunks are sent securely if there is a session, with kernel TLS the file goes by sendfile()
+static ssize_t ipv4_send_file_chunks(int socket_fd, int file_fd, size_t file_size, int connection_type, ipv4_session *session)
+{
+    if (ipv4_is_ktls(session, connection_type))
+        return ipv4_ktls_sendfile(socket_fd, file_fd, 0, file_size);
 
-    ssize_t n_last_encrypted_bytes_rem = n_remaining_bytes % AES_BLOCK_SIZE;
-    ssize_t n_last_encrypted_bytes =  n_remaining_bytes - n_last_encrypted_bytes_rem + AES_BLOCK_SIZE;
+    size_t chunk_size = (session != NULL) ? IPV4_FILE_CHUNK_SIZE_SECURE : IPV4_FILE_CHUNK_SIZE;
 
-    for (size_t i = 0; i < n_iters; ++i)
+    unsigned char *map = NULL;
+    if (file_size >= IPV4_FILE_MMAP_MIN_SIZE)
     {
-        ssize_t n_bytes = 0;
-        if (connection_type == SOCK_STREAM_UDT)
-            n_bytes = udt_recv(socket_fd, (char *) encrypted_buffer, n_encrypted_bytes);
+        map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file_fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
         else
-            n_bytes = read(socket_fd, encrypted_buffer, n_encrypted_bytes);
+            madvise(map, file_size, MADV_SEQUENTIAL);
+    }
 
-        if (n_bytes <= 0)
-            return -1;
+    unsigned char *buffer = NULL;
+    if (map == NULL && (buffer = malloc(chunk_size)) == NULL)
+        return -1;
 
-        int encryptedtext_len = decrypt_AES(encrypted_buffer, n_encrypted_bytes, decrypted_buffer, key);
-        if (encryptedtext_len == -1)
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    ssize_t n_sent_bytes = 0;
+    while (n_sent_bytes < file_size)
+    {
+        size_t n_chunk_bytes = (file_size - n_sent_bytes > chunk_size) ? chunk_size : file_size - n_sent_bytes;
+
+        const unsigned char *chunk = buffer;
+        if (map != NULL)
         {
-            syslog(LOG_ERR, "decrypt error");
-            return -1;
+            chunk = map + n_sent_bytes;
+
+            // The next chunk is being read while this one is sent
+            size_t next_offset = (n_sent_bytes + n_chunk_bytes) & ~(page_size - 1);
+            if (next_offset < file_size)
+                madvise(map + next_offset, (file_size - next_offset < chunk_size) ? file_size - next_offset : chunk_size, MADV_WILLNEED);
         }
+        else if (pread(file_fd, buffer, n_chunk_bytes, n_sent_bytes) != n_chunk_bytes)
+            break;
 
-        memcpy(cur_pos, decrypted_buffer, PACKET_DATA_SIZE - AES_BLOCK_SIZE);
+        ssize_t n_bytes = (session != NULL) ? ipv4_send_data_secure(socket_fd, chunk, n_chunk_bytes, connection_type, session)
+                                        : ipv4_send_data       (socket_fd, chunk, n_chunk_bytes, connection_type);
+        if (n_bytes == -1)
+            break;
 
-        n_recv_bytes += PACKET_DATA_SIZE - AES_BLOCK_SIZE;
-        cur_pos      += PACKET_DATA_SIZE - AES_BLOCK_SIZE;
+        n_sent_bytes += n_chunk_bytes;
     }
 
-    if (n_remaining_bytes > 0)
-    {
-        ssize_t n_bytes = 0;
-        if (connection_type == SOCK_STREAM_UDT)
-            n_bytes = udt_recv(socket_fd, (char *) encrypted_buffer, n_last_encrypted_bytes);
-        else
-            n_bytes = read(socket_fd, encrypted_buffer, n_last_encrypted_bytes);
+    if (map != NULL)
+        munmap(map, file_size);
+    free(buffer);
 
-        if (n_bytes <= 0)
-            return -1;
+    return (n_sent_bytes == file_size) ? n_sent_bytes : -1;
+}
+
+ssize_t ipv4_send_file_secure(int socket_fd, int file_fd, uint32_t *spare_fields, size_t spare_fields_size,
+                              char *spare_buffer1, size_t spare_buffer_size1, char *spare_buffer2, size_t spare_buffer_size2,
+                              int connection_type, ipv4_session *session)
+{
+    if (connection_type != SOCK_STREAM && connection_type != SOCK_DGRAM && connection_type != SOCK_STREAM_UDT)
+        return -1;
+
+    off_t file_size = get_file_size(file_fd);
+    if (file_size == -1)
+        return -1;
+
+    if (ipv4_session_lock(session, IPV4_SESSION_TX) == -1)
+        return -1;
 
-        int encryptedtext_len = decrypt_AES(encrypted_buffer, n_last_encrypted_bytes, decrypted_buffer, key);
-        if (encryptedtext_len == -1)
+    ssize_t send_state = ipv4_send_ctl_message_locked(socket_fd, IPV4_FILE_HEADER_TYPE, file_size, spare_fields, spare_fields_size,
+                                                      spare_buffer1, spare_buffer_size1, spare_buffer2, spare_buffer_size2, connection_type, session);
+    if (send_state != -1)
+        send_state = ipv4_send_file_chunks(socket_fd, file_fd, file_size, connection_type, session);
+
+    ipv4_session_unlock(session, IPV4_SESSION_TX);
+
+    return send_state;
+}
+
+ssize_t ipv4_receive_file_secure(int socket_fd, int file_fd, size_t n_bytes, int connection_type, ipv4_session *session)
+{
+    unsigned char *buffer = malloc(IPV4_FILE_CHUNK_SIZE_SECURE);
+    if (buffer == NULL)
+        return -1;
+
+    // Receive -> decrypt -> write a chunk at a time, nothing waits for the end of the file
+    ssize_t n_recv_bytes = 0;
+    while (n_recv_bytes < n_bytes)
+    {
+        size_t n_chunk_bytes = (n_bytes - n_recv_bytes > IPV4_FILE_CHUNK_SIZE_SECURE) ? IPV4_FILE_CHUNK_SIZE_SECURE : n_bytes - n_recv_bytes;
+
+        if (ipv4_receive_buffer_secure(socket_fd, buffer, n_chunk_bytes, connection_type, session) == -1 ||
+            ipv4_pwrite(file_fd, buffer, n_chunk_bytes, n_recv_bytes) == -1)
         {
-            syslog(LOG_ERR, "decrypt error");
+            free(buffer);
             return -1;
         }
 
-        memcpy(cur_pos, decrypted_buffer, n_remaining_bytes);
-
-        n_recv_bytes += n_remaining_bytes;
+        n_recv_bytes += n_chunk_bytes;
     }
 
+    free(buffer);
+
     return n_recv_bytes;
 }
 
-ssize_t ipv4_execute_DH_protocol(int socket_fd, unsigned char *secret, int is_initiator, const char *rsa_key_path, int connection_type)
+// Both sides tell whether their kernel takes TLS keys, the keys are set only if both do
+static int ipv4_negotiate_ktls(int socket_fd, ipv4_session *session, int is_initiator)
 {
-    if (secret == NULL)
+    uint64_t is_ktls = (ipv4_ktls_attach(socket_fd) == 0);
+
+    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_KTLS_OFFER_TYPE, is_ktls, NULL, 0, NULL, 0, NULL, 0, SOCK_STREAM, session);
+    if (ctl_msg_state == -1)
         return -1;
-    
-    DH *dh_struct = DH_new();
-    if (dh_struct == NULL)
+
+    ipv4_ctl_message ctl_message = {0};
+    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), SOCK_STREAM, session);
+    if (recv_bytes <= 0 || ctl_message.message_type != IPV4_KTLS_OFFER_TYPE)
         return -1;
 
-    BIGNUM *p = NULL;
-    BIGNUM *g = NULL;
-    BIGNUM *q = NULL;
-    unsigned char p_buffer[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    unsigned char g_buffer[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    unsigned char p_buffer_encrypted[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    unsigned char g_buffer_encrypted[IPV4_SPARE_BUFFER_LENGTH] = {0};
+    if (is_ktls == 0 || ctl_message.message_length == 0)
+        return 0;
 
-    ipv4_ctl_message ctl_message;
+    if (ipv4_ktls_install(socket_fd, session->secret, session->secret_size, is_initiator) == -1)
+    {
+        syslog(LOG_ERR, "kernel TLS keys couldn't be set: %s", strerror(errno));
+        return -1;
+    }
 
-    if (is_initiator == 0)
+    session->is_ktls = 1;
+    return 1;
+}
+
+typedef int (*ipv4_rsa_function)(const unsigned char *data, int data_len, unsigned char *result, const char *key_filename);
+
+// Parameters of a group by its id on the wire
+static EVP_PKEY *ipv4_DH_group_params(uint32_t group)
+{
+    const char *algorithm  = NULL;
+    const char *group_name = NULL;
+
+    switch (group)
     {
-        ssize_t recv_bytes = ipv4_receive_message(socket_fd, &ctl_message, sizeof(ctl_message), connection_type);
-        if (recv_bytes == -1 || recv_bytes == 0)
-            return -1;
+        case IPV4_DH_GROUP_FFDHE2048:
+            algorithm  = "DH";
+            group_name = "ffdhe2048";
+            break;
+
+        case IPV4_DH_GROUP_X25519:
+            algorithm  = "X25519";
+            group_name = "x25519";
+            break;
+
+        default:
+            return NULL;
+    }
 
-        private_decrypt_RSA_filename((unsigned char *) ctl_message.spare_buffer1, ctl_message.spare_fields[2], p_buffer, rsa_key_path);
-        private_decrypt_RSA_filename((unsigned char *) ctl_message.spare_buffer2, ctl_message.spare_fields[3], g_buffer, rsa_key_path);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, algorithm, NULL);
+    if (ctx == NULL)
+        return NULL;
 
-        p = BN_bin2bn(p_buffer, ctl_message.spare_fields[0], NULL);
-        g = BN_bin2bn(g_buffer, ctl_message.spare_fields[1], NULL);
+    EVP_PKEY *params = NULL;
+    if (EVP_PKEY_paramgen_init(ctx) != 1 || EVP_PKEY_CTX_set_group_name(ctx, group_name) != 1 || EVP_PKEY_paramgen(ctx, &params) != 1)
+        params = NULL;
 
-        if (p == NULL || g == NULL)
-            return -1;
+    EVP_PKEY_CTX_free(ctx);
 
-        DH_set0_pqg(dh_struct, p, NULL, g);
+    return params;
+}
+
+static EVP_PKEY *ipv4_DH_generate_key(EVP_PKEY *params)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_pkey(NULL, params, NULL);
+    if (ctx == NULL)
+        return NULL;
+
+    EVP_PKEY *key = NULL;
+    if (EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_keygen(ctx, &key) != 1)
+        key = NULL;
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return key;
+}
+
+// Returns the size of the secret
+static int ipv4_DH_derive(EVP_PKEY *key, uint32_t group, const unsigned char *alien_public_key, size_t alien_public_key_size, unsigned char *secret)
+{
+    EVP_PKEY *alien_key = ipv4_DH_group_params(group);
+    if (alien_key == NULL)
+        return -1;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_pkey(NULL, key, NULL);
+    if (ctx == NULL)
+    {
+        EVP_PKEY_free(alien_key);
+        return -1;
     }
-    else
+
+    // Secrets of the finite field group keep their leading zeros, so the size is the same for every connection
+    size_t secret_size = IPV4_SESSION_SECRET_LENGTH;
+    int is_derived = EVP_PKEY_set1_encoded_public_key(alien_key, alien_public_key, alien_public_key_size) == 1 &&
+                     EVP_PKEY_derive_init(ctx) == 1 &&
+                     (group != IPV4_DH_GROUP_FFDHE2048 || EVP_PKEY_CTX_set_dh_pad(ctx, 1) == 1) &&
+                     EVP_PKEY_derive_set_peer(ctx, alien_key) == 1 &&
+                     EVP_PKEY_derive(ctx, secret, &secret_size) == 1;
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(alien_key);
+
+    return is_derived ? (int) secret_size : -1;
+}
+
+// A public key fitting one RSA block goes in the first spare buffer,
+// a longer one (of the finite field group) in two halves: one per spare buffer
+static int ipv4_DH_seal_public_key(ipv4_rsa_function rsa_encrypt, const unsigned char *public_key, int public_key_size,
+                                   ipv4_ctl_message *ctl_message, const char *rsa_key_path)
+{
+    int half_size = (public_key_size > IPV4_SPARE_BUFFER_LENGTH / 2) ? public_key_size / 2 : public_key_size;
+
+    int size1 = rsa_encrypt(public_key, half_size, (unsigned char *) ctl_message->spare_buffer1, rsa_key_path);
+    if (size1 <= 0)
+        return -1;
+
+    int size2 = 0;
+    if (half_size < public_key_size)
     {
-        if (DH_generate_parameters_ex(dh_struct, 1024, DH_GENERATOR_2, NULL) != 1)
+        size2 = rsa_encrypt(public_key + half_size, public_key_size - half_size, (unsigned char *) ctl_message->spare_buffer2, rsa_key_path);
+        if (size2 <= 0)
             return -1;
+    }
 
-        int codes = -1;
-        if (DH_check(dh_struct, &codes) != 1)
-            return -1;
+    ctl_message->spare_fields[0] = size1;
+    ctl_message->spare_fields[1] = size2;
 
-        if (codes != 0)
-            return -1;
+    return 0;
+}
 
-        DH_get0_pqg(dh_struct, (const BIGNUM **) &p, (const BIGNUM **) &q, (const BIGNUM **) &g);
+static int ipv4_DH_open_public_key(ipv4_rsa_function rsa_decrypt, const ipv4_ctl_message *ctl_message,
+                                   unsigned char *public_key, const char *rsa_key_path)
+{
+    if (ctl_message->message_type != IPV4_ENCRYPTION_PUBKEY_TYPE ||
+        ctl_message->spare_fields[0] > IPV4_SPARE_BUFFER_LENGTH || ctl_message->spare_fields[1] > IPV4_SPARE_BUFFER_LENGTH)
+        return -1;
 
-        BN_bn2bin(p, p_buffer);
-        BN_bn2bin(g, g_buffer);
+    int size1 = rsa_decrypt((const unsigned char *) ctl_message->spare_buffer1, ctl_message->spare_fields[0], public_key, rsa_key_path);
+    if (size1 <= 0)
+        return -1;
 
-        uint32_t pg_sizes[4] = {BN_num_bytes(p), BN_num_bytes(g)};
+    if (ctl_message->spare_fields[1] == 0)
+        return size1;
 
-        pg_sizes[2] = public_encrypt_RSA_filename(p_buffer, pg_sizes[0], p_buffer_encrypted, rsa_key_path);
-        pg_sizes[3] = public_encrypt_RSA_filename(g_buffer, pg_sizes[1], g_buffer_encrypted, rsa_key_path);
+    int size2 = rsa_decrypt((const unsigned char *) ctl_message->spare_buffer2, ctl_message->spare_fields[1], public_key + size1, rsa_key_path);
+    if (size2 <= 0)
+        return -1;
 
-        int ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PG_NUM_TYPE, 0, pg_sizes, 4,
-                                                  (char *) p_buffer_encrypted, pg_sizes[2],
-                                                  (char *) g_buffer_encrypted, pg_sizes[3], connection_type);
-        if (ctl_msg_state == -1)
-            return -1;
-    }
+    return size1 + size2;
+}
+
+// State of the key exchange shared by its steps
+typedef struct
+{
+    uint32_t                group;
+    int                     is_initiator;
+    const char             *rsa_key_path;
+    EVP_PKEY               *key;
+    ipv4_ctl_message       *pubkey_message; // the public key of this side sealed by RSA
+    const ipv4_ctl_message *alien_message;  // the sealed public key of the other side
+    unsigned char          *secret;
+    int                     retval;
+} ipv4_DH_step;
+
+static ipv4_crypto_runner CRYPTO_RUNNER = NULL;
+
+void ipv4_set_crypto_runner(ipv4_crypto_runner crypto_runner)
+{
+    CRYPTO_RUNNER = crypto_runner;
+}
 
-    // Now both sides know p and g values
+// Returns the result of the step, -1 if the runner turned it away
+static int ipv4_DH_run_step(void (*step)(void *), ipv4_DH_step *state)
+{
+    state->retval = -1;
 
-    if (DH_generate_key(dh_struct) != 1) // generate private & public keys
+    if (CRYPTO_RUNNER == NULL)
+        step(state);
+    else if (CRYPTO_RUNNER(step, state) == -1)
         return -1;
 
-    const BIGNUM *public_key = DH_get0_pub_key(dh_struct);
-    if (public_key == NULL)
+    return state->retval;
+}
+
+// Generates the key pair and seals its public key
+static void ipv4_DH_make_key(void *arg)
+{
+    ipv4_DH_step *state = (ipv4_DH_step *) arg;
+
+    EVP_PKEY *params = ipv4_DH_group_params(state->group);
+    if (params == NULL)
+        return;
+
+    state->key = ipv4_DH_generate_key(params); // generate private & public keys
+    EVP_PKEY_free(params);
+
+    if (state->key == NULL)
+        return;
+
+    unsigned char *public_key = NULL;
+    size_t public_key_size = EVP_PKEY_get1_encoded_public_key(state->key, &public_key);
+
+    // The other side opens at most two RSA blocks
+    if (public_key_size > 0 && public_key_size <= 2 * IPV4_SPARE_BUFFER_LENGTH)
+        state->retval = ipv4_DH_seal_public_key(state->is_initiator ? public_encrypt_RSA_filename : private_encrypt_RSA_filename,
+                                                public_key, public_key_size, state->pubkey_message, state->rsa_key_path);
+
+    OPENSSL_free(public_key);
+}
+
+// Opens the public key of the other side and derives the secret
+static void ipv4_DH_make_secret(void *arg)
+{
+    ipv4_DH_step *state = (ipv4_DH_step *) arg;
+
+    unsigned char alien_public_key[2 * IPV4_SPARE_BUFFER_LENGTH] = {0};
+    int alien_public_key_size = ipv4_DH_open_public_key(state->is_initiator ? public_decrypt_RSA_filename : private_decrypt_RSA_filename,
+                                                        state->alien_message, alien_public_key, state->rsa_key_path);
+    if (alien_public_key_size > 0)
+        state->retval = ipv4_DH_derive(state->key, state->group, alien_public_key, alien_public_key_size, state->secret);
+}
+
+// A cipher chosen by the initiator is one this side offered
+static int ipv4_DH_is_offered(const uint32_t *ciphers, size_t n_ciphers, uint32_t cipher)
+{
+    for (size_t i = 0; i < n_ciphers; ++i)
+        if (ciphers[i] == cipher)
+            return 1;
+
+    return 0;
+}
+
+// Exchanges public keys and settles on the record cipher out of the offered ones, returns the size of the secret.
+// Only the steps taking CPU time go to the crypto runner, messages are waited for by the caller
+static int ipv4_DH_exchange_keys(int socket_fd, uint32_t group, unsigned char *secret, int *cipher, uint32_t *ciphers, size_t *n_ciphers,
+                                 int is_initiator, const char *rsa_key_path, int connection_type)
+{
+    // The other side offers its record ciphers from its fastest one and the initiator chooses one of them:
+    // the sizes of the key halves, the number of ciphers and the ciphers
+    ipv4_ctl_message ctl_message = {0};
+    ipv4_ctl_message pubkey_message = {0};
+
+    ipv4_DH_step state = {.group = group, .is_initiator = is_initiator, .rsa_key_path = rsa_key_path,
+                          .pubkey_message = &pubkey_message, .alien_message = &ctl_message, .secret = secret};
+
+    *cipher    = -1;
+    *n_ciphers = 0;
+
+    if (ipv4_DH_run_step(ipv4_DH_make_key, &state) == -1)
+    {
+        EVP_PKEY_free(state.key);
         return -1;
+    }
+
+    if (is_initiator == 0)
+    {
+        pubkey_message.spare_fields[2] = ipv4_session_ciphers(ciphers, IPV4_N_CIPHERS);
+        memcpy(pubkey_message.spare_fields + 3, ciphers, pubkey_message.spare_fields[2] * sizeof(uint32_t));
+
+        ssize_t recv_bytes = -1;
+        if (ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PUBKEY_TYPE, 0, pubkey_message.spare_fields, pubkey_message.spare_fields[2] + 3,
+                                  pubkey_message.spare_buffer1, pubkey_message.spare_fields[0],
+                                  pubkey_message.spare_buffer2, pubkey_message.spare_fields[1], connection_type) != -1)
+            recv_bytes = ipv4_receive_message(socket_fd, &ctl_message, sizeof(ctl_message), connection_type);
+
+        // A choice out of the offer can only be made by someone in the middle
+        if (recv_bytes > 0 && ipv4_DH_is_offered(ciphers, pubkey_message.spare_fields[2], ctl_message.spare_fields[2]))
+        {
+            *cipher    = ctl_message.spare_fields[2];
+            *n_ciphers = pubkey_message.spare_fields[2];
+        }
+    }
+    else
+    {
+        ssize_t recv_bytes = ipv4_receive_message(socket_fd, &ctl_message, sizeof(ctl_message), connection_type);
 
-    unsigned char public_key_buffer[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    unsigned char public_key_buffer_encrypted[IPV4_SPARE_BUFFER_LENGTH] = {0};
+        uint32_t n_offered_ciphers = ctl_message.spare_fields[2];
+        if (recv_bytes > 0 && n_offered_ciphers <= IPV4_N_CIPHERS)
+        {
+            *cipher    = ipv4_session_choose_cipher(ctl_message.spare_fields + 3, n_offered_ciphers);
+            *n_ciphers = n_offered_ciphers;
+            memcpy(ciphers, ctl_message.spare_fields + 3, n_offered_ciphers * sizeof(uint32_t));
+        }
 
+        pubkey_message.spare_fields[2] = *cipher;
 
-    BN_bn2bin(public_key, public_key_buffer);
+        if (*cipher != -1 &&
+            ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PUBKEY_TYPE, 0, pubkey_message.spare_fields, 3,
+                                  pubkey_message.spare_buffer1, pubkey_message.spare_fields[0],
+                                  pubkey_message.spare_buffer2, pubkey_message.spare_fields[1], connection_type) == -1)
+            *cipher = -1;
+    }
 
-    // Exchange public keys
+    int secret_size = -1;
+    if (*cipher != -1)
+        secret_size = ipv4_DH_run_step(ipv4_DH_make_secret, &state);
 
-    int decrypted_size = -1;
+    EVP_PKEY_free(state.key);
+
+    return secret_size;
+}
+
+// The other side opens with a nonce and the ticket of its last session if it has one, the initiator resumes
+// that session or names the group of a full handshake. Returns 1 for the resumed session and 0 for the group
+static int ipv4_DH_hello(int socket_fd, ipv4_session *session, const ipv4_ticket *ticket, uint32_t *group,
+                         int is_initiator, int connection_type)
+{
+    unsigned char nonce[IPV4_TICKET_NONCE_LENGTH];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+        return -1;
+
+    ipv4_ctl_message ctl_message = {0};
 
     if (is_initiator == 0)
     {
-        uint32_t public_key_size = private_encrypt_RSA_filename(public_key_buffer, BN_num_bytes(public_key), public_key_buffer_encrypted, rsa_key_path);
+        uint32_t sealed_size = ipv4_ticket_is_valid(ticket) ? IPV4_TICKET_SEALED_SIZE : 0;
+        char *sealed = (sealed_size != 0) ? (char *) ticket->sealed : NULL;
 
-        int ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PUBKEY_TYPE, 0, &public_key_size, 1,
-                                                  (char *) public_key_buffer_encrypted, public_key_size, NULL, 0, connection_type);
+        int ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_HELLO_TYPE, 0, &sealed_size, 1, sealed, sealed_size,
+                                                  (char *) nonce, sizeof(nonce), connection_type);
         if (ctl_msg_state == -1)
             return -1;
 
@@ -667,32 +1153,138 @@ ssize_t ipv4_execute_DH_protocol(int socket_fd, unsigned char *secret, int is_in
         if (recv_bytes == -1 || recv_bytes == 0)
             return -1;
 
-        decrypted_size = private_decrypt_RSA_filename((unsigned char *) ctl_message.spare_buffer1, ctl_message.spare_fields[0], public_key_buffer, rsa_key_path);
+        if (ctl_message.message_type == IPV4_ENCRYPTION_PG_NUM_TYPE)
+        {
+            *group = ctl_message.spare_fields[0];
+            return 0;
+        }
+
+        if (ctl_message.message_type != IPV4_ENCRYPTION_RESUME_TYPE || sealed_size == 0)
+            return -1;
+
+        return (ipv4_ticket_resume(session, ticket, nonce, (unsigned char *) ctl_message.spare_buffer2, is_initiator) == 0) ? 1 : -1;
     }
+
+    ssize_t recv_bytes = ipv4_receive_message(socket_fd, &ctl_message, sizeof(ctl_message), connection_type);
+    if (recv_bytes == -1 || recv_bytes == 0 || ctl_message.message_type != IPV4_ENCRYPTION_HELLO_TYPE)
+        return -1;
+
+    ipv4_ticket alien_ticket = {0};
+    int is_resumed = 0;
+
+    if (ctl_message.spare_fields[0] == IPV4_TICKET_SEALED_SIZE)
+    {
+        memcpy(alien_ticket.sealed, ctl_message.spare_buffer1, IPV4_TICKET_SEALED_SIZE);
+        is_resumed = (ipv4_ticket_open(&alien_ticket) == 0 &&
+                      ipv4_ticket_resume(session, &alien_ticket, nonce, (unsigned char *) ctl_message.spare_buffer2, is_initiator) == 0);
+        OPENSSL_cleanse(&alien_ticket, sizeof(alien_ticket));
+    }
+
+    int ctl_msg_state = -1;
+    if (is_resumed)
+        ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_RESUME_TYPE, 0, NULL, 0, NULL, 0, (char *) nonce, sizeof(nonce), connection_type);
     else
+        ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PG_NUM_TYPE, 0, group, 1, NULL, 0, NULL, 0, connection_type);
+
+    if (ctl_msg_state == -1)
     {
-        uint32_t public_key_size = public_encrypt_RSA_filename(public_key_buffer, BN_num_bytes(public_key), public_key_buffer_encrypted, rsa_key_path);
+        ipv4_session_destroy(session);
+        return -1;
+    }
 
-        ssize_t recv_bytes = ipv4_receive_message(socket_fd, &ctl_message, sizeof(ctl_message), connection_type);
-        if (recv_bytes == -1 || recv_bytes == 0)
-            return -1;
+    return is_resumed;
+}
 
-        int ctl_msg_state = ipv4_send_ctl_message(socket_fd, IPV4_ENCRYPTION_PUBKEY_TYPE, 0, &public_key_size, 1,
-                                                  (char *) public_key_buffer_encrypted, public_key_size, NULL, 0, connection_type);
-        if (ctl_msg_state == -1)
-            return -1;
+// The initiator gives a ticket for the next connection to the other side, which keeps it if it asks for it
+static int ipv4_DH_issue_ticket(int socket_fd, ipv4_session *session, ipv4_ticket *ticket, int is_initiator, int connection_type)
+{
+    ipv4_ticket new_ticket = {0};
+    int ticket_state = ipv4_ticket_init(&new_ticket, session, is_initiator);
+
+    if (is_initiator)
+    {
+        // A ticket of no size if it couldn't be made, the other side waits for it anyway
+        size_t sealed_size = (ticket_state == 0) ? IPV4_TICKET_SEALED_SIZE : 0;
+
+        int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_ENCRYPTION_TICKET_TYPE, sealed_size, NULL, 0,
+                                                         (char *) new_ticket.sealed, sealed_size, NULL, 0, connection_type, session);
+        OPENSSL_cleanse(&new_ticket, sizeof(new_ticket));
 
-        decrypted_size = public_decrypt_RSA_filename((unsigned char *) ctl_message.spare_buffer1, ctl_message.spare_fields[0], public_key_buffer, rsa_key_path);
+        return ctl_msg_state;
     }
 
-    BIGNUM *alien_public_key = BN_bin2bn(public_key_buffer, decrypted_size, NULL);
-    if (alien_public_key == NULL)
+    ipv4_ctl_message ctl_message = {0};
+    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, session);
+    if (recv_bytes <= 0 || ctl_message.message_type != IPV4_ENCRYPTION_TICKET_TYPE)
+    {
+        OPENSSL_cleanse(&new_ticket, sizeof(new_ticket));
         return -1;
+    }
 
-    int secret_size = DH_compute_key(secret, alien_public_key, dh_struct);
+    if (ticket != NULL)
+    {
+        memset(ticket, 0, sizeof(ipv4_ticket));
 
-    DH_free(dh_struct);
-    BN_free(alien_public_key);
+        if (ticket_state == 0 && ctl_message.message_length == IPV4_TICKET_SEALED_SIZE)
+        {
+            memcpy(new_ticket.sealed, ctl_message.spare_buffer1, IPV4_TICKET_SEALED_SIZE);
+            memcpy(ticket, &new_ticket, sizeof(ipv4_ticket));
+        }
+    }
 
-    return secret_size;
+    OPENSSL_cleanse(&new_ticket, sizeof(new_ticket));
+
+    return 0;
+}
+
+ssize_t ipv4_execute_DH_protocol(int socket_fd, ipv4_session *session, ipv4_ticket *ticket, int is_initiator, const char *rsa_key_path, int connection_type)
+{
+    if (session == NULL)
+        return -1;
+
+    // The initiator names one of the fixed groups, so no side spends time on parameters of its own
+    // and the other side takes only a group it knows
+    uint32_t group = IPV4_DH_GROUP;
+
+    int is_resumed = ipv4_DH_hello(socket_fd, session, ticket, &group, is_initiator, connection_type);
+    if (is_resumed == -1)
+        return -1;
+
+    if (is_resumed == 0)
+    {
+        unsigned char secret[IPV4_SESSION_SECRET_LENGTH] = {0};
+        int cipher = -1;
+
+        // The offer the cipher is chosen out of
+        uint32_t ciphers[IPV4_N_CIPHERS] = {0};
+        size_t n_ciphers = 0;
+
+        int secret_size = ipv4_DH_exchange_keys(socket_fd, group, secret, &cipher, ciphers, &n_ciphers, is_initiator, rsa_key_path, connection_type);
+        if (secret_size <= 0)
+        {
+            OPENSSL_cleanse(secret, sizeof(secret));
+            return -1;
+        }
+
+        // Contexts of the session are made once and kept for the whole connection
+        int session_state = ipv4_session_init(session, secret, secret_size, cipher, ciphers, n_ciphers, is_initiator);
+        OPENSSL_cleanse(secret, sizeof(secret));
+
+        if (session_state == -1)
+            return -1;
+    }
+
+    if (connection_type == SOCK_STREAM && ipv4_negotiate_ktls(socket_fd, session, is_initiator) == -1)
+    {
+        ipv4_session_destroy(session);
+        return -1;
+    }
+
+    if (ipv4_DH_issue_ticket(socket_fd, session, ticket, is_initiator, connection_type) == -1)
+    {
+        ipv4_session_destroy(session);
+        return -1;
+    }
+
+    return session->secret_size;
 }
@@ -38,6 +38,10 @@
 #include <fcntl.h>
 
 #include "ipv4_net_config.h"
+#include "ipv4_pool.h"
+#include "ipv4_ktls.h"
+#include "ipv4_session.h"
+#include "ipv4_ticket.h"
 #include "udt.h"
 
 // IPv4 control message parameters
@@ -55,6 +59,14 @@
 #define IPV4_USERS_LIST_REQUEST_TYPE 7UL
 #define IPV4_ENCRYPTION_PG_NUM_TYPE  8UL
 #define IPV4_ENCRYPTION_PUBKEY_TYPE  9UL
+#define IPV4_KTLS_OFFER_TYPE         10UL
+#define IPV4_ENCRYPTION_HELLO_TYPE   11UL
+#define IPV4_ENCRYPTION_RESUME_TYPE  12UL
+#define IPV4_ENCRYPTION_TICKET_TYPE  13UL
+
+// Key exchange groups of the handshake: the fixed finite field group of RFC 7919 and X25519
+#define IPV4_DH_GROUP_FFDHE2048      1UL
+#define IPV4_DH_GROUP_X25519         2UL
 
 // IPv4 control message structure
 
@@ -107,18 +119,29 @@ int     ipv4_send_ctl_message        (int socket_fd,          uint64_t msg_type,
 
 int     ipv4_send_ctl_message_secure (int socket_fd,         uint64_t msg_type,          uint64_t msg_length, 
                                      uint32_t *spare_fields, size_t spare_fields_size,   char *spare_buffer1, size_t spare_buffer_size1,
-                                     char *spare_buffer2,    size_t spare_buffer_size2,  int connection_type, unsigned char *key);
+                                     char *spare_buffer2,    size_t spare_buffer_size2,  int connection_type, ipv4_session *session);
 
-ssize_t ipv4_send_message_secure    (int socket_fd, const void *buffer, size_t n_bytes,  int connection_type, unsigned char *key);
-ssize_t ipv4_receive_message_secure (int socket_fd,       void *buffer, size_t n_bytes,  int connection_type, unsigned char *key);
-int     ipv4_close_secure           (int socket_fd,                                      int connection_type, unsigned char *key);
+ssize_t ipv4_send_message_secure    (int socket_fd, const void *buffer, size_t n_bytes,  int connection_type, ipv4_session *session);
+ssize_t ipv4_receive_message_secure (int socket_fd,       void *buffer, size_t n_bytes,  int connection_type, ipv4_session *session);
+int     ipv4_close_secure           (int socket_fd,                                      int connection_type, ipv4_session *session);
 
-ssize_t ipv4_receive_buffer_secure  (int socket_fd,       void *buffer, size_t n_bytes,  int connection_type, unsigned char *key);
+ssize_t ipv4_receive_buffer_secure  (int socket_fd,       void *buffer, size_t n_bytes,  int connection_type, ipv4_session *session);
 
 ssize_t ipv4_send_buffer_secure     (int socket_fd, const void *buffer, size_t n_bytes,  int msg_type,
                                      uint32_t *spare_fields, size_t spare_fields_size,   char *spare_buffer1, size_t spare_buffer_size1,
-                                     char *spare_buffer2,    size_t spare_buffer_size2,  int connection_type, unsigned char *key);
+                                     char *spare_buffer2,    size_t spare_buffer_size2,  int connection_type, ipv4_session *session);
+
+ssize_t ipv4_send_file_secure       (int socket_fd, int file_fd,
+                                     uint32_t *spare_fields, size_t spare_fields_size,   char *spare_buffer1, size_t spare_buffer_size1,
+                                     char *spare_buffer2,    size_t spare_buffer_size2,  int connection_type, ipv4_session *session);
+ssize_t ipv4_receive_file_secure    (int socket_fd, int file_fd, size_t n_bytes,         int connection_type, ipv4_session *session);
+
+ssize_t ipv4_execute_DH_protocol    (int socket_fd, ipv4_session *session, ipv4_ticket *ticket, int is_initiator, const char *rsa_key_path, int connection_type);
+
+// Runs a step of the key exchange that takes CPU time (key generation, RSA, derivation) and returns once
+// it is done, -1 if the step is turned away. Without a runner the steps are run by the calling thread
+typedef int (*ipv4_crypto_runner)(void (*step)(void *), void *arg);
 
-ssize_t ipv4_execute_DH_protocol    (int socket_fd, unsigned char *secret, int is_initiator, const char *rsa_key_path, int connection_type);
+void    ipv4_set_crypto_runner      (ipv4_crypto_runner crypto_runner);
 
 #endif // !IPV4_NET_H_
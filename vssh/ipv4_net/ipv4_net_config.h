@@ -27,6 +27,10 @@
 #define UDT_SECONDS_TIMEOUT_CONN  2
 #define UDT_USECONDS_TIMEOUT_CONN 0
 
+// UDT server parameters
+// Connections of the listening socket are found by the address and the socket id of the peer
+#define UDT_CONN_TABLE_SIZE 4096 // buckets
+
 // UDT server connection parameters (already connected)
 // The maximum possible amount of time being unactive in connection -> disconnection
 #define UDT_SECONDS_TIMEOUT_SERVER  180
@@ -38,19 +42,94 @@
 #define UDT_USECONDS_TIMEOUT_CLIENT 0
 
 // UDT send parameters (already connected)
-// The maximum possible amount of time being unactive while sending -> disconnection
+// The maximum possible amount of time without acknowledgement while sending
+// is UDT_SECONDS_TIMEOUT_SEND * UDT_N_MAX_ATTEMPTS_SEND -> disconnection
 #define UDT_SECONDS_TIMEOUT_SEND  50
 #define UDT_USECONDS_TIMEOUT_SEND 0
 #define UDT_N_MAX_ATTEMPTS_SEND   3
 
+// UDT timers (already connected)
+// Receiver-thread checks retransmission, NAK and inactivity timers at least once per tick,
+// retransmission timeout is computed from round-trip time and kept between MIN and MAX
+#define UDT_USECONDS_TIMER_TICK  1000
+#define UDT_USECONDS_INITIAL_RTT 100000
+#define UDT_USECONDS_MIN_RTO     5000
+#define UDT_USECONDS_MAX_RTO     2000000
+
+// UDT send window parameters
+// The maximum amount of sent packets waiting for acknowledgement at the same time
+#define UDT_SEND_WINDOW_SIZE     64
+#define UDT_MAX_SEND_WINDOW_SIZE 8192
+#define UDT_INITIAL_SEQNUM       0x123123
+
+// UDT receive window parameters
+// The maximum amount of packets received ahead of the expected one being kept until reassembly
+#define UDT_RECV_WINDOW_SIZE UDT_SEND_WINDOW_SIZE
+
+// UDT I/O parameters
+// Receiver-thread and sender-thread move up to BATCH datagrams per system call,
+// with OFFLOAD consecutive packets are sent and received as one UDP GSO/GRO datagram
+// of OFFLOAD_SIZE at most, it falls back to plain datagrams when the kernel refuses
+#define UDT_IO_BATCH_SIZE   16
+#define UDT_IO_OFFLOAD      1
+#define UDT_IO_OFFLOAD_SIZE 65000
+
+// UDT buffer parameters
+// Packets to be sent and data delivered to the application wait in preallocated rings
+// of SIZE bytes (a power of two), a packet not fitting into a full ring is sent again
+#define UDT_SEND_BUFFER_SIZE (1 << 20)
+#define UDT_RECV_BUFFER_SIZE (1 << 20)
+
+// UDT path MTU discovery parameters (datagram bytes without IP and UDP headers)
+// Data packets are of BASE size until the peer answers a larger probe, a size fails after
+// MAX_PROBES probes without answer, the search for a larger size repeats after RAISE_TIMEOUT
+#define UDT_PLPMTU_BASE          1200
+#define UDT_PLPMTU_MAX_PROBES    3
+#define UDT_PLPMTU_RAISE_TIMEOUT 600 // seconds
+
+// UDT congestion control parameters
+// Rate control runs once per SYN, probing packet pairs estimate the link capacity
+#define UDT_CCC_DEFAULT            UDT_CC_NATIVE
+#define UDT_CCC_SYN_INTERVAL       10000 // microseconds
+#define UDT_CCC_INITIAL_CWND       16
+#define UDT_CCC_MIN_CWND           2
+#define UDT_CCC_PACING_GRANULARITY 100   // microseconds
+#define UDT_CCC_PROBE_INTERVAL     16    // packets
+#define UDT_CCC_N_INTERVALS        16
+
 // UDT read parameters (activate after first received packet)
 // The maximum possible amount of time being unactive while receiving -> disconnection
 #define UDT_SECONDS_TIMEOUT_READ  UDT_SECONDS_TIMEOUT_SEND  * UDT_N_MAX_ATTEMPTS_SEND
 #define UDT_USECONDS_TIMEOUT_READ UDT_USECONDS_TIMEOUT_SEND * UDT_N_MAX_ATTEMPTS_SEND
 
+// Packet pool parameters
+// Each thread caches up to POOL_SIZE buffers for messages of the secure API, a buffer
+// takes a message of PACKET_DATA_SIZE with its cipher padding
+#define IPV4_POOL_SIZE        16
+#define IPV4_POOL_BUFFER_SIZE (PACKET_DATA_SIZE + 16)
+
+// File transfer parameters
+// Files are read and written in chunks of N_CHUNK_PIECES pieces of PACKET_DATA_SIZE (less
+// the cipher padding for the secure API), a transfer holds a single chunk in memory.
+// Files of MMAP_MIN_SIZE and larger are sent from their mapping instead
+#define IPV4_FILE_N_CHUNK_PIECES 64
+#define IPV4_FILE_MMAP_MIN_SIZE  (1 << 20)
+
+// Handshake parameters
+// The initiator names the key exchange group (IPV4_DH_GROUP_*), the other side takes any of them
+#define IPV4_DH_GROUP IPV4_DH_GROUP_X25519
+
+// Session ticket parameters
+// A ticket resumes sessions of the other side for LIFETIME seconds after its handshake
+#define IPV4_TICKET_LIFETIME 3600 // seconds
+
 // TCP parameters
 #define TCP_N_MAX_PENDING_CONNECTIONS 1024
 
+// Kernel TLS parameters
+// Records of TCP connections are encrypted by the kernel if both sides have kernel TLS
+#define IPV4_KTLS_ENABLED 1
+
 // General parameters
 #define PACKET_DATA_SIZE BUFSIZ
 #define N_MAX_FILENAME_LEN 1024
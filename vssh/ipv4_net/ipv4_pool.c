@@ -0,0 +1,127 @@
+#include "ipv4_net_config.h"
+#include "ipv4_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef struct _ipv4_pool_buffer ipv4_pool_buffer_t;
+struct _ipv4_pool_buffer
+{
+    ipv4_pool_buffer_t *next; // in the cache of a thread
+    size_t size;
+
+    _Alignas(16) unsigned char data[];
+};
+
+typedef struct
+{
+    ipv4_pool_buffer_t *first;
+    size_t n_buffers;
+} ipv4_pool_cache_t;
+
+#define pool_buffer(data)                                                  \
+    ((ipv4_pool_buffer_t *) ((data) - offsetof(ipv4_pool_buffer_t, data)))
+
+static pthread_key_t  POOL_KEY;
+static pthread_once_t POOL_ONCE = PTHREAD_ONCE_INIT;
+
+static atomic_uint_fast64_t N_HITS   = 0;
+static atomic_uint_fast64_t N_MISSES = 0;
+
+static void ipv4_pool_cache_free(void *arg)
+{
+    ipv4_pool_cache_t *cache = (ipv4_pool_cache_t *) arg;
+
+    while (cache->first != NULL)
+    {
+        ipv4_pool_buffer_t *next = cache->first->next;
+        free(cache->first);
+        cache->first = next;
+    }
+
+    free(cache);
+}
+
+static void ipv4_pool_key_create()
+{
+    pthread_key_create(&POOL_KEY, ipv4_pool_cache_free); // caches are freed when their threads exit
+}
+
+static ipv4_pool_cache_t *ipv4_pool_cache()
+{
+    pthread_once(&POOL_ONCE, ipv4_pool_key_create);
+
+    ipv4_pool_cache_t *cache = (ipv4_pool_cache_t *) pthread_getspecific(POOL_KEY);
+    if (cache == NULL)
+    {
+        cache = (ipv4_pool_cache_t *) calloc(1, sizeof(ipv4_pool_cache_t));
+        if (cache != NULL && pthread_setspecific(POOL_KEY, cache) != 0)
+        {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    return cache;
+}
+
+unsigned char *ipv4_pool_get(size_t size)
+{
+    ipv4_pool_cache_t  *cache  = (size <= IPV4_POOL_BUFFER_SIZE) ? ipv4_pool_cache() : NULL;
+    ipv4_pool_buffer_t *buffer = NULL;
+
+    if (cache != NULL && cache->first != NULL)
+    {
+        buffer = cache->first;
+        cache->first = buffer->next;
+        cache->n_buffers--;
+
+        atomic_fetch_add_explicit(&N_HITS, 1, memory_order_relaxed);
+    }
+    else
+    {
+        // Buffers of the pool size may be cached when they are put
+        size_t buffer_size = (size <= IPV4_POOL_BUFFER_SIZE) ? IPV4_POOL_BUFFER_SIZE : size;
+
+        buffer = (ipv4_pool_buffer_t *) malloc(sizeof(ipv4_pool_buffer_t) + buffer_size);
+        if (buffer == NULL)
+            return NULL;
+
+        buffer->size = buffer_size;
+
+        atomic_fetch_add_explicit(&N_MISSES, 1, memory_order_relaxed);
+    }
+
+    buffer->next = NULL;
+
+    return buffer->data;
+}
+
+void ipv4_pool_put(unsigned char *data)
+{
+    if (data == NULL)
+        return;
+
+    ipv4_pool_buffer_t *buffer = pool_buffer(data);
+    ipv4_pool_cache_t *cache = (buffer->size == IPV4_POOL_BUFFER_SIZE) ? ipv4_pool_cache() : NULL;
+    if (cache == NULL || cache->n_buffers >= IPV4_POOL_SIZE)
+    {
+        free(buffer);
+        return;
+    }
+
+    buffer->next = cache->first;
+    cache->first = buffer;
+    cache->n_buffers++;
+}
+
+void ipv4_pool_stats(uint64_t *n_hits, uint64_t *n_misses)
+{
+    if (n_hits != NULL)
+        *n_hits = atomic_load_explicit(&N_HITS, memory_order_relaxed);
+
+    if (n_misses != NULL)
+        *n_misses = atomic_load_explicit(&N_MISSES, memory_order_relaxed);
+}
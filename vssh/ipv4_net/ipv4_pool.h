@@ -0,0 +1,22 @@
+#ifndef IPV4_POOL_H_
+#define IPV4_POOL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The packet buffer pool
+ *
+ * Buffers of IPV4_POOL_BUFFER_SIZE bytes are cached by every thread, up to
+ * IPV4_POOL_SIZE of them, so sessions served by their own threads don't
+ * meet in the allocator. A buffer goes back to the cache of the thread
+ * putting it. Larger buffers and those beyond a full cache go to the heap.
+ * Hits and misses of all threads are counted.
+ */
+
+unsigned char *ipv4_pool_get  (size_t size);
+void           ipv4_pool_put  (unsigned char *buffer);
+
+void           ipv4_pool_stats(uint64_t *n_hits, uint64_t *n_misses);
+
+#endif // !IPV4_POOL_H_
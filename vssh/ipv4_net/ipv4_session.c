@@ -0,0 +1,330 @@
+#include "ipv4_session.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/kdf.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Key and initial vector of a direction
+#define SESSION_KEY_MATERIAL_SIZE (IPV4_SESSION_KEY_LENGTH + IPV4_SESSION_NONCE_LENGTH)
+
+// Ciphers of the longest offer and the chosen one
+#define SESSION_TRANSCRIPT_SIZE ((IPV4_N_CIPHERS + 1) * sizeof(uint32_t))
+
+static const EVP_CIPHER *ipv4_session_evp(int cipher)
+{
+    switch (cipher)
+    {
+        case IPV4_CIPHER_AES_256_GCM:
+            return EVP_aes_256_gcm();
+
+        case IPV4_CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+
+        case IPV4_CIPHER_AES_128_GCM:
+            return EVP_aes_128_gcm();
+
+        default:
+            return NULL;
+    }
+}
+
+// The context already has its cipher, key and direction
+static int ipv4_session_run(EVP_CIPHER_CTX *ctx, const unsigned char *iv, uint64_t seqnum, int is_encrypt,
+                            const unsigned char *in, int in_len, unsigned char *out)
+{
+    unsigned char nonce[IPV4_SESSION_NONCE_LENGTH];
+    memcpy(nonce, iv, IPV4_SESSION_NONCE_LENGTH);
+
+    for (int i = 0; i < 8; ++i)
+        nonce[IPV4_SESSION_NONCE_LENGTH - 1 - i] ^= (unsigned char) (seqnum >> (8 * i));
+
+    int data_len = is_encrypt ? in_len : in_len - IPV4_SESSION_TAG_SIZE;
+    if (data_len < 0)
+        return -1;
+
+    int len = 0;
+
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, -1) != 1)
+        return -1;
+
+    if (EVP_CipherUpdate(ctx, out, &len, in, data_len) != 1)
+        return -1;
+
+    if (is_encrypt == 0 && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, IPV4_SESSION_TAG_SIZE, (void *) (in + data_len)) != 1)
+        return -1;
+
+    // Fails if the tag doesn't match
+    if (EVP_CipherFinal_ex(ctx, out + len, &len) != 1)
+        return -1;
+
+    if (is_encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, IPV4_SESSION_TAG_SIZE, out + data_len) != 1)
+        return -1;
+
+    return is_encrypt ? data_len + IPV4_SESSION_TAG_SIZE : data_len;
+}
+
+// Ciphers of the offer followed by the chosen one, each in network byte order
+static size_t ipv4_session_transcript(unsigned char *transcript, const uint32_t *ciphers, size_t n_ciphers, int cipher)
+{
+    size_t transcript_size = 0;
+    for (size_t i = 0; i <= n_ciphers; ++i)
+    {
+        uint32_t value = htonl((i < n_ciphers) ? ciphers[i] : (uint32_t) cipher);
+        memcpy(transcript + transcript_size, &value, sizeof(value));
+        transcript_size += sizeof(value);
+    }
+
+    return transcript_size;
+}
+
+static int ipv4_session_direction_init(ipv4_session_direction *direction, const ipv4_session *session, const char *label,
+                                       const unsigned char *salt, size_t salt_size, int is_encrypt)
+{
+    unsigned char material[SESSION_KEY_MATERIAL_SIZE];
+    if (ipv4_session_derive(material, sizeof(material), session->secret, session->secret_size, salt, salt_size, label) == -1)
+        return -1;
+
+    memcpy(direction->key, material, IPV4_SESSION_KEY_LENGTH);
+    memcpy(direction->iv,  material + IPV4_SESSION_KEY_LENGTH, IPV4_SESSION_NONCE_LENGTH);
+    OPENSSL_cleanse(material, sizeof(material));
+
+    direction->seqnum = 0;
+
+    direction->ctx = EVP_CIPHER_CTX_new();
+    if (direction->ctx == NULL)
+        return -1;
+
+    if (EVP_CipherInit_ex(direction->ctx, ipv4_session_evp(session->cipher), NULL, direction->key, NULL, is_encrypt) != 1)
+    {
+        EVP_CIPHER_CTX_free(direction->ctx);
+        direction->ctx = NULL;
+        return -1;
+    }
+
+    pthread_mutex_init(&(direction->mutex), NULL);
+
+    return 0;
+}
+
+static void ipv4_session_direction_destroy(ipv4_session_direction *direction)
+{
+    if (direction->ctx == NULL)
+        return;
+
+    EVP_CIPHER_CTX_free(direction->ctx);
+    direction->ctx = NULL;
+
+    pthread_mutex_destroy(&(direction->mutex));
+}
+
+int ipv4_session_init(ipv4_session *session, const unsigned char *secret, size_t secret_size, int cipher,
+                      const uint32_t *ciphers, size_t n_ciphers, int is_initiator)
+{
+    if (session == NULL || secret == NULL || (ciphers == NULL && n_ciphers != 0))
+        return -1;
+
+    memset(session, 0, sizeof(ipv4_session));
+
+    if (secret_size == 0 || secret_size > IPV4_SESSION_SECRET_LENGTH || n_ciphers > IPV4_N_CIPHERS || ipv4_session_evp(cipher) == NULL)
+        return -1;
+
+    memcpy(session->secret, secret, secret_size);
+    session->secret_size = secret_size;
+    session->cipher      = cipher;
+
+    // The initiator is the server: it sends with the server key and receives with the client one
+    const char *tx_label = is_initiator ? "vssh record server" : "vssh record client";
+    const char *rx_label = is_initiator ? "vssh record client" : "vssh record server";
+
+    // The offer and the choice salt the keys: if either is changed on the way, the sides get different keys
+    unsigned char transcript[SESSION_TRANSCRIPT_SIZE];
+    size_t transcript_size = ipv4_session_transcript(transcript, ciphers, n_ciphers, cipher);
+
+    if (ipv4_session_direction_init(&(session->tx), session, tx_label, transcript, transcript_size, 1) == -1 ||
+        ipv4_session_direction_init(&(session->rx), session, rx_label, transcript, transcript_size, 0) == -1)
+    {
+        ipv4_session_direction_destroy(&(session->tx));
+        ipv4_session_direction_destroy(&(session->rx));
+        OPENSSL_cleanse(session, sizeof(ipv4_session));
+        return -1;
+    }
+
+    return 0;
+}
+
+void ipv4_session_destroy(ipv4_session *session)
+{
+    if (session == NULL || session->tx.ctx == NULL)
+        return;
+
+    ipv4_session_direction_destroy(&(session->tx));
+    ipv4_session_direction_destroy(&(session->rx));
+
+    OPENSSL_cleanse(session, sizeof(ipv4_session));
+}
+
+int ipv4_session_lock(ipv4_session *session, int direction)
+{
+    if (session == NULL || session->tx.ctx == NULL)
+        return -1;
+
+    pthread_mutex_lock((direction == IPV4_SESSION_TX) ? &(session->tx.mutex) : &(session->rx.mutex));
+
+    return 0;
+}
+
+void ipv4_session_unlock(ipv4_session *session, int direction)
+{
+    if (session == NULL || session->tx.ctx == NULL)
+        return;
+
+    pthread_mutex_unlock((direction == IPV4_SESSION_TX) ? &(session->tx.mutex) : &(session->rx.mutex));
+}
+
+int ipv4_session_encrypt(ipv4_session *session, const unsigned char *data, int data_len, unsigned char *encrypted_data)
+{
+    if (session == NULL || session->tx.ctx == NULL || data == NULL || encrypted_data == NULL || data_len < 0)
+        return -1;
+
+    // A record number is never used twice, even by a record that couldn't be sealed
+    return ipv4_session_run(session->tx.ctx, session->tx.iv, session->tx.seqnum++, 1, data, data_len, encrypted_data);
+}
+
+int ipv4_session_decrypt(ipv4_session *session, const unsigned char *encrypted_data, int encrypted_data_len, unsigned char *data)
+{
+    if (session == NULL || session->rx.ctx == NULL || encrypted_data == NULL || data == NULL || encrypted_data_len < 0)
+        return -1;
+
+    int data_len = ipv4_session_run(session->rx.ctx, session->rx.iv, session->rx.seqnum, 0, encrypted_data, encrypted_data_len, data);
+    if (data_len != -1)
+        session->rx.seqnum++;
+
+    return data_len;
+}
+
+static unsigned       CPU_FEATURES = 0;
+static uint32_t       CIPHERS[IPV4_N_CIPHERS];
+static pthread_once_t CIPHERS_ONCE = PTHREAD_ONCE_INIT;
+
+static void ipv4_session_rank_ciphers(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("aes"))
+        CPU_FEATURES |= IPV4_CPU_AES;
+    if (__builtin_cpu_supports("pclmul"))
+        CPU_FEATURES |= IPV4_CPU_PCLMUL;
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq"))
+        CPU_FEATURES |= IPV4_CPU_VAES;
+    if (__builtin_cpu_supports("avx2"))
+        CPU_FEATURES |= IPV4_CPU_AVX2;
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    if (hwcap & HWCAP_AES)
+        CPU_FEATURES |= IPV4_CPU_AES;
+    if (hwcap & HWCAP_PMULL)
+        CPU_FEATURES |= IPV4_CPU_PCLMUL;
+#endif
+
+    // OpenSSL takes the widest code of a cipher itself, only the order of ciphers is up to us:
+    // fewer rounds of AES-128 are the fastest with the instructions, ChaCha20 without them
+    int is_gcm_fast = (CPU_FEATURES & IPV4_CPU_AES) && (CPU_FEATURES & IPV4_CPU_PCLMUL);
+
+    if (is_gcm_fast)
+    {
+        CIPHERS[0] = IPV4_CIPHER_AES_128_GCM;
+        CIPHERS[1] = IPV4_CIPHER_AES_256_GCM;
+        CIPHERS[2] = IPV4_CIPHER_CHACHA20_POLY1305;
+    }
+    else
+    {
+        CIPHERS[0] = IPV4_CIPHER_CHACHA20_POLY1305;
+        CIPHERS[1] = IPV4_CIPHER_AES_128_GCM;
+        CIPHERS[2] = IPV4_CIPHER_AES_256_GCM;
+    }
+}
+
+unsigned ipv4_session_cpu_features(void)
+{
+    pthread_once(&CIPHERS_ONCE, ipv4_session_rank_ciphers);
+
+    return CPU_FEATURES;
+}
+
+// Ciphers of this side from the fastest one
+size_t ipv4_session_ciphers(uint32_t *ciphers, size_t max_n_ciphers)
+{
+    if (ciphers == NULL)
+        return 0;
+
+    pthread_once(&CIPHERS_ONCE, ipv4_session_rank_ciphers);
+
+    size_t n_ciphers = (max_n_ciphers < IPV4_N_CIPHERS) ? max_n_ciphers : IPV4_N_CIPHERS;
+    memcpy(ciphers, CIPHERS, n_ciphers * sizeof(uint32_t));
+
+    return n_ciphers;
+}
+
+int ipv4_session_choose_cipher(const uint32_t *peer_ciphers, size_t n_peer_ciphers)
+{
+    if (peer_ciphers == NULL || n_peer_ciphers == 0)
+        return -1;
+
+    pthread_once(&CIPHERS_ONCE, ipv4_session_rank_ciphers);
+
+    // A peer without the AES instructions would be slow with GCM whatever this side has
+    if (peer_ciphers[0] == IPV4_CIPHER_CHACHA20_POLY1305)
+        return IPV4_CIPHER_CHACHA20_POLY1305;
+
+    for (size_t i = 0; i < IPV4_N_CIPHERS; ++i)
+        for (size_t j = 0; j < n_peer_ciphers; ++j)
+            if (peer_ciphers[j] == CIPHERS[i])
+                return CIPHERS[i];
+
+    return -1;
+}
+
+const char *ipv4_session_cipher_name(int cipher)
+{
+    switch (cipher)
+    {
+        case IPV4_CIPHER_AES_256_GCM:
+            return "aes-256-gcm";
+
+        case IPV4_CIPHER_CHACHA20_POLY1305:
+            return "chacha20-poly1305";
+
+        case IPV4_CIPHER_AES_128_GCM:
+            return "aes-128-gcm";
+
+        default:
+            return "unknown";
+    }
+}
+
+int ipv4_session_derive(unsigned char *material, size_t material_size, const unsigned char *secret, size_t secret_size,
+                        const unsigned char *salt, size_t salt_size, const char *label)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (ctx == NULL)
+        return -1;
+
+    int retval = (EVP_PKEY_derive_init(ctx) == 1 &&
+                  EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+                  EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secret_size) == 1 &&
+                  (salt_size == 0 || EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, salt_size) == 1) &&
+                  EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char *) label, strlen(label)) == 1 &&
+                  EVP_PKEY_derive(ctx, material, &material_size) == 1) ? 0 : -1;
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return retval;
+}
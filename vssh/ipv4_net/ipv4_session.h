@@ -0,0 +1,97 @@
+#ifndef IPV4_SESSION_H_
+#define IPV4_SESSION_H_
+
+#define _UNIX03_THREADS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#define IPV4_SESSION_SECRET_LENGTH 256
+#define IPV4_SESSION_KEY_LENGTH    32
+#define IPV4_SESSION_NONCE_LENGTH  12
+#define IPV4_SESSION_TAG_SIZE      16 // a record is its ciphertext followed by the tag
+
+// Directions of a session
+#define IPV4_SESSION_RX 0
+#define IPV4_SESSION_TX 1
+
+// Record ciphers, each one is an AEAD with its own MAC
+#define IPV4_CIPHER_AES_256_GCM        1
+#define IPV4_CIPHER_CHACHA20_POLY1305  2
+#define IPV4_CIPHER_AES_128_GCM        3
+#define IPV4_N_CIPHERS                 3
+
+// CPU features the ciphers are ranked by
+#define IPV4_CPU_AES    0x1 // AES-NI or the AES instructions of ARMv8
+#define IPV4_CPU_PCLMUL 0x2 // carry-less multiplication for GHASH
+#define IPV4_CPU_VAES   0x4 // AES and carry-less multiplication on wide vectors
+#define IPV4_CPU_AVX2   0x8
+
+/**
+ * The session crypto
+ *
+ * Made from the DH secret once the handshake is over and used for the
+ * whole connection. Every message is sealed into an AEAD record of the
+ * cipher the handshake settled on: the side that doesn't initiate offers
+ * its ciphers from the fastest one on its CPU, the initiator takes the
+ * fastest one on its own CPU out of them. GCM is fast only with the AES
+ * and carry-less multiplication instructions, ChaCha20-Poly1305 is the
+ * choice of CPUs without them. The offer and the choice go into the keys,
+ * so a handshake made to settle on a weaker cipher ends with the first
+ * record that doesn't open.
+ * Each direction has its own key and initial vector derived from the
+ * secret by HKDF, the nonce of a record is that vector with the record
+ * number of its direction mixed in: records are opened in the order they
+ * were sealed and a record that is lost, replayed or moved doesn't open.
+ *
+ * Contexts of both directions get the key schedule at the start, every
+ * record only sets the nonce again. A direction is locked by whoever
+ * seals and sends (or receives and opens) its records for as long as a
+ * whole message takes, so records go on the wire in the order of their
+ * numbers. The record number of the receiving side moves on only once a
+ * record is opened.
+ */
+
+typedef struct
+{
+    EVP_CIPHER_CTX       *ctx;
+    unsigned char         key[IPV4_SESSION_KEY_LENGTH];
+    unsigned char         iv [IPV4_SESSION_NONCE_LENGTH];
+    uint64_t              seqnum; // of the next record
+    pthread_mutex_t       mutex;  // held across sealing and sending a message
+} ipv4_session_direction;
+
+typedef struct
+{
+    unsigned char secret[IPV4_SESSION_SECRET_LENGTH];
+    size_t        secret_size;
+    int           cipher;
+    int           is_ktls; // records of a TCP connection are sealed and opened by the kernel
+
+    ipv4_session_direction tx;
+    ipv4_session_direction rx;
+} ipv4_session;
+
+// The cipher is chosen out of the offered ones, a resumed session has no offer
+int  ipv4_session_init   (ipv4_session *session, const unsigned char *secret, size_t secret_size, int cipher,
+                          const uint32_t *ciphers, size_t n_ciphers, int is_initiator);
+void ipv4_session_destroy(ipv4_session *session);
+
+int  ipv4_session_lock   (ipv4_session *session, int direction);
+void ipv4_session_unlock (ipv4_session *session, int direction);
+
+// The direction is locked by the caller
+int  ipv4_session_encrypt(ipv4_session *session, const unsigned char *data,           int data_len,           unsigned char *encrypted_data);
+int  ipv4_session_decrypt(ipv4_session *session, const unsigned char *encrypted_data, int encrypted_data_len, unsigned char *data);
+
+unsigned    ipv4_session_cpu_features(void);
+size_t      ipv4_session_ciphers      (uint32_t *ciphers, size_t max_n_ciphers);
+int         ipv4_session_choose_cipher(const uint32_t *peer_ciphers, size_t n_peer_ciphers);
+const char *ipv4_session_cipher_name  (int cipher);
+
+int  ipv4_session_derive(unsigned char *material, size_t material_size, const unsigned char *secret, size_t secret_size,
+                         const unsigned char *salt, size_t salt_size, const char *label);
+
+#endif // !IPV4_SESSION_H_
@@ -0,0 +1,157 @@
+#include "ipv4_net_config.h"
+#include "ipv4_ticket.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+// Layout of a sealed ticket: the nonce, the sealed state and the tag
+#define TICKET_KEY_LENGTH   32
+#define TICKET_NONCE_LENGTH 12
+#define TICKET_TAG_SIZE     16
+#define TICKET_STATE_SIZE   (sizeof(int32_t) + sizeof(int64_t) + IPV4_TICKET_SECRET_LENGTH)
+
+_Static_assert(TICKET_NONCE_LENGTH + TICKET_STATE_SIZE + TICKET_TAG_SIZE == IPV4_TICKET_SEALED_SIZE, "sealed ticket size");
+
+// Tickets are sealed with a key of the process, they don't outlive it
+static unsigned char  TICKET_KEY[TICKET_KEY_LENGTH];
+static int            IS_TICKET_KEY = 0;
+static pthread_once_t TICKET_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+static void ipv4_ticket_make_key(void)
+{
+    IS_TICKET_KEY = (RAND_bytes(TICKET_KEY, sizeof(TICKET_KEY)) == 1);
+}
+
+static int ipv4_ticket_seal(ipv4_ticket *ticket)
+{
+    pthread_once(&TICKET_KEY_ONCE, ipv4_ticket_make_key);
+    if (IS_TICKET_KEY == 0)
+        return -1;
+
+    unsigned char state[TICKET_STATE_SIZE];
+    memcpy(state,                                     &(ticket->cipher),    sizeof(int32_t));
+    memcpy(state + sizeof(int32_t),                   &(ticket->issued_at), sizeof(int64_t));
+    memcpy(state + sizeof(int32_t) + sizeof(int64_t), ticket->secret,       IPV4_TICKET_SECRET_LENGTH);
+
+    unsigned char *nonce  = ticket->sealed;
+    unsigned char *sealed = ticket->sealed + TICKET_NONCE_LENGTH;
+    unsigned char *tag    = sealed + TICKET_STATE_SIZE;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return -1;
+
+    int len = 0;
+    int is_sealed = RAND_bytes(nonce, TICKET_NONCE_LENGTH) == 1 &&
+                    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, TICKET_KEY, nonce) == 1 &&
+                    EVP_EncryptUpdate(ctx, sealed, &len, state, sizeof(state)) == 1 &&
+                    EVP_EncryptFinal_ex(ctx, sealed + len, &len) == 1 &&
+                    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TICKET_TAG_SIZE, tag) == 1;
+
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(state, sizeof(state));
+
+    return is_sealed ? 0 : -1;
+}
+
+// Both sides derive the resumption secret, the initiator seals it
+int ipv4_ticket_init(ipv4_ticket *ticket, const ipv4_session *session, int is_initiator)
+{
+    if (ticket == NULL || session == NULL)
+        return -1;
+
+    memset(ticket, 0, sizeof(ipv4_ticket));
+
+    if (ipv4_session_derive(ticket->secret, IPV4_TICKET_SECRET_LENGTH, session->secret, session->secret_size, NULL, 0, "vssh resumption") == -1)
+        return -1;
+
+    ticket->cipher    = session->cipher;
+    ticket->issued_at = time(NULL);
+
+    if (is_initiator && ipv4_ticket_seal(ticket) == -1)
+    {
+        OPENSSL_cleanse(ticket, sizeof(ipv4_ticket));
+        return -1;
+    }
+
+    return 0;
+}
+
+// The initiator gets the state back from the sealed ticket
+int ipv4_ticket_open(ipv4_ticket *ticket)
+{
+    if (ticket == NULL)
+        return -1;
+
+    pthread_once(&TICKET_KEY_ONCE, ipv4_ticket_make_key);
+    if (IS_TICKET_KEY == 0)
+        return -1;
+
+    const unsigned char *nonce  = ticket->sealed;
+    const unsigned char *sealed = ticket->sealed + TICKET_NONCE_LENGTH;
+    const unsigned char *tag    = sealed + TICKET_STATE_SIZE;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return -1;
+
+    // Fails if the ticket isn't one of this process
+    unsigned char state[TICKET_STATE_SIZE];
+    int len = 0;
+    int is_opened = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, TICKET_KEY, nonce) == 1 &&
+                    EVP_DecryptUpdate(ctx, state, &len, sealed, TICKET_STATE_SIZE) == 1 &&
+                    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TICKET_TAG_SIZE, (void *) tag) == 1 &&
+                    EVP_DecryptFinal_ex(ctx, state + len, &len) == 1;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (is_opened)
+    {
+        memcpy(&(ticket->cipher),    state,                                     sizeof(int32_t));
+        memcpy(&(ticket->issued_at), state + sizeof(int32_t),                   sizeof(int64_t));
+        memcpy(ticket->secret,       state + sizeof(int32_t) + sizeof(int64_t), IPV4_TICKET_SECRET_LENGTH);
+    }
+
+    OPENSSL_cleanse(state, sizeof(state));
+
+    return (is_opened && ipv4_ticket_is_valid(ticket)) ? 0 : -1;
+}
+
+int ipv4_ticket_is_valid(const ipv4_ticket *ticket)
+{
+    if (ticket == NULL || ticket->issued_at == 0)
+        return 0;
+
+    int64_t now = time(NULL);
+
+    return now >= ticket->issued_at && now - ticket->issued_at < IPV4_TICKET_LIFETIME;
+}
+
+// Fresh keys from the resumption secret and the nonces of both sides
+int ipv4_ticket_resume(ipv4_session *session, const ipv4_ticket *ticket,
+                       const unsigned char *nonce, const unsigned char *alien_nonce, int is_initiator)
+{
+    if (session == NULL || ticket == NULL || nonce == NULL || alien_nonce == NULL)
+        return -1;
+
+    // The secret, the nonce of the other side and the nonce of the initiator
+    unsigned char material[IPV4_TICKET_SECRET_LENGTH + 2 * IPV4_TICKET_NONCE_LENGTH];
+    memcpy(material,                                                        ticket->secret, IPV4_TICKET_SECRET_LENGTH);
+    memcpy(material + IPV4_TICKET_SECRET_LENGTH,                            is_initiator ? alien_nonce : nonce, IPV4_TICKET_NONCE_LENGTH);
+    memcpy(material + IPV4_TICKET_SECRET_LENGTH + IPV4_TICKET_NONCE_LENGTH, is_initiator ? nonce : alien_nonce, IPV4_TICKET_NONCE_LENGTH);
+
+    unsigned char secret[IPV4_TICKET_SECRET_LENGTH];
+    int retval = -1;
+
+    if (ipv4_session_derive(secret, sizeof(secret), material, sizeof(material), NULL, 0, "vssh resumed secret") == 0)
+        retval = ipv4_session_init(session, secret, sizeof(secret), ticket->cipher, NULL, 0, is_initiator);
+
+    OPENSSL_cleanse(material, sizeof(material));
+    OPENSSL_cleanse(secret, sizeof(secret));
+
+    return retval;
+}
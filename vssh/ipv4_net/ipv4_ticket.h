@@ -0,0 +1,42 @@
+#ifndef IPV4_TICKET_H_
+#define IPV4_TICKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ipv4_session.h"
+
+#define IPV4_TICKET_SECRET_LENGTH 32
+#define IPV4_TICKET_NONCE_LENGTH  32
+#define IPV4_TICKET_SEALED_SIZE   72 // nonce, cipher, time of issue and secret, tag
+
+/**
+ * Session tickets
+ *
+ * At the end of every handshake the initiator seals a resumption secret
+ * derived from the session, with its cipher and the time of issue, under
+ * a key of its own process and gives it to the other side. Both sides
+ * derive the same resumption secret, so the other side keeps it next to
+ * the sealed ticket. On the next connection it shows the ticket with a
+ * nonce of its own, the initiator opens it and answers with its nonce:
+ * the session secret is derived from the resumption secret and both
+ * nonces, without key exchange and RSA. A ticket lives for
+ * IPV4_TICKET_LIFETIME seconds or until the initiator restarts.
+ */
+
+typedef struct
+{
+    unsigned char sealed[IPV4_TICKET_SEALED_SIZE]; // opaque to the other side
+    unsigned char secret[IPV4_TICKET_SECRET_LENGTH];
+    int32_t       cipher;
+    int64_t       issued_at;                       // 0 when there is no ticket
+} ipv4_ticket;
+
+int ipv4_ticket_init    (ipv4_ticket *ticket, const ipv4_session *session, int is_initiator);
+int ipv4_ticket_open    (ipv4_ticket *ticket);
+int ipv4_ticket_is_valid(const ipv4_ticket *ticket);
+
+int ipv4_ticket_resume  (ipv4_session *session, const ipv4_ticket *ticket,
+                         const unsigned char *nonce, const unsigned char *alien_nonce, int is_initiator);
+
+#endif // !IPV4_TICKET_H_
@@ -7,14 +7,28 @@
 
 #define SOCK_STREAM_UDT 19 // the analogue of SOCK_STREAM and SOCK_DGRAM
 
+// Options of udt_setsockopt()
+#define UDT_CONGESTION_CONTROL 1 // int: UDT_CC_NATIVE or UDT_CC_CUBIC, for a connected socket
+#define UDT_RECV_TIMEOUT       2 // struct timeval: udt_recv() fails with EAGAIN after it, zero waits forever
+
+#define UDT_CC_NATIVE 0 // rate-based DAIMD of UDT
+#define UDT_CC_CUBIC  1 // window-based CUBIC with pacing
+
 int udt_bind   (int socket_fd, const struct sockaddr *addr, socklen_t len);
 int udt_connect(int socket_fd, const struct sockaddr *addr, socklen_t len);
 
 ssize_t udt_recv(int socket_fd,       char *buffer, size_t len);
 ssize_t udt_send(int socket_fd, const char *buffer, size_t len);
 
+// A message of one packet written in place: udt_send_reserve() gives the payload of the
+// next packet and its capacity, udt_send_commit() sends 'len' bytes of it (cancels if negative)
+char   *udt_send_reserve(int socket_fd, size_t *len);
+ssize_t udt_send_commit (int socket_fd, ssize_t len);
+
 int udt_close(int socket_fd);
 
+int udt_setsockopt(int socket_fd, int optname, const void *optval, socklen_t optlen);
+
 void udt_set_server_handler(void *(*server_handler)(void *));
 
 #endif // !UDT_API_H_
@@ -7,38 +7,50 @@
 #include "udt_utils.h"
 #include "udt_buffer.h"
 
-extern udt_conn_t connection;
+static void *(*SERVER_HANDLER)(void *) = NULL;
+static udt_conn_t *LISTENER = NULL;
+
+// The connection of the send reservation of this thread, referenced until its commit
+static _Thread_local udt_conn_t *RESERVED_CONN = NULL;
 
 int udt_bind(int socket_fd, const struct sockaddr *addr, socklen_t len)
 {
-    if (connection.socket_fd != 0) // impossible to use this function twice
+    if (LISTENER != NULL) // impossible to use this function twice
         return -1;
 
-    if (connection.server_handler == NULL) // server handler wasn't set
+    if (SERVER_HANDLER == NULL) // server handler wasn't set
         return -1;
 
-    udt_startup();
-
     int bind_error = bind(socket_fd, (const struct sockaddr *) addr, len);
     if (bind_error == -1)
         return -1;
 
-    connection.socket_fd      = socket_fd;
-    connection.addrlen        = len;
-    connection.is_connected   = 0;
-    connection.is_client      = 0;
-    connection.is_main_server = 1;
-    
-    int pthread_error = pthread_atfork(udt_prepare_to_fork, NULL, udt_child_after_fork);
-    if (pthread_error == -1)
+    if (udt_socket_setup(socket_fd) == -1)
+        udt_syslog(LOG_WARNING, "couldn't resize socket buffers: %s", strerror(errno));
+
+    udt_conn_t *listener = udt_conn_new(socket_fd, 0);
+    if (listener == NULL)
         return -1;
 
-    pthread_t recv_thread;
-    int recv_pthread_error = pthread_create(&recv_thread, NULL, udt_receiver_start, (void *) &connection);
-    if (recv_pthread_error == -1)
+    if (udt_table_init(&(listener->table), UDT_CONN_TABLE_SIZE) != 0)
+    {
+        udt_conn_free(listener);
+        return -1;
+    }
+
+    listener->addrlen        = len;
+    listener->is_listener    = 1;
+    listener->server_handler = SERVER_HANDLER;
+
+    // All connections are served by this thread and threads of their own
+    int recv_pthread_error = pthread_create(&(listener->recv_thread), NULL, udt_receiver_start, (void *) listener);
+    if (recv_pthread_error != 0)
+    {
+        udt_conn_free(listener);
         return -1;
+    }
 
-    connection.recv_thread = recv_thread;
+    LISTENER = listener;
 
     int old_type = 0;
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old_type);
@@ -52,55 +64,49 @@ int udt_connect(int socket_fd, const struct sockaddr *addr, socklen_t len)
 {
     if (addr == NULL)
         return -1;
-        
-    memset(&connection, 0, sizeof(connection));
 
-    udt_startup();
+    if (udt_socket_setup(socket_fd) == -1)
+        udt_syslog(LOG_WARNING, "couldn't resize socket buffers: %s", strerror(errno));
 
-    connection.socket_fd    = socket_fd;
-    connection.addr         = *((struct sockaddr_in *) addr);
-    connection.addrlen      = len;
-    connection.is_connected = 0;
-    connection.is_client    = 1;
+    udt_conn_t *conn = udt_conn_new(socket_fd, 1);
+    if (conn == NULL)
+        return -1;
 
-    pthread_t recv_thread;
-    pthread_t send_thread;
+    conn->addr    = *((struct sockaddr_in *) addr);
+    conn->addrlen = len;
 
-    int recv_pthread_error = pthread_create(&recv_thread, NULL, udt_receiver_start, (void *) &connection);
-    if (recv_pthread_error == -1)
+    int recv_pthread_error = pthread_create(&(conn->recv_thread), NULL, udt_receiver_start, (void *) conn);
+    if (recv_pthread_error != 0)
+    {
+        udt_conn_free(conn);
         return -1;
+    }
 
-    int send_pthread_error = pthread_create(&send_thread, NULL, udt_sender_start, (void *) &connection);
-    if (send_pthread_error == -1)
+    int send_pthread_error = pthread_create(&(conn->send_thread), NULL, udt_sender_start, (void *) conn);
+    if (send_pthread_error != 0)
+    {
+        pthread_cancel(conn->recv_thread);
+        pthread_join(conn->recv_thread, NULL);
+        udt_conn_free(conn);
         return -1;
+    }
 
-    struct timeval tv = {.tv_sec = UDT_SECONDS_TIMEOUT_CONN, .tv_usec = UDT_USECONDS_TIMEOUT_CONN};
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval));
-
-    udt_handshake_init();
+    udt_handshake_init(conn);
 
-    if (connection.is_connected == 1)
+    if (conn->is_connected == 1 && udt_handle_register(socket_fd, conn) == 0)
     {
-        struct timeval new_tv = {.tv_sec = UDT_SECONDS_TIMEOUT_CLIENT, .tv_usec = UDT_USECONDS_TIMEOUT_CLIENT};
-        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &new_tv, sizeof(struct timeval));
-
-        connection.recv_thread = recv_thread;
-        connection.send_thread = send_thread;
-
+        udt_conn_put(conn); // the descriptor keeps the connection
         return 0;
     }
-    else
-    {
-        memset(&connection, 0, sizeof(connection));
 
-        struct timeval new_tv = {.tv_sec = 0, .tv_usec = 0};
-        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &new_tv, sizeof(struct timeval));
+    pthread_cancel(conn->recv_thread);
+    pthread_join(conn->recv_thread, NULL);
+    udt_conn_free(conn);
 
-        pthread_cancel(recv_thread);
-        pthread_cancel(send_thread);
+    struct timeval new_tv = {.tv_sec = 0, .tv_usec = 0};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &new_tv, sizeof(struct timeval));
 
-        return -1;
-    }
+    return -1;
 }
 
 ssize_t udt_recv(int socket_fd, char *buffer, size_t len)
@@ -108,19 +114,16 @@ ssize_t udt_recv(int socket_fd, char *buffer, size_t len)
     if (buffer == NULL)
         return -1;
 
-    if (connection.is_connected == 0 && connection.is_client == 1)
+    udt_conn_t *conn = udt_handle_find(socket_fd);
+    if (conn == NULL)
         return -1;
 
-    ssize_t received_bytes = udt_recv_buffer_read(buffer, len);
-    if (connection.is_connected == 0 && connection.is_client == 1)
-    {
-        pthread_cancel(connection.recv_thread);
-        pthread_cancel(connection.send_thread);
-
-        memset(&connection, 0, sizeof(connection));
+    // Data received before the disconnection is still delivered
+    ssize_t received_bytes = udt_recv_buffer_read(conn, buffer, len);
+    if (received_bytes == 0 && conn->is_connected == 0)
+        received_bytes = -1;
 
-        return -1;
-    }
+    udt_conn_put(conn);
 
     return received_bytes;
 }
@@ -130,44 +133,144 @@ ssize_t udt_send(int socket_fd, const char *buffer, size_t len)
     if (buffer == NULL)
         return -1;
 
-    if (connection.is_connected == 0)
+    udt_conn_t *conn = udt_handle_find(socket_fd);
+    if (conn == NULL || conn->is_connected == 0)
+    {
+        udt_conn_put(conn);
         return -1;
+    }
 
-    struct timeval old_tv;
-    socklen_t optlen;
-    getsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &old_tv, &optlen);
+    // Retransmissions are driven by timers of receiver-thread
+    ssize_t sent_bytes = udt_send_buffer_write(conn, buffer, len);
 
-    struct timeval new_tv = {.tv_sec = UDT_SECONDS_TIMEOUT_SEND, .tv_usec = UDT_USECONDS_TIMEOUT_SEND};
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &new_tv, sizeof(struct timeval));
+    udt_conn_put(conn);
 
-    ssize_t sent_bytes = udt_send_buffer_write(buffer, len);
-    if (connection.is_connected == 0 && connection.is_client == 1)
-        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &old_tv, sizeof(struct timeval));
-        
     return sent_bytes;
 }
 
+char *udt_send_reserve(int socket_fd, size_t *len)
+{
+    if (len == NULL)
+        return NULL;
+
+    if (RESERVED_CONN != NULL) // the previous reservation isn't committed
+        return NULL;
+
+    udt_conn_t *conn = udt_handle_find(socket_fd);
+    if (conn == NULL || conn->is_connected == 0)
+    {
+        udt_conn_put(conn);
+        return NULL;
+    }
+
+    char *payload = udt_send_buffer_reserve(conn, len);
+    if (payload == NULL)
+    {
+        udt_conn_put(conn);
+        return NULL;
+    }
+
+    RESERVED_CONN = conn;
+
+    return payload;
+}
+
+ssize_t udt_send_commit(int socket_fd, ssize_t len)
+{
+    // The reserved packet is in the connection even if the descriptor is closed meanwhile
+    udt_conn_t *conn = RESERVED_CONN;
+    if (conn == NULL || conn->handle_fd != socket_fd)
+        return -1;
+
+    RESERVED_CONN = NULL;
+
+    // A reservation is given back even if the connection is lost meanwhile
+    ssize_t retval = udt_send_buffer_commit(conn, len);
+
+    udt_conn_put(conn);
+
+    return retval;
+}
+
 int udt_close(int socket_fd)
 {
-    if (connection.is_connected == 1)
-    {   
-        udt_connection_close();
-        connection.is_connected = 0;
+    udt_conn_t *conn = udt_handle_find(socket_fd);
+    if (conn == NULL)
+        return close(socket_fd);
+
+    udt_handle_unregister(socket_fd);
+
+    if (conn->is_connected == 1)
+    {
+        udt_connection_close(conn);
+        conn->is_connected = 0;
+    }
+
+    // Calls blocked in udt_recv() return and give their references back
+    udt_buffer_close(&(conn->recv_buffer));
+
+    int retval = 0;
+
+    if (conn->is_client == 1)
+    {
+        pthread_cancel(conn->recv_thread);
+        pthread_join(conn->recv_thread, NULL);
+
+        conn->is_closed = 1; // the socket is closed with the last reference
     }
+    else
+    {
+        retval = close(socket_fd);
+        udt_connection_unlink(conn); // the table of the listening socket lets it go
+    }
+
+    udt_conn_put(conn);
 
-    if (connection.recv_thread != 0)
-        pthread_cancel(connection.recv_thread);
+    return retval;
+}
 
-    if (connection.send_thread != 0)
-        pthread_cancel(connection.send_thread);
+int udt_setsockopt(int socket_fd, int optname, const void *optval, socklen_t optlen)
+{
+    if (optval == NULL)
+        return -1;
+
+    udt_conn_t *conn = udt_handle_find(socket_fd);
+    if (conn == NULL)
+        return -1;
+
+    int retval = -1;
+
+    switch (optname)
+    {
+        case UDT_CONGESTION_CONTROL:
+            if (optlen != sizeof(int) || udt_ccc_set(&(conn->ccc), *((const int *) optval)) == -1)
+                break;
+
+            udt_send_window_set_cwnd(&(conn->send_window), udt_ccc_window(&(conn->ccc)));
+            retval = 0;
+            break;
+
+        case UDT_RECV_TIMEOUT:
+        {
+            if (optlen != sizeof(struct timeval))
+                break;
+
+            const struct timeval *timeout = (const struct timeval *) optval;
+            udt_buffer_set_timeout(&(conn->recv_buffer), timeout->tv_sec * 1000000L + timeout->tv_usec);
+            retval = 0;
+            break;
+        }
+
+        default:
+            break;
+    }
 
-    memset(&connection, 0, sizeof(connection));
+    udt_conn_put(conn);
 
-    return close(socket_fd);
+    return retval;
 }
 
 void udt_set_server_handler(void *(*server_handler)(void *))
 {
-    memset(&connection, 0, sizeof(connection));
-    connection.server_handler = server_handler;
+    SERVER_HANDLER = server_handler;
 }
@@ -2,48 +2,207 @@
 #include "udt_buffer.h"
 #include "udt_utils.h"
 
-int udt_buffer_init(udt_buffer_t *buffer)
+#include <errno.h>
+#include <time.h>
+
+#define RECORD_LAST 0x1 // the last piece of a message
+#define RECORD_SKIP 0x2 // the rest of the ring is empty, the next record is at its beginning
+#define RECORD_REF  0x4 // sequence number of a packet kept by the send window
+
+#define record_size(len)                                                   \
+    ((sizeof(udt_record_t) + (len) + 7) & ~(size_t) 7)
+
+typedef struct
+{
+    uint32_t len;
+    uint32_t flags;
+} udt_record_t;
+
+int udt_buffer_init(udt_buffer_t *buffer, size_t size)
+{
+    if (buffer == NULL || size < 2 * sizeof(udt_packet_t) || (size & (size - 1)) != 0)
+        return -1;
+
+    // Pages are taken by the kernel only when the ring gets to them
+    buffer->data = (char *) aligned_alloc(UDT_CACHE_LINE_SIZE, size);
+    if (buffer->data == NULL)
+        return -1;
+
+    buffer->size       = size;
+    buffer->head_cache = 0;
+    buffer->tail_cache = 0;
+    buffer->offset     = 0;
+    buffer->timeout    = 0;
+
+    atomic_init(&(buffer->tail),       0);
+    atomic_init(&(buffer->head),       0);
+    atomic_init(&(buffer->is_waiting), 0);
+    atomic_init(&(buffer->is_closed),  0);
+
+    int retval1 = pthread_mutex_init(&(buffer->producer_mutex), NULL);
+    int retval2 = pthread_mutex_init(&(buffer->mutex), NULL);
+    int retval3 = pthread_cond_init (&(buffer->cond),  NULL);
+
+    return retval1 || retval2 || retval3;
+}
+
+void udt_buffer_close(udt_buffer_t *buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    pthread_mutex_lock(&(buffer->mutex));
+    atomic_store(&(buffer->is_closed), 1);
+    pthread_mutex_unlock(&(buffer->mutex));
+
+    pthread_cond_broadcast(&(buffer->cond));
+}
+
+void udt_buffer_destroy(udt_buffer_t *buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    free(buffer->data);
+    buffer->data = NULL;
+
+    pthread_mutex_destroy(&(buffer->producer_mutex));
+    pthread_mutex_destroy(&(buffer->mutex));
+    pthread_cond_destroy (&(buffer->cond));
+}
+
+// Consumer only
+void udt_buffer_set_timeout(udt_buffer_t *buffer, long timeout)
 {
-    if (buffer)
+    if (buffer == NULL || timeout < 0)
+        return;
+
+    buffer->timeout = timeout;
+}
+
+// Producer only
+static int udt_buffer_push(udt_buffer_t *buffer, const void *data, size_t len, uint32_t flags)
+{
+    size_t size = record_size(len);
+    size_t tail = atomic_load_explicit(&(buffer->tail), memory_order_relaxed);
+    size_t pos  = tail & (buffer->size - 1);
+
+    // A record is never split by the end of the ring
+    size_t n_skipped = (buffer->size - pos < size) ? buffer->size - pos : 0;
+
+    if (buffer->size - (tail - buffer->head_cache) < n_skipped + size)
+    {
+        buffer->head_cache = atomic_load_explicit(&(buffer->head), memory_order_acquire);
+        if (buffer->size - (tail - buffer->head_cache) < n_skipped + size)
+            return -1;
+    }
+
+    if (n_skipped > 0)
     {
-        int retval1 = pthread_mutex_init(&(buffer->mutex), NULL);
-        int retval2 = pthread_cond_init (&(buffer->cond),  NULL);
+        ((udt_record_t *) (buffer->data + pos))->flags = RECORD_SKIP;
+        pos = 0;
+    }
+
+    udt_record_t *record = (udt_record_t *) (buffer->data + pos);
+    record->len   = len;
+    record->flags = flags;
+    memcpy(record + 1, data, len);
 
-        return retval1 || retval2;
+    atomic_store_explicit(&(buffer->tail), tail + n_skipped + size, memory_order_release);
+
+    // Pairs with the fence of a consumer going to sleep: either it sees the record or it is seen waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&(buffer->is_waiting), memory_order_relaxed) == 1)
+    {
+        pthread_mutex_lock(&(buffer->mutex));
+        pthread_cond_signal(&(buffer->cond));
+        pthread_mutex_unlock(&(buffer->mutex));
     }
-    else
-        return -1;
+
+    return 0;
 }
 
-ssize_t udt_buffer_write(udt_buffer_t *buffer, char *data, ssize_t len)
+// Consumer only, NULL if the ring is empty
+static udt_record_t *udt_buffer_first(udt_buffer_t *buffer)
 {
-    if (buffer == NULL || data == NULL)
-        return -1;
+    while (1)
+    {
+        size_t head = atomic_load_explicit(&(buffer->head), memory_order_relaxed);
+        if (head == buffer->tail_cache)
+        {
+            buffer->tail_cache = atomic_load_explicit(&(buffer->tail), memory_order_acquire);
+            if (head == buffer->tail_cache)
+                return NULL;
+        }
 
-    char *new_data = malloc(len * sizeof(char));
-    if (new_data == NULL)
-        return -1;
+        size_t pos = head & (buffer->size - 1);
+        udt_record_t *record = (udt_record_t *) (buffer->data + pos);
+        if ((record->flags & RECORD_SKIP) == 0)
+            return record;
 
-    memcpy(new_data, data, len);
+        atomic_store_explicit(&(buffer->head), head + buffer->size - pos, memory_order_release);
+    }
+}
 
-    udt_block_t *new_block = (udt_block_t *) calloc(1, sizeof(udt_block_t));
-    if (new_block == NULL)
-        return -1;
+// Consumer only, NULL if the ring is empty and closed or nothing comes in time
+static udt_record_t *udt_buffer_wait(udt_buffer_t *buffer)
+{
+    udt_record_t *record = udt_buffer_first(buffer);
+    if (record != NULL)
+        return record;
 
-    new_block->data = new_data;
-    new_block->len  = len;
+    struct timespec deadline;
+    if (buffer->timeout > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += buffer->timeout / 1000000;
+        deadline.tv_nsec += (buffer->timeout % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
 
-    if (len == -1) // first or middle packets
+    pthread_mutex_lock(&(buffer->mutex));
+
+    atomic_store_explicit(&(buffer->is_waiting), 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int wait_error = 0;
+    while ((record = udt_buffer_first(buffer)) == NULL && atomic_load(&(buffer->is_closed)) == 0 && wait_error != ETIMEDOUT)
     {
-        new_block->last = 0;
-        new_block->len  = PACKET_DATA_SIZE;
-    } 
-    else // solo or last packets
-        new_block->last = 1;
-
-    linked_list_add((*buffer), new_block);
-    
-    return new_block->len;
+        if (buffer->timeout > 0)
+            wait_error = pthread_cond_timedwait(&(buffer->cond), &(buffer->mutex), &deadline);
+        else
+            pthread_cond_wait(&(buffer->cond), &(buffer->mutex));
+    }
+
+    atomic_store_explicit(&(buffer->is_waiting), 0, memory_order_relaxed);
+
+    pthread_mutex_unlock(&(buffer->mutex));
+
+    return record;
+}
+
+// Consumer only
+static void udt_buffer_pop(udt_buffer_t *buffer, udt_record_t *record)
+{
+    size_t head = atomic_load_explicit(&(buffer->head), memory_order_relaxed);
+
+    buffer->offset = 0;
+    atomic_store_explicit(&(buffer->head), head + record_size(record->len), memory_order_release);
+}
+
+ssize_t udt_buffer_write(udt_buffer_t *buffer, char *data, ssize_t len, int last)
+{
+    if (buffer == NULL || data == NULL || len < 0)
+        return -1;
+
+    if (udt_buffer_push(buffer, data, len, last ? RECORD_LAST : 0) == -1)
+        return -1;
+
+    return len;
 }
 
 ssize_t udt_buffer_read(udt_buffer_t *buffer, char *data, ssize_t len)
@@ -51,31 +210,36 @@ ssize_t udt_buffer_read(udt_buffer_t *buffer, char *data, ssize_t len)
     if (buffer == NULL || data == NULL)
         return -1;
 
-    udt_block_t *block = NULL;
     ssize_t n_read_bytes = 0;
     ssize_t cur_pos      = 0;
     int last = 0;
 
-    while (last == 0)
+    while (last == 0 && cur_pos < len)
     {
-        block = NULL;
-        linked_list_get((*buffer), block);
+        udt_record_t *record = udt_buffer_wait(buffer);
+        if (record == NULL && n_read_bytes == 0 && atomic_load(&(buffer->is_closed)) == 0)
+        {
+            errno = EAGAIN; // the timeout is over
+            return -1;
+        }
 
-        if (block == NULL)
+        if (record == NULL)
             return n_read_bytes;
 
-        last = block->last;
-
-        ssize_t n = ((len - cur_pos) < block->len) ? len - cur_pos : block->len;
-        memcpy(data + cur_pos, block->data, n);
-        n_read_bytes += n;
-        cur_pos      += n;
+        // A record is left in the ring until the rest of it is read
+        ssize_t n_left = record->len - buffer->offset;
+        ssize_t n = ((len - cur_pos) < n_left) ? len - cur_pos : n_left;
 
-        free(block->data);
-        free(block);
+        memcpy(data + cur_pos, (char *) (record + 1) + buffer->offset, n);
+        buffer->offset += n;
+        n_read_bytes   += n;
+        cur_pos        += n;
 
-        if (cur_pos >= len)
-            break;
+        if (buffer->offset == record->len)
+        {
+            last = record->flags & RECORD_LAST;
+            udt_buffer_pop(buffer, record);
+        }
     }
 
     return n_read_bytes;
@@ -86,28 +250,65 @@ int udt_buffer_write_packet(udt_buffer_t *buffer, udt_packet_t *packet)
     if (buffer == NULL || packet == NULL)
         return -1;
 
-    udt_packet_block_t *new_block = (udt_packet_block_t *) calloc(1, sizeof(udt_packet_block_t));
-    if (new_block == NULL)
+    size_t size = packet_size(*packet);
+    if (size > sizeof(udt_packet_t))
         return -1;
 
-    memcpy(&(new_block->packet), packet, sizeof(udt_packet_t));
+    pthread_mutex_lock(&(buffer->producer_mutex));
+    int retval = udt_buffer_push(buffer, packet, size, 0);
+    pthread_mutex_unlock(&(buffer->producer_mutex));
 
-    linked_list_add((*buffer), new_block);
+    if (retval == -1)
+    {
+        udt_syslog(LOG_NOTICE, "buffer is full, packet is dropped");
+        return -1;
+    }
 
     return 1;
 }
 
-int udt_buffer_read_packet(udt_buffer_t *buffer, udt_packet_t *packet)
+int udt_buffer_write_ref(udt_buffer_t *buffer, uint32_t seqnum)
 {
-    if (buffer == NULL || packet == NULL)
+    if (buffer == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(buffer->producer_mutex));
+    int retval = udt_buffer_push(buffer, &seqnum, sizeof(seqnum), RECORD_REF);
+    pthread_mutex_unlock(&(buffer->producer_mutex));
+
+    if (retval == -1)
+    {
+        udt_syslog(LOG_NOTICE, "buffer is full, packet is dropped");
+        return -1;
+    }
+
+    return 1;
+}
+
+int udt_buffer_read_packets(udt_buffer_t *buffer, udt_packet_t *packets, uint32_t *refs, size_t max_n_packets)
+{
+    if (buffer == NULL || packets == NULL || refs == NULL || max_n_packets == 0)
         return 0;
 
-    udt_packet_block_t *block = NULL;
+    // Waits for the first packet only, the rest are those already written
+    udt_record_t *record = udt_buffer_wait(buffer);
+    int n_packets = 0;
 
-    linked_list_get((*buffer), block);
+    while (record != NULL && n_packets < max_n_packets)
+    {
+        if (record->flags & RECORD_REF)
+            memcpy(&(refs[n_packets]), record + 1, sizeof(uint32_t));
+        else
+        {
+            refs[n_packets] = UDT_BUFFER_NO_REF;
+            memcpy(&(packets[n_packets]), record + 1, record->len);
+        }
 
-    *packet = block->packet;
-    free(block);
+        n_packets++;
+        udt_buffer_pop(buffer, record);
 
-    return 1;
+        record = udt_buffer_first(buffer);
+    }
+
+    return n_packets; // 0 if buffer is closed
 }
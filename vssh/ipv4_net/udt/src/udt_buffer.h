@@ -5,53 +5,77 @@
 
 #include "udt_packet.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
-typedef struct _udt_block udt_block_t;
-struct _udt_block
-{
-    char *data;
-    ssize_t len;
-    int last;
-    udt_block_t *next;
-};
+typedef struct _udt_conn udt_conn_t;
 
-typedef struct _udt_packet_block udt_packet_block_t;
-struct _udt_packet_block
-{
-    udt_packet_t packet;
-    ssize_t len;
-    udt_packet_block_t *next;
-};
+#define UDT_CACHE_LINE_SIZE 64
+#define UDT_BUFFER_NO_REF   0xFFFFFFFF // the packet itself is in the record
+
+/**
+ * The udt buffer
+ *
+ * A preallocated single-producer/single-consumer ring of records: packets
+ * to be sent or pieces of messages delivered to the application, each one
+ * is stored with its length right after the previous one. A record that
+ * doesn't fit before the end of the ring starts at its beginning again.
+ *
+ * Both sides move their own counter only and keep a copy of the other
+ * one, the counters are in separate cache lines. The consumer sleeps only
+ * when the ring is empty and producers signal it only while it sleeps. A
+ * record that doesn't fit into a full ring is refused: lost packets are
+ * sent again. Several producers of the send buffer are serialized by the
+ * producer lock. Data packets are queued by their sequence numbers only,
+ * the packets themselves stay in the send window.
+ */
 
 typedef struct _udt_buffer udt_buffer_t;
 struct _udt_buffer
 {
-    void *first;
-    void *last;
-    ssize_t size;
+    _Alignas(UDT_CACHE_LINE_SIZE)
+    atomic_size_t tail;       // bytes written, moved by the producer
+    size_t        head_cache; // the consumer's counter seen last time
+
+    _Alignas(UDT_CACHE_LINE_SIZE)
+    atomic_size_t head;       // bytes read, moved by the consumer
+    size_t        tail_cache; // the producer's counter seen last time
+    size_t        offset;     // bytes already read of the first record
+    atomic_int    is_waiting; // the consumer sleeps
+    long          timeout;    // microseconds the consumer waits for a record, 0 is forever
+
+    _Alignas(UDT_CACHE_LINE_SIZE)
+    char       *data;
+    size_t      size;      // power of two
+    atomic_int  is_closed; // readers don't wait for new records anymore
+
+    pthread_mutex_t producer_mutex;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    pthread_cond_t  cond;
 };
 
-int udt_buffer_init(udt_buffer_t *buffer);
-int udt_send_buffer_init();
-int udt_recv_buffer_init();
+int udt_buffer_init(udt_buffer_t *buffer, size_t size);
+void udt_buffer_close(udt_buffer_t *buffer);
+void udt_buffer_destroy(udt_buffer_t *buffer);
+void udt_buffer_set_timeout(udt_buffer_t *buffer, long timeout);
 
-ssize_t udt_buffer_write(udt_buffer_t *buffer, char *data, ssize_t len);
+ssize_t udt_buffer_write(udt_buffer_t *buffer, char *data, ssize_t len, int last);
 ssize_t udt_buffer_read (udt_buffer_t *buffer, char *data, ssize_t len);
 int udt_buffer_write_packet(udt_buffer_t *buffer, udt_packet_t *packet);
-int udt_buffer_read_packet (udt_buffer_t *buffer, udt_packet_t *packet);
+int udt_buffer_write_ref   (udt_buffer_t *buffer, uint32_t seqnum);
+int udt_buffer_read_packets(udt_buffer_t *buffer, udt_packet_t *packets, uint32_t *refs, size_t max_n_packets);
 
-ssize_t udt_recv_buffer_write(char *data, ssize_t len);
-ssize_t udt_recv_buffer_read (char *data, ssize_t len);
+ssize_t udt_recv_buffer_write(udt_conn_t *conn, char *data, ssize_t len, int last);
+ssize_t udt_recv_buffer_read (udt_conn_t *conn, char *data, ssize_t len);
 
-ssize_t udt_send_buffer_write(const char *data, ssize_t len);
-int udt_send_packet_buffer_write(udt_packet_t *packet);
-int udt_send_packet_buffer_read (udt_packet_t *packet);
+ssize_t udt_send_buffer_write  (udt_conn_t *conn, const char *data, ssize_t len);
+char   *udt_send_buffer_reserve(udt_conn_t *conn, size_t *len);
+ssize_t udt_send_buffer_commit (udt_conn_t *conn, ssize_t len);
+int udt_send_packet_buffer_write(udt_conn_t *conn, udt_packet_t *packet);
+int udt_send_packet_buffer_read (udt_conn_t *conn, udt_packet_t *packets, udt_packet_t **batch, size_t max_n_packets);
+void udt_send_packet_buffer_release(udt_conn_t *conn, udt_packet_t **batch, size_t n_packets);
 
-ssize_t udt_recv_file_buffer_read (int fd, off_t *offset, ssize_t size);
-ssize_t udt_send_file_buffer_write(int fd, off_t  offset, ssize_t size);
+ssize_t udt_recv_file_buffer_read(udt_conn_t *conn, int fd, off_t *offset, ssize_t size);
 
 #endif // !UDT_BUFFER_H_
@@ -9,41 +9,64 @@
 #include "udt_core.h"
 #include "udt_buffer.h"
 
-udt_buffer_t RECV_BUFFER = {0};
-udt_buffer_t SEND_BUFFER = {0};
+ssize_t udt_recv_buffer_write(udt_conn_t *conn, char *data, ssize_t len, int last)
+{
+    return udt_buffer_write(&(conn->recv_buffer), data, len, last);
+}
 
-extern udt_conn_t connection;
+ssize_t udt_recv_buffer_read(udt_conn_t *conn, char *data, ssize_t len)
+{
+    return udt_buffer_read(&(conn->recv_buffer), data, len);
+}
 
-int udt_recv_buffer_init()
+static void udt_data_header(udt_packet_t *packet, size_t msgnum, int boundary)
 {
-    return udt_buffer_init(&RECV_BUFFER);
+    packet_clear_header (*packet);
+    packet_set_data     (*packet);
+    packet_set_msgnum   (*packet, msgnum);
+    packet_set_boundary (*packet, boundary);
+    packet_set_order    (*packet, 1);
 }
 
-int udt_send_buffer_init()
+static ssize_t udt_send_data_packet(udt_conn_t *conn, const char *data, ssize_t len, size_t msgnum, int boundary)
 {
-    return udt_buffer_init(&SEND_BUFFER);
+    udt_packet_t packet;
+    udt_data_header(&packet, msgnum, boundary);
+
+    // Blocks only while the send window is full
+    return udt_send_window_push(&(conn->send_window), &(packet.header), data, len);
 }
 
-ssize_t udt_recv_buffer_write(char *data, ssize_t len)
+char *udt_send_buffer_reserve(udt_conn_t *conn, size_t *len)
 {
-    return udt_buffer_write(&RECV_BUFFER, data, len);
+    if (len == NULL)
+        return NULL;
+
+    // Blocks only while the send window is full
+    char *payload = udt_send_window_reserve(&(conn->send_window));
+    if (payload == NULL)
+        return NULL;
+
+    *len = udt_mtu_payload(&(conn->mtu));
+
+    return payload;
 }
 
-ssize_t udt_recv_buffer_read(char *data, ssize_t len)
+ssize_t udt_send_buffer_commit(udt_conn_t *conn, ssize_t len)
 {
-    return udt_buffer_read(&RECV_BUFFER, data, len);
+    udt_packet_t packet;
+    udt_data_header(&packet, 1, PACKET_BOUNDARY_SOLO);
+
+    // The payload is already in the reserved packet
+    return udt_send_window_commit(&(conn->send_window), &(packet.header), len);
 }
 
-ssize_t udt_send_buffer_write(const char *data, ssize_t len)
+ssize_t udt_send_buffer_write(udt_conn_t *conn, const char *data, ssize_t len)
 {
     if (data == NULL)
         return -1;
 
-    udt_packet_t packet;
-
-    size_t msgnum  = 1;
-    int    seqnum  = 1; 
-    size_t n_attempts = 0; 
+    size_t msgnum = 1;
 
     ssize_t n_sent_bytes = 0;
     int boundary = PACKET_BOUNDARY_START; 
@@ -51,75 +74,53 @@ ssize_t udt_send_buffer_write(const char *data, ssize_t len)
     long n_bytes_to_send = len;
     const char *buffer = data;
 
+    // Packets fit into datagrams the path takes without fragmentation
+    ssize_t payload_size = udt_mtu_payload(&(conn->mtu));
+
     while (n_bytes_to_send > 0)
     {
-        ssize_t n_packet_bytes = (n_bytes_to_send > PACKET_DATA_SIZE) ? PACKET_DATA_SIZE : n_bytes_to_send;
-        n_bytes_to_send -= PACKET_DATA_SIZE;
+        ssize_t n_packet_bytes = (n_bytes_to_send > payload_size) ? payload_size : n_bytes_to_send;
+        n_bytes_to_send -= n_packet_bytes;
         boundary |= (n_bytes_to_send > 0) ? PACKET_BOUNDARY_NONE : PACKET_BOUNDARY_END;
 
-        connection.last_packet_number = msgnum;
-
-        packet_clear_header (packet);
-        packet_set_data     (packet);
-        packet_set_seqnum   (packet, seqnum++);
-        packet_set_msgnum   (packet, msgnum++);
-        packet_set_boundary (packet, boundary);
-        packet_set_order    (packet, 1);
-        packet_set_timestamp(packet, 0x0000051c);
-        packet_set_id       (packet, 0x08c42c74);
-
-        while (n_attempts < UDT_N_MAX_ATTEMPTS_SEND)
-        {
-            connection.is_in_wait = 1;
-            
-            udt_packet_new(&packet, buffer, n_packet_bytes);
-            udt_send_packet_buffer_write(&packet);
-
-            while (connection.is_in_wait == 1); // wait for ACK signal
-
-            if (connection.no_ack == 1)
-            {
-                connection.no_ack = 0;
-                n_attempts++;
-            }
-            else
-                break;
-        }
-
-        if (n_attempts == UDT_N_MAX_ATTEMPTS_SEND)
+        if (udt_send_data_packet(conn, buffer, n_packet_bytes, msgnum++, boundary) == -1)
             return n_sent_bytes;
 
         n_sent_bytes += n_packet_bytes;
 
         boundary = PACKET_BOUNDARY_NONE;
         buffer += n_packet_bytes;
-
-        n_attempts = 0;
     }
 
-    packet_clear_header (packet);
-    packet_set_ctrl     (packet);
-    packet_set_type     (packet, PACKET_TYPE_ACK2);
-    packet_set_timestamp(packet, 0x0000051c);
-    packet_set_id       (packet, 0x08c42c74);
-
-    udt_packet_new(&packet, NULL, 0);
-    udt_send_packet_buffer_write(&packet);
-
     return n_sent_bytes;
 }
 
-int udt_send_packet_buffer_write(udt_packet_t *packet)
+int udt_send_packet_buffer_write(udt_conn_t *conn, udt_packet_t *packet)
 {
-    return udt_buffer_write_packet(&SEND_BUFFER, packet);
+    return udt_buffer_write_packet(&(conn->send_buffer), packet);
 }
 
-int udt_send_packet_buffer_read(udt_packet_t *packet)
+int udt_send_packet_buffer_read(udt_conn_t *conn, udt_packet_t *packets, udt_packet_t **batch, size_t max_n_packets)
 {
-    return udt_buffer_read_packet(&SEND_BUFFER, packet);
+    uint32_t refs[max_n_packets];
+
+    int n_packets = udt_buffer_read_packets(&(conn->send_buffer), packets, refs, max_n_packets);
+    if (n_packets == 0)
+        return -1; // buffer is closed
+
+    for (int i = 0; i < n_packets; ++i)
+        batch[i] = &(packets[i]);
+
+    // Data packets are sent right from the send window, acknowledged ones are left out
+    return udt_send_window_pin(&(conn->send_window), batch, refs, n_packets);
+}
+
+void udt_send_packet_buffer_release(udt_conn_t *conn, udt_packet_t **batch, size_t n_packets)
+{
+    udt_send_window_unpin(&(conn->send_window), batch, n_packets);
 }
 
-ssize_t udt_recv_file_buffer_read(int fd, off_t *offset, ssize_t size)
+ssize_t udt_recv_file_buffer_read(udt_conn_t *conn, int fd, off_t *offset, ssize_t size)
 {
     char data[PACKET_DATA_SIZE + 1];
     ssize_t retval = 0;
@@ -130,7 +131,7 @@ ssize_t udt_recv_file_buffer_read(int fd, off_t *offset, ssize_t size)
 
     while (buf_size > 0)
     {
-        int n_read_bytes = udt_buffer_read(&RECV_BUFFER, data, PACKET_DATA_SIZE);
+        int n_read_bytes = udt_buffer_read(&(conn->recv_buffer), data, PACKET_DATA_SIZE);
         if (n_read_bytes != PACKET_DATA_SIZE)
             break; // the situation when connection has lost and there is nothing to read
 
@@ -149,86 +150,3 @@ ssize_t udt_recv_file_buffer_read(int fd, off_t *offset, ssize_t size)
 
     return retval;
 }
-
-ssize_t udt_send_file_buffer_write(int fd, off_t offset, ssize_t size)
-{
-    if (fd < 0)
-        return -1;
-
-    udt_packet_t packet;
-    char buffer[PACKET_DATA_SIZE + 1] = {0};
-
-    size_t msgnum = 1;
-    int    seqnum = 1;
-    size_t n_attempts = 0;
-
-    ssize_t n_sent_bytes = 0;
-    int boundary = PACKET_BOUNDARY_START;
-
-    long n_bytes_to_send = size;
-    while (n_bytes_to_send > 0)
-    {
-        ssize_t n_bytes_to_read = (n_bytes_to_send > PACKET_DATA_SIZE) ? PACKET_DATA_SIZE : n_bytes_to_send;
-        ssize_t n_packet_bytes = pread(fd, buffer, n_bytes_to_read, offset);
-        if (n_packet_bytes < 0)
-            break;
-
-        n_bytes_to_send -= n_packet_bytes;
-
-        // If bytes read is less than the desired, then its EOF
-        if (n_packet_bytes < n_bytes_to_read)
-            n_bytes_to_send = 0;
-
-        connection.last_packet_number = msgnum;
-
-        boundary |= (n_bytes_to_send > 0) ? PACKET_BOUNDARY_NONE : PACKET_BOUNDARY_END;
-
-        packet_clear_header (packet);
-        packet_set_data     (packet);
-        packet_set_seqnum   (packet, seqnum++);
-        packet_set_msgnum   (packet, msgnum++);
-        packet_set_boundary (packet, boundary);
-        packet_set_order    (packet, 1);
-        packet_set_timestamp(packet, 0x0000051c);
-        packet_set_id       (packet, 0x08c42c74);
-
-        while (n_attempts < UDT_N_MAX_ATTEMPTS_SEND)
-        {
-            connection.is_in_wait = 1;
-
-            udt_packet_new(&packet, buffer, n_packet_bytes);
-            udt_send_packet_buffer_write(&packet);
-
-            while (connection.is_in_wait == 1); // wait for ACK signal
-
-            if (connection.no_ack == 1)
-            {
-                connection.no_ack = 0;
-                n_attempts++;
-            }
-            else
-                break;
-        }
-
-        if (n_attempts == UDT_N_MAX_ATTEMPTS_SEND)
-            return n_sent_bytes;
-
-        n_sent_bytes += n_packet_bytes;
-
-        boundary = PACKET_BOUNDARY_NONE;
-        offset += n_packet_bytes;
-
-        n_attempts = 0;
-    }
-
-    packet_clear_header (packet);
-    packet_set_ctrl     (packet);
-    packet_set_type     (packet, PACKET_TYPE_ACK2);
-    packet_set_timestamp(packet, 0x0000051c);
-    packet_set_id       (packet, 0x08c42c74);
-
-    udt_packet_new(&packet, NULL, 0);
-    udt_send_packet_buffer_write(&packet);
-
-    return n_sent_bytes;
-}
@@ -0,0 +1,481 @@
+#include "ipv4_net_config.h"
+#include "udt_ccc.h"
+#include "udt_window.h"
+#include "udt_utils.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// CUBIC constants (RFC 8312)
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+
+// Pacing gains over cwnd per rtt (as in Linux TCP pacing)
+#define CUBIC_SLOW_START_GAIN 2.0
+#define CUBIC_AVOIDANCE_GAIN  1.2
+
+// Native rate increase per SYN, packets
+#define NATIVE_MIN_INC 0.01
+
+uint64_t udt_clock_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void udt_rtt_init(udt_rtt_t *rtt)
+{
+    if (rtt == NULL)
+        return;
+
+    rtt->srtt        = UDT_USECONDS_INITIAL_RTT;
+    rtt->rtt_var     = UDT_USECONDS_INITIAL_RTT / 2;
+    rtt->is_measured = 0;
+}
+
+void udt_rtt_update(udt_rtt_t *rtt, uint64_t sample)
+{
+    if (rtt == NULL)
+        return;
+
+    if (rtt->is_measured == 0)
+    {
+        rtt->srtt        = sample;
+        rtt->rtt_var     = sample / 2;
+        rtt->is_measured = 1;
+        return;
+    }
+
+    uint64_t delta = (rtt->srtt > sample) ? rtt->srtt - sample : sample - rtt->srtt;
+
+    rtt->rtt_var = (3 * rtt->rtt_var + delta)  / 4;
+    rtt->srtt    = (7 * rtt->srtt    + sample) / 8;
+}
+
+uint64_t udt_rtt_rto(udt_rtt_t *rtt)
+{
+    if (rtt == NULL)
+        return UDT_USECONDS_MAX_RTO;
+
+    // Timers are checked once per tick, so the variation is never below it
+    uint64_t rto = rtt->srtt + ((4 * rtt->rtt_var > UDT_USECONDS_TIMER_TICK) ? 4 * rtt->rtt_var : UDT_USECONDS_TIMER_TICK);
+
+    if (rto < UDT_USECONDS_MIN_RTO)
+        rto = UDT_USECONDS_MIN_RTO;
+    if (rto > UDT_USECONDS_MAX_RTO)
+        rto = UDT_USECONDS_MAX_RTO;
+
+    return rto;
+}
+
+static void ccc_clamp_cwnd(udt_ccc_t *ccc)
+{
+    if (ccc->cwnd < UDT_CCC_MIN_CWND)
+        ccc->cwnd = UDT_CCC_MIN_CWND;
+    if (ccc->cwnd > ccc->max_cwnd)
+        ccc->cwnd = ccc->max_cwnd;
+}
+
+static int ccc_is_new_loss(udt_ccc_t *ccc, uint32_t first_lost)
+{
+    return udt_seqnum_offset(ccc->last_dec_seqnum, first_lost) > 0;
+}
+
+/*
+ * Native UDT: slow start up to the maximal window, then the sending period
+ * is decreased once per SYN by an amount depending on the spare link
+ * capacity and increased by 1/8 on every new congestion period.
+ */
+
+static void native_leave_slow_start(udt_ccc_t *ccc)
+{
+    ccc->is_slow_start = 0;
+
+    if (ccc->recv_rate > 0)
+        ccc->send_period = 1000000.0 / ccc->recv_rate;
+    else if (ccc->rtt > 0)
+        ccc->send_period = (ccc->rtt + UDT_CCC_SYN_INTERVAL) / ccc->cwnd;
+}
+
+static void native_init(udt_ccc_t *ccc)
+{
+    ccc->cwnd           = UDT_CCC_INITIAL_CWND;
+    ccc->send_period    = 1.0;
+    ccc->is_slow_start  = 1;
+    ccc->last_rate_time = 0;
+}
+
+static void native_on_ack(udt_ccc_t *ccc, size_t n_acked)
+{
+    if (ccc->is_slow_start == 1)
+    {
+        ccc->cwnd += n_acked;
+        if (ccc->cwnd >= ccc->max_cwnd)
+            native_leave_slow_start(ccc);
+
+        return;
+    }
+
+    uint64_t now = udt_clock_usec();
+    if (now - ccc->last_rate_time < UDT_CCC_SYN_INTERVAL)
+        return;
+
+    ccc->last_rate_time = now;
+
+    if (ccc->recv_rate > 0)
+        ccc->cwnd = ccc->recv_rate * (ccc->rtt + UDT_CCC_SYN_INTERVAL) / 1000000.0 + UDT_CCC_INITIAL_CWND;
+
+    double inc = NATIVE_MIN_INC;
+    double spare_bandwidth = ccc->bandwidth - 1000000.0 / ccc->send_period;
+
+    // The increase is in bytes of the spare bandwidth, packets are as large as the path takes
+    double packet_size = (ccc->packet_size > 0) ? ccc->packet_size : sizeof(udt_packet_t);
+
+    if (ccc->bandwidth > 0 && spare_bandwidth > 0)
+    {
+        inc = pow(10.0, ceil(log10(spare_bandwidth * packet_size * 8.0))) * 0.0000015 / packet_size;
+        if (inc < NATIVE_MIN_INC)
+            inc = NATIVE_MIN_INC;
+    }
+
+    ccc->send_period = (ccc->send_period * UDT_CCC_SYN_INTERVAL) / (ccc->send_period * inc + UDT_CCC_SYN_INTERVAL);
+}
+
+static void native_on_loss(udt_ccc_t *ccc, uint32_t first_lost)
+{
+    if (ccc->is_slow_start == 1)
+        native_leave_slow_start(ccc);
+
+    if (ccc_is_new_loss(ccc, first_lost))
+    {
+        ccc->send_period    *= 1.125;
+        ccc->last_dec_seqnum = ccc->max_seqnum;
+    }
+}
+
+static void native_on_timeout(udt_ccc_t *ccc)
+{
+    if (ccc->is_slow_start == 1)
+        native_leave_slow_start(ccc);
+}
+
+/*
+ * CUBIC: the window grows as a cubic function of the time since the last
+ * decrease, data packets are paced evenly over the round-trip time.
+ */
+
+static void cubic_update_period(udt_ccc_t *ccc)
+{
+    if (ccc->rtt == 0)
+        return;
+
+    double gain = (ccc->is_slow_start == 1) ? CUBIC_SLOW_START_GAIN : CUBIC_AVOIDANCE_GAIN;
+    ccc->send_period = ccc->rtt / (ccc->cwnd * gain);
+}
+
+static void cubic_init(udt_ccc_t *ccc)
+{
+    ccc->cwnd          = UDT_CCC_INITIAL_CWND;
+    ccc->ssthresh      = ccc->max_cwnd;
+    ccc->send_period   = 0.0;
+    ccc->is_slow_start = 1;
+    ccc->w_max         = 0.0;
+    ccc->k             = 0.0;
+    ccc->epoch_start   = 0;
+}
+
+static void cubic_on_ack(udt_ccc_t *ccc, size_t n_acked)
+{
+    if (ccc->is_slow_start == 1)
+    {
+        ccc->cwnd += n_acked;
+        if (ccc->cwnd >= ccc->ssthresh)
+        {
+            ccc->is_slow_start = 0;
+            ccc->epoch_start   = 0;
+        }
+    }
+    else
+    {
+        uint64_t now = udt_clock_usec();
+        if (ccc->epoch_start == 0)
+        {
+            ccc->epoch_start = now;
+            if (ccc->cwnd < ccc->w_max)
+                ccc->k = cbrt((ccc->w_max - ccc->cwnd) / CUBIC_C);
+            else
+            {
+                ccc->k     = 0.0;
+                ccc->w_max = ccc->cwnd;
+            }
+        }
+
+        double t = (now + ccc->rtt - ccc->epoch_start) / 1000000.0;
+        double target = CUBIC_C * pow(t - ccc->k, 3.0) + ccc->w_max;
+
+        if (target > ccc->cwnd)
+            ccc->cwnd += (target - ccc->cwnd) / ccc->cwnd * n_acked;
+        else
+            ccc->cwnd += NATIVE_MIN_INC * n_acked / ccc->cwnd;
+    }
+
+    ccc_clamp_cwnd(ccc);
+    cubic_update_period(ccc);
+}
+
+static void cubic_on_loss(udt_ccc_t *ccc, uint32_t first_lost)
+{
+    if (!ccc_is_new_loss(ccc, first_lost))
+        return;
+
+    // Fast convergence: release bandwidth for new flows
+    if (ccc->cwnd < ccc->w_max)
+        ccc->w_max = ccc->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+    else
+        ccc->w_max = ccc->cwnd;
+
+    ccc->cwnd           *= CUBIC_BETA;
+    ccc->ssthresh        = ccc->cwnd;
+    ccc->is_slow_start   = 0;
+    ccc->epoch_start     = 0;
+    ccc->last_dec_seqnum = ccc->max_seqnum;
+
+    ccc_clamp_cwnd(ccc);
+    cubic_update_period(ccc);
+}
+
+static void cubic_on_timeout(udt_ccc_t *ccc)
+{
+    ccc->w_max         = ccc->cwnd;
+    ccc->ssthresh      = ccc->cwnd * CUBIC_BETA;
+    ccc->cwnd          = UDT_CCC_MIN_CWND;
+    ccc->is_slow_start = 1;
+    ccc->epoch_start   = 0;
+
+    if (ccc->ssthresh < UDT_CCC_MIN_CWND)
+        ccc->ssthresh = UDT_CCC_MIN_CWND;
+
+    cubic_update_period(ccc);
+}
+
+static const udt_ccc_ops_t CCC_ALGORITHMS[] =
+{
+    [UDT_CC_NATIVE] = {"native", native_init, native_on_ack, native_on_loss, native_on_timeout},
+    [UDT_CC_CUBIC]  = {"cubic",  cubic_init,  cubic_on_ack,  cubic_on_loss,  cubic_on_timeout },
+};
+
+#define N_CCC_ALGORITHMS (sizeof(CCC_ALGORITHMS) / sizeof(CCC_ALGORITHMS[0]))
+
+int udt_ccc_init(udt_ccc_t *ccc, int algorithm, size_t max_cwnd)
+{
+    if (ccc == NULL || algorithm < 0 || algorithm >= N_CCC_ALGORITHMS)
+        return -1;
+
+    memset(ccc, 0, sizeof(udt_ccc_t));
+
+    ccc->ops             = &CCC_ALGORITHMS[algorithm];
+    ccc->max_cwnd        = max_cwnd;
+    ccc->max_seqnum      = (UDT_INITIAL_SEQNUM - 1) & PACKET_MASK_SEQ;
+    ccc->last_dec_seqnum = ccc->max_seqnum;
+
+    ccc->ops->init(ccc);
+    ccc_clamp_cwnd(ccc);
+
+    return pthread_mutex_init(&(ccc->mutex), NULL);
+}
+
+int udt_ccc_set(udt_ccc_t *ccc, int algorithm)
+{
+    if (ccc == NULL || ccc->ops == NULL || algorithm < 0 || algorithm >= N_CCC_ALGORITHMS)
+        return -1;
+
+    pthread_mutex_lock(&(ccc->mutex));
+
+    ccc->ops = &CCC_ALGORITHMS[algorithm];
+    ccc->ops->init(ccc);
+    ccc_clamp_cwnd(ccc);
+
+    pthread_mutex_unlock(&(ccc->mutex));
+
+    udt_syslog(LOG_INFO, "congestion control: %s", ccc->ops->name);
+
+    return 0;
+}
+
+void udt_ccc_on_ack(udt_ccc_t *ccc, size_t n_acked, uint64_t rtt, uint32_t recv_rate, uint32_t bandwidth, size_t packet_size)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return;
+
+    pthread_mutex_lock(&(ccc->mutex));
+
+    if (rtt > 0)
+        ccc->rtt = rtt;
+    if (recv_rate > 0)
+        ccc->recv_rate = recv_rate;
+    if (bandwidth > 0)
+        ccc->bandwidth = bandwidth;
+    if (packet_size > 0)
+        ccc->packet_size = packet_size;
+
+    ccc->ops->on_ack(ccc, n_acked);
+    ccc_clamp_cwnd(ccc);
+
+    pthread_mutex_unlock(&(ccc->mutex));
+}
+
+void udt_ccc_on_loss(udt_ccc_t *ccc, uint32_t first_lost)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return;
+
+    pthread_mutex_lock(&(ccc->mutex));
+
+    ccc->ops->on_loss(ccc, first_lost);
+    ccc_clamp_cwnd(ccc);
+
+    pthread_mutex_unlock(&(ccc->mutex));
+}
+
+void udt_ccc_on_timeout(udt_ccc_t *ccc)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return;
+
+    pthread_mutex_lock(&(ccc->mutex));
+
+    ccc->ops->on_timeout(ccc);
+    ccc_clamp_cwnd(ccc);
+
+    pthread_mutex_unlock(&(ccc->mutex));
+}
+
+size_t udt_ccc_window(udt_ccc_t *ccc)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return UDT_SEND_WINDOW_SIZE;
+
+    pthread_mutex_lock(&(ccc->mutex));
+    size_t cwnd = (size_t) ccc->cwnd;
+    pthread_mutex_unlock(&(ccc->mutex));
+
+    return cwnd;
+}
+
+uint64_t udt_ccc_pace_delay(udt_ccc_t *ccc)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return 0;
+
+    uint64_t now = udt_clock_usec();
+
+    return (ccc->next_send_time > now + UDT_CCC_PACING_GRANULARITY) ? ccc->next_send_time - now : 0;
+}
+
+void udt_ccc_pace(udt_ccc_t *ccc, uint32_t seqnum)
+{
+    if (ccc == NULL || ccc->ops == NULL)
+        return;
+
+    pthread_mutex_lock(&(ccc->mutex));
+
+    double send_period = ccc->send_period;
+    if (udt_seqnum_offset(ccc->max_seqnum, seqnum) > 0)
+        ccc->max_seqnum = seqnum;
+
+    pthread_mutex_unlock(&(ccc->mutex));
+
+    uint64_t now = udt_clock_usec();
+
+    // Sleeping is too coarse for short periods, so small bursts are allowed
+    if (ccc->next_send_time > now + UDT_CCC_PACING_GRANULARITY)
+    {
+        uint64_t delay = ccc->next_send_time - now;
+        struct timespec ts = {.tv_sec = delay / 1000000, .tv_nsec = (delay % 1000000) * 1000};
+
+        nanosleep(&ts, NULL);
+        now = udt_clock_usec();
+    }
+
+    uint64_t base = (ccc->next_send_time > now) ? ccc->next_send_time : now;
+
+    // The first packet of a probing pair is followed by the second one at once
+    if (seqnum % UDT_CCC_PROBE_INTERVAL == 0)
+        ccc->next_send_time = base;
+    else
+        ccc->next_send_time = base + (uint64_t) send_period;
+}
+
+static int compare_intervals(const void *interval1, const void *interval2)
+{
+    uint64_t value1 = *((const uint64_t *) interval1);
+    uint64_t value2 = *((const uint64_t *) interval2);
+
+    return (value1 > value2) - (value1 < value2);
+}
+
+// Packets per second from the intervals close to the median one, 0 if there are too few of them
+static uint32_t filtered_rate(const uint64_t *intervals)
+{
+    uint64_t sorted[UDT_CCC_N_INTERVALS];
+
+    memcpy(sorted, intervals, sizeof(sorted));
+    qsort(sorted, UDT_CCC_N_INTERVALS, sizeof(uint64_t), compare_intervals);
+
+    uint64_t median = sorted[UDT_CCC_N_INTERVALS / 2];
+    if (median == 0)
+        return 0;
+
+    uint64_t sum = 0;
+    size_t count = 0;
+
+    for (size_t i = 0; i < UDT_CCC_N_INTERVALS; ++i)
+    {
+        if (sorted[i] > median / 8 && sorted[i] < median * 8)
+        {
+            sum += sorted[i];
+            count++;
+        }
+    }
+
+    if (count <= UDT_CCC_N_INTERVALS / 2 || sum == 0)
+        return 0;
+
+    return (uint32_t) (1000000 * count / sum);
+}
+
+void udt_ccc_on_arrival(udt_ccc_rate_t *rate, uint32_t seqnum)
+{
+    if (rate == NULL)
+        return;
+
+    uint64_t now = udt_clock_usec();
+
+    if (rate->last_arrival != 0)
+    {
+        rate->arrival_intervals[rate->arrival_slot] = now - rate->last_arrival;
+        rate->arrival_slot = (rate->arrival_slot + 1) % UDT_CCC_N_INTERVALS;
+
+        if (seqnum % UDT_CCC_PROBE_INTERVAL == 1 && udt_seqnum_inc(rate->last_seqnum) == seqnum) // probing pair
+        {
+            rate->probe_intervals[rate->probe_slot] = now - rate->last_arrival;
+            rate->probe_slot = (rate->probe_slot + 1) % UDT_CCC_N_INTERVALS;
+        }
+    }
+
+    rate->last_arrival = now;
+    rate->last_seqnum  = seqnum;
+}
+
+uint32_t udt_ccc_recv_rate(udt_ccc_rate_t *rate)
+{
+    return (rate == NULL) ? 0 : filtered_rate(rate->arrival_intervals);
+}
+
+uint32_t udt_ccc_bandwidth(udt_ccc_rate_t *rate)
+{
+    return (rate == NULL) ? 0 : filtered_rate(rate->probe_intervals);
+}
@@ -0,0 +1,122 @@
+#ifndef UDT_CCC_H_
+#define UDT_CCC_H_
+
+#define _UNIX03_THREADS
+
+#include "udt.h"
+#include "udt_packet.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct _udt_ccc udt_ccc_t;
+
+/**
+ * The udt congestion control algorithm
+ *
+ * Every event handler is called under the lock of the controller and
+ * updates the congestion window and the sending period.
+ */
+
+typedef struct
+{
+    const char *name;
+
+    void (*init)      (udt_ccc_t *ccc);
+    void (*on_ack)    (udt_ccc_t *ccc, size_t n_acked);
+    void (*on_loss)   (udt_ccc_t *ccc, uint32_t first_lost);
+    void (*on_timeout)(udt_ccc_t *ccc);
+} udt_ccc_ops_t;
+
+/**
+ * The udt congestion controller
+ *
+ * Limits the amount of packets in flight (congestion window) and paces
+ * data packets out of the sender-thread (sending period). ACK and NAK
+ * events come from the receiver-thread.
+ */
+
+struct _udt_ccc
+{
+    const udt_ccc_ops_t *ops;
+
+    double   cwnd;            // congestion window, packets
+    double   max_cwnd;
+    double   ssthresh;
+    double   send_period;     // interval between data packets, microseconds
+    int      is_slow_start;
+
+    uint64_t rtt;             // smoothed round-trip time of the connection, microseconds
+    uint32_t recv_rate;       // packets per second reported by the receiver
+    uint32_t bandwidth;       // link capacity reported by the receiver, packets per second
+    size_t   packet_size;     // datagram size of data packets on the path, bytes
+
+    uint32_t max_seqnum;      // the largest sent sequence number
+    uint32_t last_dec_seqnum; // the largest sent sequence number at the last decrease
+    uint64_t last_rate_time;  // the last rate increase (native)
+
+    double   w_max;           // window before the last decrease (cubic)
+    double   k;               // time to reach w_max again, seconds (cubic)
+    uint64_t epoch_start;     // the last decrease, microseconds (cubic)
+
+    uint64_t next_send_time;  // sender-thread only
+
+    pthread_mutex_t mutex;
+};
+
+/**
+ * The udt arrival rate estimator
+ *
+ * Kept by the receiver-thread: the receiving rate comes from the intervals
+ * between arriving data packets, the link capacity from the intervals
+ * within probing packet pairs sent back to back. Both are reported to the
+ * sender in ACK.
+ */
+
+typedef struct
+{
+    uint64_t last_arrival;
+    uint32_t last_seqnum;
+
+    uint64_t arrival_intervals[UDT_CCC_N_INTERVALS];
+    uint64_t probe_intervals  [UDT_CCC_N_INTERVALS];
+    size_t   arrival_slot;
+    size_t   probe_slot;
+} udt_ccc_rate_t;
+
+/**
+ * The udt round-trip time estimator
+ *
+ * Smoothed round-trip time and its variation as in RFC 6298, the samples
+ * come from time stamps echoed in ACK and ACK2.
+ */
+
+typedef struct
+{
+    uint64_t srtt;    // microseconds
+    uint64_t rtt_var; // microseconds
+    int      is_measured;
+} udt_rtt_t;
+
+uint64_t udt_clock_usec();
+
+void     udt_rtt_init      (udt_rtt_t *rtt);
+void     udt_rtt_update    (udt_rtt_t *rtt, uint64_t sample);
+uint64_t udt_rtt_rto       (udt_rtt_t *rtt);
+
+int      udt_ccc_init      (udt_ccc_t *ccc, int algorithm, size_t max_cwnd);
+int      udt_ccc_set       (udt_ccc_t *ccc, int algorithm);
+
+void     udt_ccc_on_ack    (udt_ccc_t *ccc, size_t n_acked, uint64_t rtt, uint32_t recv_rate, uint32_t bandwidth, size_t packet_size);
+void     udt_ccc_on_loss   (udt_ccc_t *ccc, uint32_t first_lost);
+void     udt_ccc_on_timeout(udt_ccc_t *ccc);
+
+size_t   udt_ccc_window    (udt_ccc_t *ccc);
+void     udt_ccc_pace      (udt_ccc_t *ccc, uint32_t seqnum);
+uint64_t udt_ccc_pace_delay(udt_ccc_t *ccc);
+
+void     udt_ccc_on_arrival(udt_ccc_rate_t *rate, uint32_t seqnum);
+uint32_t udt_ccc_recv_rate (udt_ccc_rate_t *rate);
+uint32_t udt_ccc_bandwidth (udt_ccc_rate_t *rate);
+
+#endif // !UDT_CCC_H_
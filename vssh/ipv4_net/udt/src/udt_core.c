@@ -5,49 +5,170 @@
 
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <time.h>
+#include <netinet/udp.h>
 
-udt_conn_t connection = {0};
+int udt_socket_setup(int socket_fd)
+{
+    // The kernel buffers must hold the whole send window of both sides,
+    // otherwise pipelined packets are dropped before reaching the receiver
+    int buffer_size = 2 * UDT_SEND_WINDOW_SIZE * sizeof(udt_packet_t);
+
+    int retval1 = setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    int retval2 = setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    // Datagrams are never fragmented, the path mtu is found by probes instead of ICMP
+    int mtu_discover = IP_PMTUDISC_PROBE;
+    int retval3 = setsockopt(socket_fd, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_discover, sizeof(mtu_discover));
+
+    return (retval1 == -1 || retval2 == -1 || retval3 == -1) ? -1 : 0;
+}
+
+udt_conn_t *udt_conn_new(int socket_fd, int is_client)
+{
+    // Counters of the buffers are kept in their own cache lines
+    udt_conn_t *conn = (udt_conn_t *) aligned_alloc(UDT_CACHE_LINE_SIZE, sizeof(udt_conn_t));
+    if (conn == NULL)
+        return NULL;
+
+    memset(conn, 0, sizeof(udt_conn_t));
+
+    atomic_init(&(conn->n_refs), 1); // of the creator
+
+    conn->socket_fd = socket_fd;
+    conn->handle_fd = socket_fd;
+    conn->is_client = is_client;
+    conn->is_gso    = UDT_IO_OFFLOAD;
+
+    // Only has to differ between sockets talking from the same address and port
+    conn->id = (uint32_t) (udt_clock_usec() ^ (uintptr_t) conn) & PACKET_MASK_SEQ;
+    if (conn->id == 0)
+        conn->id = 1;
+
+    if (udt_buffer_init(&(conn->send_buffer), UDT_SEND_BUFFER_SIZE) != 0 ||
+        udt_buffer_init(&(conn->recv_buffer), UDT_RECV_BUFFER_SIZE) != 0)
+    {
+        udt_buffer_destroy(&(conn->send_buffer));
+        udt_buffer_destroy(&(conn->recv_buffer));
+        free(conn);
+        return NULL;
+    }
 
-pthread_mutex_t handshake_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  handshake_cond  = PTHREAD_COND_INITIALIZER;
+    if (udt_send_window_init(&(conn->send_window), UDT_SEND_WINDOW_SIZE, UDT_INITIAL_SEQNUM, &(conn->send_buffer)) != 0 ||
+        udt_recv_window_init(&(conn->recv_window), UDT_RECV_WINDOW_SIZE, 0)                                        != 0)
+    {
+        udt_send_window_destroy(&(conn->send_window));
+        udt_buffer_destroy(&(conn->send_buffer));
+        udt_buffer_destroy(&(conn->recv_buffer));
+        free(conn);
+        return NULL;
+    }
 
-extern udt_buffer_t RECV_BUFFER;
-extern udt_buffer_t SEND_BUFFER;
+    udt_ccc_init(&(conn->ccc), UDT_CCC_DEFAULT, UDT_SEND_WINDOW_SIZE);
+    udt_send_window_set_cwnd(&(conn->send_window), udt_ccc_window(&(conn->ccc)));
+    udt_rtt_init(&(conn->rtt));
+    udt_mtu_init(&(conn->mtu), sizeof(udt_packet_t));
 
-int udt_startup()
+    pthread_mutex_init(&(conn->handshake_mutex), NULL);
+    pthread_cond_init (&(conn->handshake_cond),  NULL);
+
+    return conn;
+}
+
+void udt_conn_free(udt_conn_t *conn)
 {
-    return udt_send_buffer_init() || udt_recv_buffer_init();
+    if (conn == NULL)
+        return;
+
+    // Sender-thread sends everything queued before (shutdown as well) and exits
+    udt_buffer_close(&(conn->send_buffer));
+    if (conn->send_thread != 0)
+        pthread_join(conn->send_thread, NULL);
+
+    udt_buffer_close(&(conn->recv_buffer));
+
+    udt_send_window_destroy(&(conn->send_window));
+    udt_recv_window_destroy(&(conn->recv_window));
+    udt_table_destroy(&(conn->table));
+
+    udt_buffer_destroy(&(conn->send_buffer));
+    udt_buffer_destroy(&(conn->recv_buffer));
+
+    pthread_mutex_destroy(&(conn->handshake_mutex));
+    pthread_cond_destroy (&(conn->handshake_cond));
+
+    // The socket of a closed client is kept until its sender-thread is over
+    if (conn->is_client == 1 && conn->is_closed == 1)
+        close(conn->socket_fd);
+
+    free(conn);
 }
 
-void udt_handshake_init()
+udt_conn_t *udt_conn_ref(udt_conn_t *conn)
+{
+    if (conn != NULL)
+        atomic_fetch_add_explicit(&(conn->n_refs), 1, memory_order_relaxed);
+
+    return conn;
+}
+
+void udt_conn_put(udt_conn_t *conn)
+{
+    if (conn == NULL)
+        return;
+
+    if (atomic_fetch_sub_explicit(&(conn->n_refs), 1, memory_order_acq_rel) == 1)
+        udt_conn_free(conn);
+}
+
+void udt_handshake_init(udt_conn_t *conn)
 {
     udt_packet_t packet;
     size_t n_attempts_to_connect = UDT_N_MAX_ATTEMPTS_CONN;
 
-    while (connection.is_connected == 0 && n_attempts_to_connect > 0)
-    {
-        pthread_mutex_lock(&handshake_mutex);
-
-        udt_packet_new_handshake(&packet);
-        udt_send_packet_buffer_write(&packet);
+    pthread_mutex_lock(&(conn->handshake_mutex));
 
-        pthread_cond_wait(&handshake_cond, &handshake_mutex);
-        pthread_mutex_unlock(&handshake_mutex);
+    while (conn->is_connected == 0 && n_attempts_to_connect > 0)
+    {
+        udt_packet_new_handshake(conn, &packet);
+        udt_send_packet_buffer_write(conn, &packet);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += UDT_SECONDS_TIMEOUT_CONN;
+        deadline.tv_nsec += UDT_USECONDS_TIMEOUT_CONN * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
 
-        pthread_mutex_init(&handshake_mutex, NULL);
-        pthread_cond_init (&handshake_cond,  NULL);
+        // Woken up by the receiver-thread as soon as the response comes
+        int wait_error = 0;
+        while (conn->is_connected == 0 && wait_error != ETIMEDOUT)
+            wait_error = pthread_cond_timedwait(&(conn->handshake_cond), &(conn->handshake_mutex), &deadline);
 
         n_attempts_to_connect--;
     }
+
+    pthread_mutex_unlock(&(conn->handshake_mutex));
 }
 
-void udt_handshake_terminate()
+void udt_handshake_terminate(udt_conn_t *conn)
 {
-    connection.is_connected = 1;
+    pthread_mutex_lock(&(conn->handshake_mutex));
+    conn->is_connected = 1;
+    pthread_mutex_unlock(&(conn->handshake_mutex));
+
+    pthread_cond_broadcast(&(conn->handshake_cond));
 }
 
-void udt_connection_close()
+void udt_connection_close(udt_conn_t *conn)
 {
+    // Everything sent before must be delivered ahead of the shutdown
+    if (udt_send_window_flush(&(conn->send_window)) == -1)
+        udt_syslog(LOG_NOTICE, "connection is closed with unacknowledged packets");
+
     udt_packet_t packet;
 
     packet_clear_header(packet);
@@ -55,38 +176,321 @@ void udt_connection_close()
     packet_set_type    (packet, PACKET_TYPE_SHUTDOWN);
 
     udt_packet_new(&packet, NULL, 0);
-    udt_send_packet_buffer_write(&packet);
+    udt_send_packet_buffer_write(conn, &packet);
+}
+
+// Waits for receiver-thread of the listening socket to take the closed connection out of
+// its table, then the last reference can't be put by receiver-thread
+void udt_connection_unlink(udt_conn_t *conn)
+{
+    pthread_mutex_lock(&(conn->handshake_mutex));
+
+    conn->is_closed = 1;
+    while (conn->is_unlinked == 0)
+        pthread_cond_wait(&(conn->handshake_cond), &(conn->handshake_mutex));
+
+    pthread_mutex_unlock(&(conn->handshake_mutex));
+}
+
+void udt_timers_start(udt_conn_t *conn, uint64_t idle_timeout)
+{
+    conn->idle_timeout       = idle_timeout;
+    conn->saved_idle_timeout = idle_timeout;
+    conn->last_recv_time     = udt_clock_usec();
+    conn->last_nak_time      = conn->last_recv_time;
+    conn->last_check_time    = conn->last_recv_time;
+}
+
+static void udt_connection_lost(udt_conn_t *conn)
+{
+    conn->is_connected = 0;
+    udt_send_window_break(&(conn->send_window));
+    udt_syslog(LOG_NOTICE, "disconnection has occured from peer: IP = %s, port = %d",
+               inet_ntoa(conn->addr.sin_addr), (int) ntohs(conn->addr.sin_port));
+
+    udt_buffer_close(&(conn->recv_buffer)); // wakes up udt_recv()
+
+    if (conn->is_client == 1)
+    {
+        struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+        setsockopt(conn->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval));
+    }
 }
 
-void udt_prepare_to_fork()
+static void udt_timers_check(udt_conn_t *conn, uint64_t now)
 {
-    if (connection.is_main_server != 1)
+    if (conn->is_connected == 0 || now - conn->last_check_time < UDT_USECONDS_TIMER_TICK)
+        return;
+
+    conn->last_check_time = now;
+
+    uint64_t rto = udt_rtt_rto(&(conn->rtt));
+
+    // Retransmission timer: nothing is acknowledged for rto
+    int n_resent = udt_send_window_timeout(&(conn->send_window), rto);
+    if (n_resent > 0)
+    {
+        udt_ccc_on_timeout(&(conn->ccc));
+        udt_send_window_set_cwnd(&(conn->send_window), udt_ccc_window(&(conn->ccc)));
+    }
+    else if (n_resent == -1)
+    {
+        udt_connection_lost(conn);
         return;
+    }
+
+    // NAK timer: losses are reported again until retransmissions fill them
+    if (now - conn->last_nak_time >= rto)
+    {
+        uint32_t loss_list[PACKET_MAX_LOSS_LENGTH];
+        size_t loss_length = udt_recv_window_losses(&(conn->recv_window), loss_list, PACKET_MAX_LOSS_LENGTH);
 
-    pthread_mutex_init(&handshake_mutex, NULL);
-    pthread_cond_init (&handshake_cond,  NULL);
+        if (loss_length > 0)
+            udt_packet_send_nak(conn, loss_list, loss_length);
+    }
+
+    // Path mtu probe: a larger datagram is tried until the peer answers it
+    size_t probe_size = udt_mtu_probe(&(conn->mtu), now, rto);
+    if (probe_size > 0)
+        udt_packet_send_probe(conn, probe_size);
 
-    pthread_cond_signal(&SEND_BUFFER.cond);
-    pthread_mutex_init(&SEND_BUFFER.mutex, NULL);
-    pthread_cond_init (&SEND_BUFFER.cond,  NULL);
+    // Inactivity timer
+    if (udt_send_window_n_flight(&(conn->send_window)) == 0 && now - conn->last_recv_time >= conn->idle_timeout)
+        udt_connection_lost(conn);
 }
 
-void udt_child_after_fork()
+static void udt_listener_check(udt_conn_t *listener, uint64_t now)
 {
-    if (connection.is_main_server != 1)
+    if (now - listener->last_check_time < UDT_USECONDS_TIMER_TICK)
         return;
 
-    connection.is_main_server = 0;
-    memset(&connection.last_addr, 0, sizeof(connection.last_addr));
-    connection.last_packet_number = 0;
+    listener->last_check_time = now;
+
+    udt_conn_t *conn = listener->table.first;
+    while (conn != NULL)
+    {
+        udt_conn_t *next = conn->list_next;
+
+        // udt_close() holds a reference until the connection is unlinked, so freeing
+        // and joining sender-thread never happen on this thread
+        if (conn->is_closed == 1)
+        {
+            udt_table_remove(&(listener->table), conn);
+            udt_conn_put(conn);
+
+            pthread_mutex_lock(&(conn->handshake_mutex));
+            conn->is_unlinked = 1;
+            pthread_cond_broadcast(&(conn->handshake_cond));
+            pthread_mutex_unlock(&(conn->handshake_mutex));
+        }
+        else
+            udt_timers_check(conn, now);
 
-    close(connection.socket_fd);
+        conn = next;
+    }
+}
 
-    connection.recv_thread = pthread_self();
-    pthread_create(&connection.send_thread, NULL, udt_sender_start, (void *) &connection);
+static udt_conn_t *udt_listener_accept(udt_conn_t *listener, const struct sockaddr_in *addr, udt_packet_t *packet)
+{
+    udt_conn_t *conn = udt_conn_new(listener->socket_fd, 0);
+    if (conn == NULL)
+    {
+        udt_syslog(LOG_ERR, "couldn't create connection for client...");
+        return NULL;
+    }
 
+    conn->handle_fd = dup(listener->socket_fd);
+    if (conn->handle_fd == -1)
+    {
+        udt_syslog(LOG_ERR, "couldn't create descriptor for client: %s", strerror(errno));
+        udt_conn_free(conn);
+        return NULL;
+    }
+
+    conn->type           = listener->type;
+    conn->addr           = *addr;
+    conn->addrlen        = sizeof(struct sockaddr_in);
+    conn->peer_id        = ntohl(packet->header._head3);
+    conn->server_handler = listener->server_handler;
+
+    udt_timers_start(conn, (uint64_t) UDT_SECONDS_TIMEOUT_SERVER * 1000000 + UDT_USECONDS_TIMEOUT_SERVER);
+    udt_recv_window_start(&(conn->recv_window), ntohl(((uint32_t *) packet->data)[2]));
+    udt_mtu_negotiate(&(conn->mtu), ntohl(((uint32_t *) packet->data)[3]));
+
+    if (udt_handle_register(conn->handle_fd, conn) == -1 ||
+        pthread_create(&(conn->send_thread), NULL, udt_sender_start, (void *) conn) != 0)
+    {
+        udt_syslog(LOG_ERR, "couldn't start connection for client...");
+        udt_handle_unregister(conn->handle_fd);
+        close(conn->handle_fd);
+        udt_conn_free(conn);
+        return NULL;
+    }
+
+    udt_table_insert(&(listener->table), conn);
+
+    udt_packet_t response;
+    udt_packet_new_handshake(conn, &response);
+    udt_send_packet_buffer_write(conn, &response);
+    udt_handshake_terminate(conn);
+
+    // The handler owns the descriptor and closes it when the job is done
     pthread_t server_thread;
-    pthread_create(&server_thread, NULL, connection.server_handler, (void *) &connection.socket_fd);
+    if (pthread_create(&server_thread, NULL, conn->server_handler, (void *) (intptr_t) conn->handle_fd) != 0)
+    {
+        udt_syslog(LOG_ERR, "couldn't start server handler for client...");
+        conn->is_connected = 0;
+        udt_handle_unregister(conn->handle_fd);
+        close(conn->handle_fd);
+
+        // Nobody else knows the connection, it is the only one freed by this thread
+        udt_table_remove(&(listener->table), conn);
+        udt_conn_put(conn);
+
+        return NULL;
+    }
+
+    pthread_detach(server_thread);
+
+    udt_syslog(LOG_NOTICE, "new connection: IP = %s, port = %d, %zu connections",
+               inet_ntoa(addr->sin_addr), (int) ntohs(addr->sin_port), listener->table.n_conns);
+
+    return conn;
+}
+
+static size_t udt_sender_send(udt_conn_t *conn, udt_packet_t **packets, size_t n_packets)
+{
+    struct mmsghdr messages[UDT_IO_BATCH_SIZE];
+    struct iovec   vectors [UDT_IO_BATCH_SIZE];
+
+    for (size_t i = 0; i < n_packets; ++i)
+    {
+        vectors[i].iov_base = packets[i];
+        vectors[i].iov_len  = packet_size(*packets[i]);
+
+        memset(&(messages[i]), 0, sizeof(struct mmsghdr));
+        messages[i].msg_hdr.msg_name    = &(conn->addr);
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        messages[i].msg_hdr.msg_iov     = &(vectors[i]);
+        messages[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    size_t n_sent_packets = 0;
+    while (n_sent_packets < n_packets)
+    {
+        int n_sent = sendmmsg(conn->socket_fd, messages + n_sent_packets, n_packets - n_sent_packets, 0);
+        if (n_sent == -1)
+        {
+            udt_syslog(LOG_ERR, "sendmmsg() error: %s", strerror(errno));
+            n_sent = 1; // the packet is recovered by retransmission
+        }
+
+        n_sent_packets += n_sent;
+    }
+
+    return n_sent_packets;
+}
+
+// Data packets of the same size go as datagrams of several segments split by the kernel
+// or the network card, control packets (probes larger than the path) go alone, returns
+// the amount of packets sent before the offload turned out to be unsupported
+static size_t udt_sender_send_gso(udt_conn_t *conn, udt_packet_t **packets, size_t n_packets)
+{
+    struct mmsghdr messages  [UDT_IO_BATCH_SIZE];
+    struct iovec   vectors   [UDT_IO_BATCH_SIZE];
+    char           controls  [UDT_IO_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    size_t         n_segments[UDT_IO_BATCH_SIZE];
+
+    size_t n_messages = 0;
+
+    for (size_t i = 0; i < n_packets; i += n_segments[n_messages++])
+    {
+        // Every segment but the last one is of the same size
+        uint16_t segment_size   = packet_size(*packets[i]);
+        size_t   max_n_segments = UDT_IO_OFFLOAD_SIZE / segment_size;
+
+        n_segments[n_messages] = 0;
+        for (size_t j = i; j < n_packets && n_segments[n_messages] < max_n_segments; ++j)
+        {
+            int is_control = (ntohl(packets[j]->header._head0) & PACKET_MASK_CTRL) != 0;
+
+            size_t size = packet_size(*packets[j]);
+            if (size > segment_size || (is_control && j > i))
+                break;
+
+            vectors[j].iov_base = packets[j];
+            vectors[j].iov_len  = size;
+            n_segments[n_messages]++;
+
+            if (size < segment_size || is_control)
+                break;
+        }
+
+        struct msghdr *header = &(messages[n_messages].msg_hdr);
+        memset(&(messages[n_messages]), 0, sizeof(struct mmsghdr));
+        header->msg_name    = &(conn->addr);
+        header->msg_namelen = sizeof(struct sockaddr_in);
+        header->msg_iov     = &(vectors[i]);
+        header->msg_iovlen  = n_segments[n_messages];
+
+        if (n_segments[n_messages] == 1)
+            continue;
+
+        header->msg_control    = controls[n_messages];
+        header->msg_controllen = sizeof(controls[n_messages]);
+
+        struct cmsghdr *control = CMSG_FIRSTHDR(header);
+        control->cmsg_level = SOL_UDP;
+        control->cmsg_type  = UDP_SEGMENT;
+        control->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+
+        memcpy(CMSG_DATA(control), &segment_size, sizeof(segment_size));
+    }
+
+    size_t n_sent_messages = 0;
+    size_t n_sent_packets  = 0;
+
+    while (n_sent_messages < n_messages)
+    {
+        int n_sent = sendmmsg(conn->socket_fd, messages + n_sent_messages, n_messages - n_sent_messages, 0);
+        if (n_sent == -1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+        {
+            udt_syslog(LOG_NOTICE, "segmentation offload is unsupported, plain datagrams are sent: %s", strerror(errno));
+            conn->is_gso = 0;
+
+            return n_sent_packets;
+        }
+        else if (n_sent == -1)
+        {
+            udt_syslog(LOG_ERR, "sendmmsg() error: %s", strerror(errno));
+            n_sent = 1; // the packets are recovered by retransmission
+        }
+
+        for (int i = 0; i < n_sent; ++i)
+            n_sent_packets += n_segments[n_sent_messages + i];
+
+        n_sent_messages += n_sent;
+    }
+
+    return n_sent_packets;
+}
+
+static void udt_sender_flush(udt_conn_t *conn, udt_packet_t **packets, size_t n_packets)
+{
+    uint32_t now = htonl((uint32_t) udt_clock_usec());
+
+    for (size_t i = 0; i < n_packets; ++i)
+    {
+        packets[i]->header._head2 = now;             // time stamp
+        packets[i]->header._head3 = htonl(conn->id); // socket id
+    }
+
+    size_t n_sent_packets = 0;
+    if (conn->is_gso == 1 && n_packets > 1)
+        n_sent_packets = udt_sender_send_gso(conn, packets, n_packets);
+
+    if (n_sent_packets < n_packets)
+        udt_sender_send(conn, packets + n_sent_packets, n_packets - n_sent_packets);
 }
 
 void *udt_sender_start(void *arg)
@@ -96,22 +500,90 @@ void *udt_sender_start(void *arg)
 
     udt_syslog(LOG_INFO, "sender-thread is ready to send packets");
 
-    udt_packet_t packet;
+    udt_conn_t *conn = (udt_conn_t *) arg;
+    udt_packet_t  packets[UDT_IO_BATCH_SIZE]; // control packets
+    udt_packet_t *batch  [UDT_IO_BATCH_SIZE]; // the same ones and data packets in the send window
 
-    while (udt_send_packet_buffer_read(&packet))
+    int n_packets = 0;
+    while ((n_packets = udt_send_packet_buffer_read(conn, packets, batch, UDT_IO_BATCH_SIZE)) != -1)
     {
-        ssize_t n_sent_bytes = sendto(connection.socket_fd, &packet, sizeof(udt_packet_t), 0,
-                                      (struct sockaddr *) &(connection.addr), sizeof(struct sockaddr));
-        if (n_sent_bytes == -1)
-            udt_syslog(LOG_ERR, "sendto() error: %s", strerror(errno));
+        int first = 0;
 
-        memset(&packet, 0, sizeof(udt_packet_t));
+        for (int i = 0; i < n_packets; ++i)
+        {
+            uint32_t head0 = ntohl(batch[i]->header._head0);
+            if ((head0 & PACKET_MASK_CTRL) != 0) // control packets go at once
+                continue;
+
+            // Packets paced already leave before the sender-thread sleeps
+            if (i > first && udt_ccc_pace_delay(&(conn->ccc)) > 0)
+            {
+                udt_sender_flush(conn, batch + first, i - first);
+                first = i;
+            }
+
+            udt_ccc_pace(&(conn->ccc), head0 & PACKET_MASK_SEQ);
+        }
+
+        udt_sender_flush(conn, batch + first, n_packets - first);
+        udt_send_packet_buffer_release(conn, batch, n_packets);
     }
 
     void *retval = 0;
     pthread_exit(retval);
 }
 
+static void udt_receiver_dispatch(udt_conn_t *self, const char *data, size_t len, struct sockaddr_in *addr)
+{
+    udt_syslog(LOG_INFO, "message from IP = %s, port = %d\n", inet_ntoa(addr->sin_addr), (int) ntohs(addr->sin_port));
+
+    if (len < sizeof(udt_packet_header_t) || len > sizeof(udt_packet_t))
+        return;
+
+    udt_packet_t datagram;
+    udt_packet_t *packet = &datagram;
+
+    memcpy(packet, data, len);
+    memset((char *) packet + len, 0, sizeof(udt_packet_t) - len);
+
+    // Requests of clients looking for servers aren't udt packets and carry no length
+    if (udt_handle_request_packet(self->socket_fd, packet, addr) != 0)
+        return;
+
+    if (packet_size(*packet) != len) // truncated or malformed
+        return;
+
+    uint32_t peer_id = ntohl(packet->header._head3);
+    udt_conn_t *conn = NULL;
+
+    if (self->is_listener == 1)
+    {
+        conn = udt_table_find(&(self->table), addr, peer_id);
+
+        uint32_t head0 = ntohl(packet->header._head0);
+        int is_handshake = (head0 & PACKET_MASK_CTRL) != 0 && (head0 & PACKET_MASK_TYPE) == PACKET_TYPE_HANDSHAKE;
+
+        if (conn == NULL && is_handshake)
+        {
+            udt_listener_accept(self, addr, packet);
+            return;
+        }
+    }
+    else if (addr->sin_addr.s_addr == self->addr.sin_addr.s_addr && addr->sin_port == self->addr.sin_port &&
+             (self->is_connected == 0 || peer_id == self->peer_id))
+        conn = self;
+
+    if (conn == NULL)
+    {
+        udt_syslog(LOG_ERR, "message from unknown source");
+        return;
+    }
+
+    conn->last_recv_time = udt_clock_usec();
+
+    udt_packet_parse(conn, *packet);
+}
+
 void *udt_receiver_start(void *arg)
 {
     int old_type = 0;
@@ -119,68 +591,104 @@ void *udt_receiver_start(void *arg)
 
     udt_syslog(LOG_INFO, "receiver-thread is ready to receive packets");
 
-    udt_packet_t packet;
-    memset(&packet, 0, sizeof(udt_packet_t));
+    udt_conn_t *self = (udt_conn_t *) arg;
 
-    while (1)
+    // Receiver-thread wakes up once per tick at least to check timers
+    struct timeval tv = {.tv_sec = 0, .tv_usec = UDT_USECONDS_TIMER_TICK};
+    setsockopt(self->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval));
+
+    // Coalesced datagrams of the same source come together, split by their segment size
+    int is_gro = UDT_IO_OFFLOAD;
+    if (is_gro == 1 && setsockopt(self->socket_fd, SOL_UDP, UDP_GRO, &is_gro, sizeof(is_gro)) == -1)
     {
-        int recv_error = recvfrom(connection.socket_fd, &packet, sizeof(udt_packet_t), 0,
-                                  (struct sockaddr *) &(connection.last_addr), &(connection.addrlen));
+        udt_syslog(LOG_NOTICE, "receive offload is unsupported: %s", strerror(errno));
+        is_gro = 0;
+    }
 
-        if (recv_error == -1 && errno == EAGAIN)
-        {
-            if (connection.is_in_wait == 1) // send packet
-            {
-                connection.no_ack = 1;
-                connection.is_in_wait = 0;
-            }
-            else if (connection.is_connected == 1) // already connected
-            {
-                connection.is_connected = 0;
-                connection.is_in_wait   = 0;
-                connection.addr.sin_addr.s_addr = 0;
-                udt_syslog(LOG_NOTICE, "disconnection has occured from client: IP = %s, port = %d", 
-                           inet_ntoa(connection.addr.sin_addr), (int) ntohs(connection.addr.sin_port));
+    size_t buffer_size = (is_gro == 1) ? UDT_IO_OFFLOAD_SIZE : sizeof(udt_packet_t);
+    char *buffers = (char *) malloc(UDT_IO_BATCH_SIZE * buffer_size);
+    if (buffers == NULL)
+    {
+        udt_syslog(LOG_ERR, "couldn't allocate receive buffers");
+        pthread_exit(NULL);
+    }
 
-                pthread_cond_signal(&(RECV_BUFFER.cond));
+    pthread_cleanup_push(free, buffers); // the thread of a client is cancelled
 
-                struct timeval tv = {.tv_sec = 0, .tv_usec = 0};    
-                setsockopt(connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval));
+    struct sockaddr_in addrs   [UDT_IO_BATCH_SIZE];
+    struct mmsghdr     messages[UDT_IO_BATCH_SIZE];
+    struct iovec       vectors [UDT_IO_BATCH_SIZE];
+    char               controls[UDT_IO_BATCH_SIZE][CMSG_SPACE(sizeof(int))];
 
-                if (connection.is_client == 0)
-                {
-                    udt_syslog(LOG_NOTICE, "exit because of disconnection");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else // process of connection (client)
-                pthread_cond_signal(&handshake_cond);
+    memset(messages, 0, sizeof(messages));
 
-            errno = 0;
-            continue;
-        }
-        else if (recv_error == -1)
+    for (int i = 0; i < UDT_IO_BATCH_SIZE; ++i)
+    {
+        vectors[i].iov_base = buffers + i * buffer_size;
+        vectors[i].iov_len  = buffer_size;
+
+        messages[i].msg_hdr.msg_name   = &(addrs[i]);
+        messages[i].msg_hdr.msg_iov    = &(vectors[i]);
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1)
+    {
+        for (int i = 0; i < UDT_IO_BATCH_SIZE; ++i)
         {
-            udt_syslog(LOG_ERR, "recvfrom() error: %s", strerror(errno));
-            continue;
+            messages[i].msg_hdr.msg_namelen    = sizeof(struct sockaddr_in);
+            messages[i].msg_hdr.msg_control    = (is_gro == 1) ? controls[i] : NULL;
+            messages[i].msg_hdr.msg_controllen = (is_gro == 1) ? sizeof(controls[i]) : 0;
         }
 
-        udt_syslog(LOG_INFO, "message from IP = %s, port = %d\n", inet_ntoa(connection.last_addr.sin_addr), (int) ntohs(connection.last_addr.sin_port));
+        // Waits for the first datagram only, the rest are those already queued
+        int n_messages = recvmmsg(self->socket_fd, messages, UDT_IO_BATCH_SIZE, MSG_WAITFORONE, NULL);
 
-        if (connection.is_connected == 0)
-            connection.addr = connection.last_addr;
-        else if (connection.last_addr.sin_addr.s_addr != connection.addr.sin_addr.s_addr || connection.last_addr.sin_port != connection.addr.sin_port)
+        if (n_messages == -1 && errno == EAGAIN)
+            n_messages = 0;
+        else if (n_messages == -1)
         {
-            udt_syslog(LOG_ERR, "message from unknown source");
+            udt_syslog(LOG_ERR, "recvmmsg() error: %s", strerror(errno));
             continue;
         }
 
-        if (udt_handle_request_packet(&packet) != 0)
-            continue;
+        for (int i = 0; i < n_messages; ++i)
+        {
+            size_t len          = messages[i].msg_len;
+            size_t segment_size = len;
+
+            struct cmsghdr *control = NULL;
+            for (control = CMSG_FIRSTHDR(&(messages[i].msg_hdr)); control != NULL; control = CMSG_NXTHDR(&(messages[i].msg_hdr), control))
+            {
+                if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+                {
+                    int gso_size = 0;
+                    memcpy(&gso_size, CMSG_DATA(control), sizeof(gso_size));
+                    segment_size = gso_size;
+                }
+            }
+
+            if (segment_size == 0)
+                continue;
 
-        udt_packet_parse(packet);
+            for (size_t offset = 0; offset < len; offset += segment_size)
+            {
+                size_t n_bytes = (len - offset < segment_size) ? len - offset : segment_size;
+                udt_receiver_dispatch(self, (char *) vectors[i].iov_base + offset, n_bytes, &(addrs[i]));
+            }
+        }
+
+        // Parsing may restart timers, so the clock is read afterwards
+        if (self->is_listener == 1)
+            udt_listener_check(self, udt_clock_usec());
+        else
+            udt_timers_check(self, udt_clock_usec());
+
+        errno = 0;
     }
 
+    pthread_cleanup_pop(1);
+
     void *retval = 0;
     pthread_exit(retval);
 }
@@ -2,6 +2,13 @@
 #define UDT_CORE_H_
 
 #include "ipv4_net_config.h"
+#include "udt_buffer.h"
+#include "udt_window.h"
+#include "udt_table.h"
+#include "udt_ccc.h"
+#include "udt_mtu.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -11,50 +18,97 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
-typedef struct
+/**
+ * The udt connection
+ *
+ * A client connection owns its socket and both threads. Connections of
+ * a server share the listening socket and its receiver-thread, each one
+ * has its own sender-thread and a duplicate of the listening socket as
+ * the descriptor given to the application. The listening socket itself
+ * is a connection too: it keeps the table of its connections.
+ *
+ * A connection is referenced by its descriptor, by the table of the
+ * listening socket and by every call of the application in progress,
+ * the last reference frees it. udt_close() waits for the table to let a
+ * connection go, so receiver-thread never frees one.
+ */
+
+struct _udt_conn
 {
-    int socket_fd;
+    int socket_fd; // the socket datagrams go through
+    int handle_fd; // the descriptor known to the application
     int type;
 
+    uint32_t id;      // socket id of this side, carried by every sent packet
+    uint32_t peer_id; // socket id of the other side
+
     struct
     {
-        struct sockaddr_in last_addr;
         struct sockaddr_in addr;
         socklen_t addrlen;
     };
 
-    int is_connected;
-    int is_client;
-    int is_in_wait;
+    atomic_int n_refs;
+    atomic_int is_connected; // read by application threads
+    atomic_int is_closed;    // the application has closed the descriptor
+    int        is_unlinked;  // out of the table of the listening socket, under handshake_mutex
+    int        is_client;
+    int        is_listener;
+    int        is_gso;       // sender-thread sends segmentation offloaded datagrams
+
+    udt_buffer_t send_buffer; // packets to be sent by sender-thread
+    udt_buffer_t recv_buffer; // data delivered to the application
 
-    int no_ack;
-    size_t last_packet_number;
+    udt_send_window_t send_window;
+    udt_recv_window_t recv_window;
 
-    int is_main_server;
+    udt_ccc_t      ccc;
+    udt_ccc_rate_t recv_rate;
 
     struct
-    {   
+    {
         pthread_t recv_thread;
         pthread_t send_thread;
     };
 
-    struct timeval saved_tv;
+    udt_rtt_t rtt;
+    udt_mtu_t mtu;
 
+    struct
+    {
+        uint64_t idle_timeout;       // inactivity before disconnection, microseconds
+        uint64_t saved_idle_timeout; // while a message is being received
+        uint64_t last_recv_time;
+        uint64_t last_nak_time;
+        uint64_t last_ack2_time;
+        uint64_t last_check_time;
+    };
+
+    pthread_mutex_t handshake_mutex; // waits for the handshake and for the unlinking
+    pthread_cond_t  handshake_cond;
+
+    udt_table_t table; // listening socket only
     void* (*server_handler)(void *);
-} udt_conn_t;
 
-extern udt_conn_t connection;
+    udt_conn_t *next;      // in the chain of the connection table
+    udt_conn_t *list_prev; // in the list of all connections of the table
+    udt_conn_t *list_next;
+};
 
-int udt_startup();
+int udt_socket_setup(int socket_fd);
 
-void udt_handshake_init     ();
-void udt_handshake_terminate();
-void udt_connection_close   ();
+udt_conn_t *udt_conn_new (int socket_fd, int is_client);
+void        udt_conn_free(udt_conn_t *conn);
+udt_conn_t *udt_conn_ref (udt_conn_t *conn);
+void        udt_conn_put (udt_conn_t *conn);
+
+void udt_handshake_init     (udt_conn_t *conn);
+void udt_handshake_terminate(udt_conn_t *conn);
+void udt_connection_close   (udt_conn_t *conn);
+void udt_connection_unlink  (udt_conn_t *conn);
+void udt_timers_start       (udt_conn_t *conn, uint64_t idle_timeout);
 
 void *udt_sender_start  (void *arg);
 void *udt_receiver_start(void *arg);
 
-void udt_child_after_fork();
-void udt_prepare_to_fork ();
-
 #endif // !UDT_CORE_H_
@@ -0,0 +1,105 @@
+#include "ipv4_net_config.h"
+#include "udt_mtu.h"
+#include "udt_packet.h"
+#include "udt_ccc.h"
+#include "udt_utils.h"
+
+// IPv4 and UDP headers are not a part of udt datagrams
+#define IP_UDP_HEADER_SIZE 28
+
+// Link MTUs tried after the negotiated maximum: jumbo, FDDI, Ethernet, PPPoE, IPv6 minimum
+static const size_t LINK_MTUS[] = {9000, 4352, 1500, 1492, 1280};
+
+static size_t udt_mtu_next_probe(udt_mtu_t *mtu, size_t failed_size)
+{
+    for (size_t i = 0; i < sizeof(LINK_MTUS) / sizeof(LINK_MTUS[0]); ++i)
+    {
+        size_t probe_size = LINK_MTUS[i] - IP_UDP_HEADER_SIZE;
+        if (probe_size < failed_size && probe_size <= mtu->max_size && probe_size > mtu->size)
+            return probe_size;
+    }
+
+    return 0;
+}
+
+static void udt_mtu_search(udt_mtu_t *mtu, size_t probe_size, uint64_t now)
+{
+    mtu->probe_size = (probe_size > mtu->size) ? probe_size : 0;
+    mtu->n_probes   = 0;
+
+    if (mtu->probe_size == 0)
+    {
+        mtu->search_time = now;
+        udt_syslog(LOG_INFO, "mtu: search is over, datagrams of %zu bytes", (size_t) mtu->size);
+    }
+}
+
+void udt_mtu_init(udt_mtu_t *mtu, size_t max_size)
+{
+    if (mtu == NULL)
+        return;
+
+    mtu->size     = (max_size < UDT_PLPMTU_BASE) ? max_size : UDT_PLPMTU_BASE;
+    mtu->max_size = max_size;
+
+    udt_mtu_search(mtu, max_size, udt_clock_usec());
+}
+
+void udt_mtu_negotiate(udt_mtu_t *mtu, size_t peer_max_size)
+{
+    if (mtu == NULL || peer_max_size <= sizeof(udt_packet_header_t) || peer_max_size >= mtu->max_size)
+        return;
+
+    mtu->max_size = peer_max_size;
+    if (mtu->size > peer_max_size)
+        mtu->size = peer_max_size;
+
+    udt_mtu_search(mtu, peer_max_size, udt_clock_usec());
+}
+
+size_t udt_mtu_probe(udt_mtu_t *mtu, uint64_t now, uint64_t timeout)
+{
+    if (mtu == NULL)
+        return 0;
+
+    if (mtu->probe_size == 0)
+    {
+        // Raise timer: the path may have changed since the last search
+        if (mtu->size < mtu->max_size && now - mtu->search_time >= (uint64_t) UDT_PLPMTU_RAISE_TIMEOUT * 1000000)
+            udt_mtu_search(mtu, mtu->max_size, now);
+        else
+            return 0;
+    }
+
+    if (mtu->n_probes > 0 && now - mtu->probe_time < timeout)
+        return 0;
+
+    if (mtu->n_probes == UDT_PLPMTU_MAX_PROBES) // too big for the path
+    {
+        udt_syslog(LOG_INFO, "mtu: probe of %zu bytes is lost", mtu->probe_size);
+
+        udt_mtu_search(mtu, udt_mtu_next_probe(mtu, mtu->probe_size), now);
+        if (mtu->probe_size == 0)
+            return 0;
+    }
+
+    mtu->n_probes++;
+    mtu->probe_time = now;
+
+    return mtu->probe_size;
+}
+
+void udt_mtu_confirm(udt_mtu_t *mtu, size_t size, uint64_t now)
+{
+    if (mtu == NULL || size != mtu->probe_size || mtu->probe_size == 0)
+        return;
+
+    // Probes go from the largest size down, so the first answered one ends the search
+    mtu->size = size;
+    udt_mtu_search(mtu, 0, now);
+}
+
+size_t udt_mtu_payload(udt_mtu_t *mtu)
+{
+    return mtu->size - sizeof(udt_packet_header_t);
+}
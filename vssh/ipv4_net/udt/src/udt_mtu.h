@@ -0,0 +1,38 @@
+#ifndef UDT_MTU_H_
+#define UDT_MTU_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The udt packetization layer path MTU (RFC 8899)
+ *
+ * Sizes are of whole udt datagrams, without IP and UDP headers. The
+ * handshake gives the largest datagram both sides can take, data packets
+ * start at the base size and grow when the peer answers a larger probe.
+ * Probes go from the largest size down through common link MTUs, a size
+ * fails after several probes without answer. The search is repeated from
+ * time to time to find a path which got larger. Only the receiver-thread
+ * changes it, the application thread reads the size of data packets.
+ */
+
+typedef struct
+{
+    atomic_size_t size; // the datagram size confirmed for the path
+    size_t max_size;    // negotiated in the handshake
+
+    size_t   probe_size;  // 0 when the search is over
+    size_t   n_probes;    // probes of probe_size without answer
+    uint64_t probe_time;
+    uint64_t search_time; // the end of the last search
+} udt_mtu_t;
+
+void   udt_mtu_init     (udt_mtu_t *mtu, size_t max_size);
+void   udt_mtu_negotiate(udt_mtu_t *mtu, size_t peer_max_size);
+
+size_t udt_mtu_probe    (udt_mtu_t *mtu, uint64_t now, uint64_t timeout);
+void   udt_mtu_confirm  (udt_mtu_t *mtu, size_t size, uint64_t now);
+size_t udt_mtu_payload  (udt_mtu_t *mtu);
+
+#endif // !UDT_MTU_H_
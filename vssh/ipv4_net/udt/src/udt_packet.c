@@ -4,11 +4,6 @@
 #include "udt_core.h"
 #include "udt_utils.h"
 
-extern udt_conn_t connection;
-
-extern pthread_mutex_t handshake_mutex;
-extern pthread_cond_t  handshake_cond;
-
 void udt_packet_deserialize(udt_packet_t *packet)
 {
     if (packet == NULL)
@@ -40,17 +35,77 @@ ssize_t udt_packet_new(udt_packet_t *packet, const void *buffer, size_t len)
     if (packet == NULL)
         return -1;
 
-    if (len > sizeof(packet->data))
+    if (len > sizeof(packet->data) || (buffer == NULL && len > 0))
         return -1;
 
-    memset(packet->data, 0, sizeof(packet->data));
-    memcpy(packet->data, buffer, len);
+    if (len > 0)
+        memcpy(packet->data, buffer, len);
+
+    packet_set_length(*packet, len);
     udt_packet_serialize(packet);
 
     return len;
 }
 
-ssize_t udt_packet_new_handshake(udt_packet_t *packet)
+ssize_t udt_packet_send_nak(udt_conn_t *conn, const uint32_t *loss_list, size_t len)
+{
+    if (loss_list == NULL || len == 0 || len > PACKET_MAX_LOSS_LENGTH)
+        return -1;
+
+    // The rest of the list is reported next time, a range is never split
+    size_t max_len = udt_mtu_payload(&(conn->mtu)) / sizeof(uint32_t);
+    if (len > max_len)
+    {
+        len = max_len;
+        if (loss_list[len - 1] & PACKET_LOSS_RANGE_FLAG)
+            len--;
+    }
+
+    udt_packet_t packet;
+    uint32_t net_loss_list[PACKET_MAX_LOSS_LENGTH];
+
+    for (size_t i = 0; i < len; ++i)
+        net_loss_list[i] = htonl(loss_list[i]);
+
+    packet_clear_header   (packet);
+    packet_set_ctrl       (packet);
+    packet_set_type       (packet, PACKET_TYPE_NAK);
+    packet_set_loss_length(packet, len);
+
+    ssize_t n_packet_bytes = udt_packet_new(&packet, net_loss_list, len * sizeof(uint32_t));
+    if (n_packet_bytes == -1)
+        return -1;
+
+    udt_syslog(LOG_INFO, "nak: report %zu lost packets entries", len);
+
+    conn->last_nak_time = udt_clock_usec();
+
+    return udt_send_packet_buffer_write(conn, &packet);
+}
+
+ssize_t udt_packet_send_probe(udt_conn_t *conn, size_t size)
+{
+    if (size <= sizeof(udt_packet_header_t) || size > sizeof(udt_packet_t))
+        return -1;
+
+    udt_packet_t packet;
+    static const char padding[PACKET_DATA_SIZE] = {0};
+
+    packet_clear_header  (packet);
+    packet_set_ctrl      (packet);
+    packet_set_type      (packet, PACKET_TYPE_MTUPROBE);
+    packet_set_probe_size(packet, size);
+
+    ssize_t n_packet_bytes = udt_packet_new(&packet, padding, size - sizeof(udt_packet_header_t));
+    if (n_packet_bytes == -1)
+        return -1;
+
+    udt_syslog(LOG_INFO, "mtu: probe of %zu bytes", size);
+
+    return udt_send_packet_buffer_write(conn, &packet);
+}
+
+ssize_t udt_packet_new_handshake(udt_conn_t *conn, udt_packet_t *packet)
 {
     if (packet == NULL)
         return -1;
@@ -59,22 +114,20 @@ ssize_t udt_packet_new_handshake(udt_packet_t *packet)
     packet_set_ctrl     (*packet);
     packet_set_type     (*packet, PACKET_TYPE_HANDSHAKE);
     packet_set_timestamp(*packet, 0);
-    packet_set_id       (*packet, 0);
 
     uint32_t buffer[8] = {0};
 
     uint32_t flight_flag_size = 10;
-    uint32_t id = 10;
     uint32_t request_type = 0;
     uint32_t cookie = 10;
 
     buffer[0] = UDT_VERSION;
-    buffer[1] = connection.type;
-    buffer[2] = 0x123123; // random number
-    buffer[3] = PACKET_DATA_SIZE;
+    buffer[1] = conn->type;
+    buffer[2] = UDT_INITIAL_SEQNUM; // the first sequence number of data packets
+    buffer[3] = conn->mtu.max_size; // the largest datagram taken
     buffer[4] = flight_flag_size;
     buffer[5] = request_type;
-    buffer[6] = id;
+    buffer[6] = conn->id;
     buffer[7] = cookie;
 
     for (int i = 0; i < 8; ++i)
@@ -83,14 +136,15 @@ ssize_t udt_packet_new_handshake(udt_packet_t *packet)
     return udt_packet_new(packet, buffer, sizeof(buffer));
 }
 
-int udt_handle_request_packet(udt_packet_t *packet)
+int udt_handle_request_packet(int socket_fd, udt_packet_t *packet, const struct sockaddr_in *addr)
 {
     if (((ipv4_ctl_message *) packet)->message_type == IPV4_BROADCAST_TYPE)
     {
         udt_syslog(LOG_INFO, "packet: broadcast request");
-        const char respond_message[PACKET_DATA_SIZE] = {0};
+        // Of the size of the request: the socket doesn't fragment, so the answer must fit into any path
+        const char respond_message[sizeof(ipv4_ctl_message)] = {0};
 
-        ssize_t sent_bytes = sendto(connection.socket_fd, respond_message, PACKET_DATA_SIZE, 0, (struct sockaddr *) &connection.addr, connection.addrlen);
+        ssize_t sent_bytes = sendto(socket_fd, respond_message, sizeof(respond_message), 0, (struct sockaddr *) addr, sizeof(struct sockaddr_in));
         if (sent_bytes == -1 || sent_bytes != sizeof(respond_message))
             udt_syslog(LOG_ERR, "cannot respond to broadcast request");
 
@@ -100,7 +154,28 @@ int udt_handle_request_packet(udt_packet_t *packet)
     return 0;
 }
 
-int udt_packet_parse(udt_packet_t packet)
+// The packet is left undelivered while the application doesn't read and the buffer is full
+static int udt_packet_deliver(udt_conn_t *conn, udt_packet_t *packet)
+{
+    int boundary = packet_get_boundary(*packet);
+    int last     = (boundary == PACKET_BOUNDARY_SOLO || boundary == PACKET_BOUNDARY_END);
+
+    if (udt_recv_buffer_write(conn, packet->data, packet_get_length(*packet), last) == -1)
+        return -1;
+
+    if (boundary == PACKET_BOUNDARY_END)        // last packet
+        conn->idle_timeout = conn->saved_idle_timeout;
+
+    else if (boundary == PACKET_BOUNDARY_START) // first packet
+    {
+        conn->saved_idle_timeout = conn->idle_timeout;
+        conn->idle_timeout       = (uint64_t) UDT_SECONDS_TIMEOUT_READ * 1000000 + UDT_USECONDS_TIMEOUT_READ;
+    }
+
+    return 0;
+}
+
+int udt_packet_parse(udt_conn_t *conn, udt_packet_t packet)
 {
     udt_packet_deserialize(&packet);
 
@@ -111,45 +186,18 @@ int udt_packet_parse(udt_packet_t packet)
             case PACKET_TYPE_HANDSHAKE: // handshake
                 udt_syslog(LOG_INFO, "packet: handshake");
 
-                if (connection.is_client == 1) // client
+                if (conn->is_client == 1 && conn->is_connected == 0) // client
                 {
-                    pthread_cond_signal(&handshake_cond);
-                    udt_handshake_terminate();
-
-                    return 0;
+                    conn->peer_id = packet.header._head3;
+                    udt_mtu_negotiate(&(conn->mtu), ntohl(((uint32_t *) packet.data)[3]));
+                    udt_recv_window_start(&(conn->recv_window), ntohl(((uint32_t *) packet.data)[2]));
+                    udt_timers_start(conn, (uint64_t) UDT_SECONDS_TIMEOUT_CLIENT * 1000000 + UDT_USECONDS_TIMEOUT_CLIENT);
+                    udt_handshake_terminate(conn);
                 }
-                else if (connection.is_connected == 0) // server
+                else if (conn->is_client == 0 && conn->is_connected == 1) // server, the response was lost
                 {
-                    udt_syslog(LOG_INFO, "create new process for client...");
-
-                    int fork_value = fork();
-                    if (fork_value == -1) // error
-                    {
-                        udt_syslog(LOG_ERR, "error in fork() while creating process for client...");
-
-                        return PACKET_SYSTEM_ERROR;
-                    }
-                    else if (fork_value == 0) // child
-                    {
-                        int new_socket_fd = ipv4_socket(SOCK_DGRAM, SO_REUSEADDR);
-                        if (new_socket_fd == -1)
-                        {
-                            udt_syslog(LOG_ERR, "couldn't create socket...");
-                            udt_syslog(LOG_NOTICE, "exit because of error");
-                            exit(EXIT_FAILURE);
-                        }
-                            
-                        struct timeval tv = {.tv_sec = UDT_SECONDS_TIMEOUT_SERVER, .tv_usec = UDT_USECONDS_TIMEOUT_SERVER};
-                        setsockopt(new_socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval));
-
-                        connection.socket_fd = new_socket_fd;
-
-                        udt_packet_new_handshake(&packet);
-                        udt_send_packet_buffer_write(&packet);
-                        udt_handshake_terminate();
-
-                        return 0;
-                    }
+                    udt_packet_new_handshake(conn, &packet);
+                    udt_send_packet_buffer_write(conn, &packet);
                 }
 
                 return 0;
@@ -159,15 +207,63 @@ int udt_packet_parse(udt_packet_t packet)
                 return 0;
 
             case PACKET_TYPE_ACK:                   // ack
+            {
                 udt_syslog(LOG_INFO, "packet: ack");
-                if (packet_get_msgnum(packet) == connection.last_packet_number)
-                    connection.is_in_wait = 0;
+
+                int n_acked = udt_send_window_ack(&(conn->send_window), packet_get_ack_seqnum(packet));
+
+                uint32_t recv_rate = ntohl(((uint32_t *) packet.data)[0]);
+                uint32_t bandwidth = ntohl(((uint32_t *) packet.data)[1]);
+                uint32_t echo_time = ntohl(((uint32_t *) packet.data)[2]);
+
+                uint64_t now = udt_clock_usec();
+                udt_rtt_update(&(conn->rtt), (uint32_t) now - echo_time);
+
+                udt_ccc_on_ack(&(conn->ccc), n_acked, conn->rtt.srtt, recv_rate, bandwidth, conn->mtu.size);
+                udt_send_window_set_cwnd(&(conn->send_window), udt_ccc_window(&(conn->ccc)));
+
+                // The receiver measures round-trip time by ACK2, once per SYN is enough
+                if (now - conn->last_ack2_time >= UDT_CCC_SYN_INTERVAL)
+                {
+                    udt_packet_t packet_ack2;
+                    uint32_t ack_time = htonl(packet_get_timestamp(packet));
+
+                    packet_clear_header  (packet_ack2);
+                    packet_set_ctrl      (packet_ack2);
+                    packet_set_type      (packet_ack2, PACKET_TYPE_ACK2);
+                    packet_set_ack_seqnum(packet_ack2, packet_get_ack_seqnum(packet));
+
+                    udt_packet_new(&packet_ack2, &ack_time, sizeof(ack_time));
+                    udt_send_packet_buffer_write(conn, &packet_ack2);
+
+                    conn->last_ack2_time = now;
+                }
 
                 return 0;
+            }
 
             case PACKET_TYPE_NAK:                   // nak
+            {
                 udt_syslog(LOG_INFO, "packet: nak");
+
+                size_t loss_length = packet_get_loss_length(packet);
+                if (loss_length > PACKET_MAX_LOSS_LENGTH || loss_length * sizeof(uint32_t) > packet_get_length(packet))
+                    return PACKET_INVALID_SEQNUM_ERROR;
+
+                uint32_t loss_list[PACKET_MAX_LOSS_LENGTH];
+                for (size_t i = 0; i < loss_length; ++i)
+                    loss_list[i] = ntohl(((uint32_t *) packet.data)[i]);
+
+                if (loss_length > 0)
+                {
+                    udt_ccc_on_loss(&(conn->ccc), loss_list[0] & PACKET_MASK_SEQ);
+                    udt_send_window_set_cwnd(&(conn->send_window), udt_ccc_window(&(conn->ccc)));
+                }
+
+                udt_send_window_resend(&(conn->send_window), loss_list, loss_length);
+
                 return 0;
+            }
 
             case PACKET_TYPE_CONGDELAY:             // congestion-delay warn
                 udt_syslog(LOG_INFO, "packet: congestion-delay");
@@ -176,24 +272,27 @@ int udt_packet_parse(udt_packet_t packet)
             case PACKET_TYPE_SHUTDOWN:              // shutdown
                 udt_syslog(LOG_INFO, "packet: shutdown");
 
-                if (connection.is_connected == 0)
+                if (conn->is_connected == 0)
                 {
                     udt_syslog(LOG_NOTICE, "unknown client tries to shutdown me");
                     return PACKET_UNKNOWN_CLIENT_ERROR;
                 }
 
-                connection.is_connected = 0;
-                if (connection.is_client == 0) // server
-                {
-                    udt_syslog(LOG_NOTICE, "successfully finish job and exit");
-                    exit(EXIT_SUCCESS);
-                }
-                    
+                conn->is_connected = 0;
+                udt_send_window_break(&(conn->send_window));
+                udt_buffer_close(&(conn->recv_buffer)); // wakes up udt_recv()
+
                 return 0;
 
             case PACKET_TYPE_ACK2:                  // ack of ack
+            {
                 udt_syslog(LOG_INFO, "packet: ack of ack");
+
+                uint32_t echo_time = ntohl(((uint32_t *) packet.data)[0]);
+                udt_rtt_update(&(conn->rtt), (uint32_t) udt_clock_usec() - echo_time);
+
                 return 0;
+            }
 
             case PACKET_TYPE_DROPREQ:               // message drop request
                 udt_syslog(LOG_INFO, "packet: drop request");
@@ -203,6 +302,32 @@ int udt_packet_parse(udt_packet_t packet)
                 udt_syslog(LOG_INFO, "packet: error signal");
                 return 0;
 
+            case PACKET_TYPE_MTUPROBE:              // path mtu probe
+            {
+                udt_syslog(LOG_INFO, "packet: mtu probe");
+
+                if (conn->is_connected == 0)
+                    return PACKET_UNKNOWN_CLIENT_ERROR;
+
+                if (packet_get_length(packet) == 0) // the answer
+                {
+                    udt_mtu_confirm(&(conn->mtu), packet_get_probe_size(packet), udt_clock_usec());
+                    return 0;
+                }
+
+                udt_packet_t packet_answer;
+
+                packet_clear_header  (packet_answer);
+                packet_set_ctrl      (packet_answer);
+                packet_set_type      (packet_answer, PACKET_TYPE_MTUPROBE);
+                packet_set_probe_size(packet_answer, sizeof(udt_packet_header_t) + packet_get_length(packet));
+
+                udt_packet_new(&packet_answer, NULL, 0);
+                udt_send_packet_buffer_write(conn, &packet_answer);
+
+                return 0;
+            }
+
             default:                                // unsupported packet type
                 udt_syslog(LOG_INFO, "packet: unknown");
                 return PACKET_UNKNOWN_TYPE_ERROR;
@@ -212,66 +337,72 @@ int udt_packet_parse(udt_packet_t packet)
     {
         udt_syslog(LOG_INFO, "packet: data");
 
-        if (connection.is_connected == 1)
+        if (conn->is_connected == 1)
         {
-            if (packet.header._head1 & 0x80000000 &&
-                packet.header._head1 & 0x40000000)      // solo packet
-                udt_recv_buffer_write(packet.data, PACKET_DATA_SIZE);
+            int32_t offset = udt_seqnum_offset(conn->recv_window.first_seqnum, packet_get_seqnum(packet));
+            int is_dropped = 0;
 
-            else if (packet.header._head1 & 0x40000000) // last packet
-            {
-                setsockopt(connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &(connection.saved_tv), sizeof(struct timeval));
+            udt_ccc_on_arrival(&(conn->recv_rate), packet_get_seqnum(packet));
 
-                if (packet_get_msgnum(packet) == (connection.last_packet_number + 1))
+            if (offset == 0) // expected packet
+            {
+                if (udt_packet_deliver(conn, &packet) == -1)
                 {
-                    udt_recv_buffer_write(packet.data, PACKET_DATA_SIZE);
-                    connection.last_packet_number = 0;
+                    udt_syslog(LOG_INFO, "receive buffer is full, packet is dropped");
+                    is_dropped = 1;
                 }
                 else
                 {
-                    udt_syslog(LOG_INFO, "received packet doesn't correspond expectable message number");
-                    return PACKET_INVALID_MSGNUM_ERROR;
-                }
-            }
-                
-            else if (packet.header._head1 & 0x80000000) // first packet
-            {
-                socklen_t optlen;
-                getsockopt(connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO, &(connection.saved_tv), &optlen);
+                    udt_recv_window_advance(&(conn->recv_window));
 
-                struct timeval new_tv = {.tv_sec = UDT_SECONDS_TIMEOUT_READ, .tv_usec = UDT_USECONDS_TIMEOUT_READ};
-                setsockopt(connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &new_tv, sizeof(struct timeval));
+                    udt_packet_t *next_packet = NULL;
+                    while ((next_packet = udt_recv_window_first(&(conn->recv_window))) != NULL) // the gap is filled
+                    {
+                        if (udt_packet_deliver(conn, next_packet) == -1)
+                            break;
 
-                udt_recv_buffer_write(packet.data, -1);
-                connection.last_packet_number = 1;
+                        udt_recv_window_advance(&(conn->recv_window));
+                    }
+                }
             }
-                
-            else // middle packet
+            else if (offset > 0) // packet ahead of the expected one
             {
-                if (packet_get_msgnum(packet) == (connection.last_packet_number + 1))
+                uint32_t last_seqnum = conn->recv_window.last_seqnum;
+
+                if (udt_recv_window_insert(&(conn->recv_window), &packet) == -1)
                 {
-                    udt_recv_buffer_write(packet.data, -1);
-                    connection.last_packet_number++;
+                    udt_syslog(LOG_INFO, "received packet is beyond receive window, dropped");
+                    is_dropped = 1;
                 }
-                else
+                else if (udt_seqnum_offset(last_seqnum, packet_get_seqnum(packet)) > 1) // new gap, report it at once
                 {
-                    udt_syslog(LOG_INFO, "received packet doesn't correspond expectable message number");
-                    return PACKET_INVALID_MSGNUM_ERROR;
+                    uint32_t first_lost = udt_seqnum_inc(last_seqnum);
+                    uint32_t last_lost  = udt_seqnum_add(packet_get_seqnum(packet), -1);
+
+                    uint32_t loss_list[2] = {first_lost | PACKET_LOSS_RANGE_FLAG, last_lost};
+                    if (first_lost == last_lost)
+                        udt_packet_send_nak(conn, &last_lost, 1);
+                    else
+                        udt_packet_send_nak(conn, loss_list, 2);
                 }
-            } 
+            }
 
+            // Duplicates are acknowledged too: the previous acknowledgement may be lost
             udt_packet_t packet_ack;
-            size_t message_number = packet_get_msgnum(packet);
+            uint32_t ack_info[3] = {htonl(udt_ccc_recv_rate(&(conn->recv_rate))),
+                                    htonl(udt_ccc_bandwidth(&(conn->recv_rate))),
+                                    htonl(packet_get_timestamp(packet))};
+
+            packet_clear_header  (packet_ack);
+            packet_set_ctrl      (packet_ack);
+            packet_set_type      (packet_ack, PACKET_TYPE_ACK);
+            packet_set_ack_seqnum(packet_ack, conn->recv_window.first_seqnum);
 
-            packet_clear_header (packet_ack);
-            packet_set_ctrl     (packet_ack);
-            packet_set_type     (packet_ack, PACKET_TYPE_ACK);
-            packet_set_timestamp(packet_ack, 0x0000051c);
-            packet_set_id       (packet_ack, 0x08c42c74);
-            packet_set_msgnum   (packet_ack, message_number);
+            udt_packet_new(&packet_ack, ack_info, sizeof(ack_info));
+            udt_send_packet_buffer_write(conn, &packet_ack);
 
-            udt_packet_new(&packet_ack, NULL, 0);
-            udt_send_packet_buffer_write(&packet_ack);
+            if (is_dropped == 1)
+                return PACKET_INVALID_SEQNUM_ERROR;
         }
         else
         {
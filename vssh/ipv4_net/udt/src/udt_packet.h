@@ -22,6 +22,11 @@
 #define PACKET_TYPE_ACK2      0x00060000
 #define PACKET_TYPE_DROPREQ   0x00070000
 #define PACKET_TYPE_ERRSIG    0x00080000
+#define PACKET_TYPE_MTUPROBE  0x00090000
+
+// Loss list entry with this bit set is the first one of a range, the next entry is the last one
+#define PACKET_LOSS_RANGE_FLAG 0x80000000
+#define PACKET_MAX_LOSS_LENGTH (PACKET_DATA_SIZE / sizeof(uint32_t))
 
 #define PACKET_BOUNDARY_NONE  0
 #define PACKET_BOUNDARY_END   1
@@ -29,7 +34,7 @@
 #define PACKET_BOUNDARY_SOLO  3
 
 #define PACKET_SYSTEM_ERROR         -1
-#define PACKET_INVALID_MSGNUM_ERROR  1
+#define PACKET_INVALID_SEQNUM_ERROR  1
 #define PACKET_UNKNOWN_TYPE_ERROR    2
 #define PACKET_UNKNOWN_CLIENT_ERROR  3
 
@@ -44,7 +49,8 @@
     ((packet).header._head1 &= 0x00000000);       \
     ((packet).header._head2 &= 0x00000000);       \
     ((packet).header._head3 &= 0x00000000);       \
-    ((packet).header._head4 &= 0x00000000);
+    ((packet).header._head4 &= 0x00000000);       \
+    ((packet).header._head5 &= 0x00000000);
 
 #define packet_set_data(packet)                   \
     ((packet).header._head0 &= 0x7FFFFFFF)
@@ -56,10 +62,16 @@
     ((packet).header._head0 &= 0x80000000);       \
     ((packet).header._head0 |= (seqnum))
 
+#define packet_get_seqnum(packet)                 \
+    ((packet).header._head0 & PACKET_MASK_SEQ)
+
 #define packet_set_boundary(packet, boundary)     \
     ((packet).header._head1 &= 0xC0000000);       \
     ((packet).header._head1 |= (boundary << 30))
 
+#define packet_get_boundary(packet)               \
+    ((packet).header._head1 >> 30)
+
 #define packet_set_order(packet, order)           \
     ((packet).header._head1 |= (order) ? 0x20000000 : 0x00000000)
 
@@ -69,9 +81,40 @@
 #define packet_get_msgnum(packet)                 \
     ((packet).header._head4)
 
+#define packet_set_length(packet, length)         \
+    ((packet).header._head5 = (length))
+
+#define packet_get_length(packet)                 \
+    ((packet).header._head5)
+
+// The datagram of a serialized packet
+#define packet_size(packet)                       \
+    (sizeof(udt_packet_header_t) + ntohl((packet).header._head5))
+
+#define packet_set_ack_seqnum(packet, seqnum)     \
+    ((packet).header._head1 = (seqnum))
+
+#define packet_get_ack_seqnum(packet)             \
+    ((packet).header._head1)
+
+#define packet_set_loss_length(packet, length)    \
+    ((packet).header._head1 = (length))
+
+#define packet_get_loss_length(packet)            \
+    ((packet).header._head1)
+
+#define packet_set_probe_size(packet, size)       \
+    ((packet).header._head1 = (size))
+
+#define packet_get_probe_size(packet)             \
+    ((packet).header._head1)
+
 #define packet_set_timestamp(packet, timestamp_)  \
     ((packet).header._head2 |= timestamp_)
 
+#define packet_get_timestamp(packet)              \
+    ((packet).header._head2)
+
 #define packet_set_id(packet, packet_id)          \
     ((packet).header._head3 |= packet_id)
 
@@ -91,11 +134,38 @@
  *   sequence_number
  *   boundary order message_number
  *   time_stamp
+ *   id
+ *   message_number
+ *   length
  *
  * Control packet header contains:
  *   type ext_type
- *   ack_sequence_number
+ *   ack_sequence_number (ACK), loss list length (NAK) or probe size (MTUPROBE)
  *   time_stamp
+ *   id
+ *   -
+ *   length
+ *
+ * Length is the amount of data bytes, only the header and these bytes are
+ * sent, so control packets and short messages make short datagrams.
+ *
+ * Time stamp is microseconds of the sender's clock and id is the socket id
+ * of the sender, both are set when a packet leaves the sender-thread. The
+ * server finds the connection of a packet by the address and the id.
+ *
+ * ACK packet data is the receiving rate and the link capacity estimated
+ * by the receiver, packets per second, and the time stamp of the data
+ * packet being acknowledged, all in network order. ACK2 packet data is the
+ * time stamp of the ACK being answered. The echoed time stamps give
+ * round-trip time to both sides.
+ *
+ * NAK packet data is a compressed loss list: sequence numbers in network
+ * order, a range is stored as its first number with PACKET_LOSS_RANGE_FLAG
+ * followed by its last number.
+ *
+ * MTUPROBE packet is padded with zeros up to the probed datagram size, the
+ * answer is an empty MTUPROBE packet with the size of the received probe.
+ * Handshake carries the largest datagram size a side takes.
  */
 
 typedef struct
@@ -129,10 +199,16 @@ typedef struct
         uint32_t _head3;
     };
 
-    union 
+    union
+    {
+        uint32_t message_number;
+        uint32_t _head4;
+    };
+
+    union
     {
-        size_t message_number;
-        uint64_t _head4;
+        uint32_t length;
+        uint32_t _head5;
     };
 
 } udt_packet_header_t;
@@ -146,9 +222,13 @@ typedef struct
 void udt_packet_deserialize      (udt_packet_t *packet);
 void udt_packet_serialize        (udt_packet_t *packet);
 
+typedef struct _udt_conn udt_conn_t;
+
 ssize_t udt_packet_new           (udt_packet_t *packet, const void *buffer, size_t len);
-ssize_t udt_packet_new_handshake (udt_packet_t *packet);
-int     udt_handle_request_packet(udt_packet_t *packet);
-int     udt_packet_parse         (udt_packet_t  packet);
+ssize_t udt_packet_new_handshake (udt_conn_t *conn, udt_packet_t *packet);
+ssize_t udt_packet_send_nak      (udt_conn_t *conn, const uint32_t *loss_list, size_t len);
+ssize_t udt_packet_send_probe    (udt_conn_t *conn, size_t size);
+int     udt_handle_request_packet(int socket_fd, udt_packet_t *packet, const struct sockaddr_in *addr);
+int     udt_packet_parse         (udt_conn_t *conn, udt_packet_t packet);
 
 #endif // !UDT_PACKET_H_
@@ -0,0 +1,180 @@
+#include "ipv4_net_config.h"
+#include "udt_table.h"
+#include "udt_core.h"
+#include "udt_utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+static udt_conn_t    **HANDLES       = NULL;
+static size_t          N_HANDLES     = 0;
+static pthread_mutex_t HANDLES_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+#define conn_is_peer(conn, addr_, peer_id_)                           \
+    ((conn)->addr.sin_addr.s_addr == (addr_)->sin_addr.s_addr &&      \
+     (conn)->addr.sin_port        == (addr_)->sin_port        &&      \
+     (conn)->peer_id              == (peer_id_))
+
+static size_t udt_table_hash(udt_table_t *table, const struct sockaddr_in *addr, uint32_t peer_id)
+{
+    uint64_t key = ((uint64_t) addr->sin_addr.s_addr << 32) | ((uint64_t) addr->sin_port << 16);
+    key ^= peer_id;
+    key *= 0x9E3779B97F4A7C15ULL; // fibonacci hashing spreads neighbouring ports and ids
+
+    return (size_t) (key >> 32) % table->size;
+}
+
+int udt_table_init(udt_table_t *table, size_t size)
+{
+    if (table == NULL || size == 0)
+        return -1;
+
+    table->buckets = (udt_conn_t **) calloc(size, sizeof(udt_conn_t *));
+    if (table->buckets == NULL)
+        return -1;
+
+    table->first   = NULL;
+    table->size    = size;
+    table->n_conns = 0;
+
+    return 0;
+}
+
+void udt_table_destroy(udt_table_t *table)
+{
+    if (table == NULL)
+        return;
+
+    free(table->buckets);
+    table->buckets = NULL;
+    table->first   = NULL;
+    table->size    = 0;
+    table->n_conns = 0;
+}
+
+int udt_table_insert(udt_table_t *table, udt_conn_t *conn)
+{
+    if (table == NULL || conn == NULL || table->buckets == NULL)
+        return -1;
+
+    size_t bucket = udt_table_hash(table, &(conn->addr), conn->peer_id);
+
+    conn->next = table->buckets[bucket];
+    table->buckets[bucket] = conn;
+
+    conn->list_prev = NULL;
+    conn->list_next = table->first;
+    if (table->first != NULL)
+        table->first->list_prev = conn;
+    table->first = conn;
+
+    table->n_conns++;
+
+    return 0;
+}
+
+void udt_table_remove(udt_table_t *table, udt_conn_t *conn)
+{
+    if (table == NULL || conn == NULL || table->buckets == NULL)
+        return;
+
+    udt_conn_t **link = &(table->buckets[udt_table_hash(table, &(conn->addr), conn->peer_id)]);
+    while (*link != NULL && *link != conn)
+        link = &((*link)->next);
+
+    if (*link == NULL)
+        return;
+
+    *link = conn->next;
+    conn->next = NULL;
+
+    if (conn->list_prev != NULL)
+        conn->list_prev->list_next = conn->list_next;
+    else
+        table->first = conn->list_next;
+
+    if (conn->list_next != NULL)
+        conn->list_next->list_prev = conn->list_prev;
+
+    conn->list_prev = NULL;
+    conn->list_next = NULL;
+
+    table->n_conns--;
+}
+
+udt_conn_t *udt_table_find(udt_table_t *table, const struct sockaddr_in *addr, uint32_t peer_id)
+{
+    if (table == NULL || addr == NULL || table->buckets == NULL)
+        return NULL;
+
+    udt_conn_t *conn = table->buckets[udt_table_hash(table, addr, peer_id)];
+    while (conn != NULL && !conn_is_peer(conn, addr, peer_id))
+        conn = conn->next;
+
+    return conn;
+}
+
+int udt_handle_register(int handle_fd, udt_conn_t *conn)
+{
+    if (handle_fd < 0 || conn == NULL)
+        return -1;
+
+    pthread_mutex_lock(&HANDLES_MUTEX);
+
+    if (handle_fd >= N_HANDLES)
+    {
+        size_t n_handles = (N_HANDLES == 0) ? 64 : N_HANDLES;
+        while (n_handles <= handle_fd)
+            n_handles *= 2;
+
+        udt_conn_t **handles = (udt_conn_t **) realloc(HANDLES, n_handles * sizeof(udt_conn_t *));
+        if (handles == NULL)
+        {
+            pthread_mutex_unlock(&HANDLES_MUTEX);
+            return -1;
+        }
+
+        memset(handles + N_HANDLES, 0, (n_handles - N_HANDLES) * sizeof(udt_conn_t *));
+
+        HANDLES   = handles;
+        N_HANDLES = n_handles;
+    }
+
+    HANDLES[handle_fd] = udt_conn_ref(conn); // of the descriptor
+
+    pthread_mutex_unlock(&HANDLES_MUTEX);
+
+    return 0;
+}
+
+void udt_handle_unregister(int handle_fd)
+{
+    udt_conn_t *conn = NULL;
+
+    pthread_mutex_lock(&HANDLES_MUTEX);
+
+    if (handle_fd >= 0 && handle_fd < N_HANDLES)
+    {
+        conn = HANDLES[handle_fd];
+        HANDLES[handle_fd] = NULL;
+    }
+
+    pthread_mutex_unlock(&HANDLES_MUTEX);
+
+    udt_conn_put(conn);
+}
+
+// The reference is taken under the lock, so the descriptor can't lose the connection meanwhile
+udt_conn_t *udt_handle_find(int handle_fd)
+{
+    udt_conn_t *conn = NULL;
+
+    pthread_mutex_lock(&HANDLES_MUTEX);
+
+    if (handle_fd >= 0 && handle_fd < N_HANDLES)
+        conn = udt_conn_ref(HANDLES[handle_fd]);
+
+    pthread_mutex_unlock(&HANDLES_MUTEX);
+
+    return conn;
+}
@@ -0,0 +1,44 @@
+#ifndef UDT_TABLE_H_
+#define UDT_TABLE_H_
+
+#define _UNIX03_THREADS
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+typedef struct _udt_conn udt_conn_t;
+
+/**
+ * The udt connection table
+ *
+ * Demultiplexes datagrams of the listening socket: a connection is found
+ * by the address, the port and the socket id of the peer, connections with
+ * the same hash are chained. All connections are also kept in a list, so
+ * timers are checked without walking the buckets. Only receiver-thread of
+ * the listening socket uses it, so there is no lock.
+ */
+
+typedef struct
+{
+    udt_conn_t **buckets;
+    udt_conn_t  *first; // the list of all connections
+
+    size_t size;
+    size_t n_conns;
+} udt_table_t;
+
+int         udt_table_init   (udt_table_t *table, size_t size);
+void        udt_table_destroy(udt_table_t *table);
+
+int         udt_table_insert (udt_table_t *table, udt_conn_t *conn);
+void        udt_table_remove (udt_table_t *table, udt_conn_t *conn);
+udt_conn_t *udt_table_find   (udt_table_t *table, const struct sockaddr_in *addr, uint32_t peer_id);
+
+// Descriptors given to the application are mapped to their connections, a connection
+// found is referenced until udt_conn_put()
+int         udt_handle_register  (int handle_fd, udt_conn_t *conn);
+void        udt_handle_unregister(int handle_fd);
+udt_conn_t *udt_handle_find      (int handle_fd);
+
+#endif // !UDT_TABLE_H_
@@ -0,0 +1,536 @@
+#include "ipv4_net_config.h"
+#include "udt_window.h"
+#include "udt_buffer.h"
+#include "udt_ccc.h"
+#include "udt_utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define window_n_flight(window)                                        \
+    ((size_t) udt_seqnum_offset((window)->first_seqnum, (window)->next_seqnum))
+
+#define window_limit(window)                                           \
+    (((window)->cwnd < (window)->size) ? (window)->cwnd : (window)->size)
+
+#define window_slot(window, seqnum)                                    \
+    (((window)->first_slot + udt_seqnum_offset((window)->first_seqnum, (seqnum))) % (window)->size)
+
+int udt_send_window_init(udt_send_window_t *window, size_t size, uint32_t init_seqnum, udt_buffer_t *output)
+{
+    if (window == NULL || output == NULL || size == 0 || size > UDT_MAX_SEND_WINDOW_SIZE)
+        return -1;
+
+    window->packets = (udt_packet_t *) calloc(size, sizeof(udt_packet_t));
+    window->n_pins  = (uint16_t *)     calloc(size, sizeof(uint16_t));
+    if (window->packets == NULL || window->n_pins == NULL)
+    {
+        free(window->packets);
+        free(window->n_pins);
+        return -1;
+    }
+
+    window->output       = output;
+    window->size         = size;
+    window->cwnd         = size;
+    window->first_slot   = 0;
+    window->first_seqnum = init_seqnum & PACKET_MASK_SEQ;
+    window->next_seqnum  = init_seqnum & PACKET_MASK_SEQ;
+    window->is_reserved   = 0;
+    window->n_attempts    = 0;
+    window->timer_start   = 0;
+    window->last_ack_time = 0;
+    window->is_broken     = 0;
+
+    int retval1 = pthread_mutex_init(&(window->mutex), NULL);
+    int retval2 = pthread_cond_init (&(window->cond),  NULL);
+
+    return retval1 || retval2;
+}
+
+void udt_send_window_destroy(udt_send_window_t *window)
+{
+    if (window == NULL)
+        return;
+
+    free(window->packets);
+    free(window->n_pins);
+    window->packets = NULL;
+    window->n_pins  = NULL;
+    window->size    = 0;
+}
+
+ssize_t udt_send_window_push(udt_send_window_t *window, const udt_packet_header_t *header, const void *data, size_t len)
+{
+    if (len > PACKET_DATA_SIZE || (data == NULL && len > 0))
+        return -1;
+
+    char *payload = udt_send_window_reserve(window);
+    if (payload == NULL)
+        return -1;
+
+    if (len > 0)
+        memcpy(payload, data, len);
+
+    return udt_send_window_commit(window, header, len);
+}
+
+char *udt_send_window_reserve(udt_send_window_t *window)
+{
+    if (window == NULL || window->packets == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    // The slot of the next packet may be still pinned by a retransmission of the acknowledged one
+    while ((window_n_flight(window) >= window_limit(window) || window->is_reserved == 1 ||
+            window->n_pins[window_slot(window, window->next_seqnum)] > 0) && window->is_broken == 0)
+        pthread_cond_wait(&(window->cond), &(window->mutex));
+
+    if (window->is_broken == 1)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return NULL;
+    }
+
+    // Nobody else touches a slot beyond the packets in flight
+    window->is_reserved = 1;
+    udt_packet_t *packet = &(window->packets[window_slot(window, window->next_seqnum)]);
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    return packet->data;
+}
+
+ssize_t udt_send_window_commit(udt_send_window_t *window, const udt_packet_header_t *header, ssize_t len)
+{
+    if (window == NULL || window->packets == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    if (window->is_reserved == 0)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return -1;
+    }
+
+    window->is_reserved = 0;
+
+    // A negative length gives the slot back
+    if (header == NULL || len < 0 || len > PACKET_DATA_SIZE || window->is_broken == 1)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        pthread_cond_broadcast(&(window->cond));
+        return -1;
+    }
+
+    udt_packet_t *packet = &(window->packets[window_slot(window, window->next_seqnum)]);
+
+    packet->header = *header;
+    packet_set_seqnum(*packet, window->next_seqnum);
+    packet_set_length(*packet, len);
+    udt_packet_serialize(packet);
+
+    // Retransmission timer starts with the first packet in flight
+    if (window_n_flight(window) == 0)
+    {
+        window->timer_start   = udt_clock_usec();
+        window->last_ack_time = window->timer_start;
+    }
+
+    udt_buffer_write_ref(window->output, window->next_seqnum);
+    window->next_seqnum = udt_seqnum_inc(window->next_seqnum);
+
+    pthread_mutex_unlock(&(window->mutex));
+    pthread_cond_broadcast(&(window->cond));
+
+    return len;
+}
+
+size_t udt_send_window_pin(udt_send_window_t *window, udt_packet_t **packets, const uint32_t *seqnums, size_t n)
+{
+    if (window == NULL || packets == NULL || seqnums == NULL)
+        return 0;
+
+    size_t n_packets = 0;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (seqnums[i] == UDT_BUFFER_NO_REF) // a packet of its own
+        {
+            packets[n_packets++] = packets[i];
+            continue;
+        }
+
+        // Packets acknowledged while queued are not sent again
+        int32_t offset = udt_seqnum_offset(window->first_seqnum, seqnums[i]);
+        if (offset < 0 || offset >= (int32_t) window_n_flight(window))
+            continue;
+
+        size_t slot = window_slot(window, seqnums[i]);
+        window->n_pins[slot]++;
+
+        packets[n_packets++] = &(window->packets[slot]);
+    }
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    return n_packets;
+}
+
+void udt_send_window_unpin(udt_send_window_t *window, udt_packet_t **packets, size_t n)
+{
+    if (window == NULL || packets == NULL)
+        return;
+
+    int is_released = 0;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (packets[i] < window->packets || packets[i] >= window->packets + window->size)
+            continue;
+
+        size_t slot = packets[i] - window->packets;
+        if (--window->n_pins[slot] == 0)
+            is_released = 1;
+    }
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    if (is_released == 1)
+        pthread_cond_broadcast(&(window->cond));
+}
+
+int udt_send_window_ack(udt_send_window_t *window, uint32_t ack_seqnum)
+{
+    if (window == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    int32_t n_acked = udt_seqnum_offset(window->first_seqnum, ack_seqnum);
+    if (n_acked < 0 || n_acked > window_n_flight(window)) // invalid acknowledgement
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return 0;
+    }
+
+    // Duplicate acknowledgement doesn't touch retransmission timer, or a stream
+    // of them would keep it from firing
+    if (n_acked == 0)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return 0;
+    }
+
+    // New acknowledgement restarts retransmission timer: gaps are recovered
+    // by NAK, so only tail losses are left to timeout
+    window->timer_start   = udt_clock_usec();
+    window->first_slot    = (window->first_slot + n_acked) % window->size;
+    window->first_seqnum  = ack_seqnum & PACKET_MASK_SEQ;
+    window->n_attempts    = 0;
+    window->last_ack_time = window->timer_start;
+
+    pthread_mutex_unlock(&(window->mutex));
+    pthread_cond_broadcast(&(window->cond));
+
+    return n_acked;
+}
+
+int udt_send_window_timeout(udt_send_window_t *window, uint64_t rto)
+{
+    if (window == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    size_t n_flight = window_n_flight(window);
+    if (n_flight == 0 || window->is_broken == 1)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return 0;
+    }
+
+    // Exponential backoff while nothing is acknowledged
+    uint64_t now = udt_clock_usec();
+    uint64_t backoff_rto = rto << ((window->n_attempts < 6) ? window->n_attempts : 6);
+    if (backoff_rto > UDT_USECONDS_MAX_RTO)
+        backoff_rto = UDT_USECONDS_MAX_RTO;
+
+    if (now - window->timer_start < backoff_rto)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return 0;
+    }
+
+    if (now - window->last_ack_time >= (uint64_t) UDT_SECONDS_TIMEOUT_SEND * UDT_N_MAX_ATTEMPTS_SEND * 1000000)
+    {
+        udt_syslog(LOG_NOTICE, "no acknowledgement for %d seconds, connection is broken", UDT_SECONDS_TIMEOUT_SEND * UDT_N_MAX_ATTEMPTS_SEND);
+
+        window->is_broken = 1;
+
+        pthread_mutex_unlock(&(window->mutex));
+        pthread_cond_broadcast(&(window->cond));
+
+        return -1;
+    }
+
+    udt_syslog(LOG_INFO, "timeout: resend %zu packets after %llu us", n_flight, (unsigned long long) (now - window->timer_start));
+
+    window->n_attempts++;
+    window->timer_start = now;
+
+    for (size_t i = 0; i < n_flight; ++i)
+        udt_buffer_write_ref(window->output, udt_seqnum_add(window->first_seqnum, i));
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    return n_flight;
+}
+
+int udt_send_window_resend(udt_send_window_t *window, const uint32_t *loss_list, size_t len)
+{
+    if (window == NULL || loss_list == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    if (window->is_broken == 1)
+    {
+        pthread_mutex_unlock(&(window->mutex));
+        return 0;
+    }
+
+    size_t n_flight = window_n_flight(window);
+    int n_resent = 0;
+
+    window->timer_start = udt_clock_usec();
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        uint32_t first_lost = loss_list[i] & PACKET_MASK_SEQ;
+        uint32_t last_lost  = first_lost;
+
+        if ((loss_list[i] & PACKET_LOSS_RANGE_FLAG) && i + 1 < len)
+            last_lost = loss_list[++i] & PACKET_MASK_SEQ;
+
+        int32_t first_offset = udt_seqnum_offset(window->first_seqnum, first_lost);
+        int32_t last_offset  = udt_seqnum_offset(window->first_seqnum, last_lost);
+
+        // Lost packets may be already acknowledged by a later ACK
+        if (first_offset < 0)
+            first_offset = 0;
+        if (last_offset >= (int32_t) n_flight)
+            last_offset = (int32_t) n_flight - 1;
+
+        for (int32_t offset = first_offset; offset <= last_offset; ++offset)
+        {
+            udt_buffer_write_ref(window->output, udt_seqnum_add(window->first_seqnum, offset));
+            n_resent++;
+        }
+    }
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    udt_syslog(LOG_INFO, "nak: resend %d packets", n_resent);
+
+    return n_resent;
+}
+
+int udt_send_window_flush(udt_send_window_t *window)
+{
+    if (window == NULL || window->packets == NULL)
+        return -1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UDT_SECONDS_TIMEOUT_SEND * UDT_N_MAX_ATTEMPTS_SEND;
+
+    pthread_mutex_lock(&(window->mutex));
+
+    int wait_error = 0;
+    while (window_n_flight(window) > 0 && window->is_broken == 0 && wait_error != ETIMEDOUT)
+        wait_error = pthread_cond_timedwait(&(window->cond), &(window->mutex), &deadline);
+
+    int retval = (window_n_flight(window) == 0) ? 0 : -1;
+
+    pthread_mutex_unlock(&(window->mutex));
+
+    return retval;
+}
+
+void udt_send_window_break(udt_send_window_t *window)
+{
+    if (window == NULL)
+        return;
+
+    pthread_mutex_lock(&(window->mutex));
+    window->is_broken = 1;
+    pthread_mutex_unlock(&(window->mutex));
+
+    pthread_cond_broadcast(&(window->cond));
+}
+
+void udt_send_window_set_cwnd(udt_send_window_t *window, size_t cwnd)
+{
+    if (window == NULL)
+        return;
+
+    pthread_mutex_lock(&(window->mutex));
+    window->cwnd = cwnd;
+    pthread_mutex_unlock(&(window->mutex));
+
+    pthread_cond_broadcast(&(window->cond));
+}
+
+size_t udt_send_window_n_flight(udt_send_window_t *window)
+{
+    if (window == NULL)
+        return 0;
+
+    pthread_mutex_lock(&(window->mutex));
+    size_t n_flight = (window->is_broken == 1) ? 0 : window_n_flight(window);
+    pthread_mutex_unlock(&(window->mutex));
+
+    return n_flight;
+}
+
+int udt_recv_window_init(udt_recv_window_t *window, size_t size, uint32_t init_seqnum)
+{
+    if (window == NULL || size == 0)
+        return -1;
+
+    window->packets     = (udt_packet_t *) calloc(size, sizeof(udt_packet_t));
+    window->is_received = (char *)         calloc(size, sizeof(char));
+    if (window->packets == NULL || window->is_received == NULL)
+    {
+        free(window->packets);
+        free(window->is_received);
+        return -1;
+    }
+
+    window->size = size;
+    udt_recv_window_start(window, init_seqnum);
+
+    return 0;
+}
+
+void udt_recv_window_destroy(udt_recv_window_t *window)
+{
+    if (window == NULL)
+        return;
+
+    free(window->packets);
+    free(window->is_received);
+
+    window->packets     = NULL;
+    window->is_received = NULL;
+    window->size        = 0;
+}
+
+void udt_recv_window_start(udt_recv_window_t *window, uint32_t init_seqnum)
+{
+    if (window == NULL)
+        return;
+
+    if (window->is_received != NULL)
+        memset(window->is_received, 0, window->size);
+
+    window->first_slot   = 0;
+    window->first_seqnum = init_seqnum & PACKET_MASK_SEQ;
+    window->last_seqnum  = (init_seqnum - 1) & PACKET_MASK_SEQ;
+}
+
+int udt_recv_window_insert(udt_recv_window_t *window, const udt_packet_t *packet)
+{
+    if (window == NULL || packet == NULL || window->packets == NULL)
+        return -1;
+
+    int32_t offset = udt_seqnum_offset(window->first_seqnum, packet_get_seqnum(*packet));
+    if (offset < 0 || offset >= window->size) // already delivered or too far ahead
+        return -1;
+
+    size_t slot = (window->first_slot + offset) % window->size;
+    if (window->is_received[slot] == 0)
+    {
+        window->packets[slot]     = *packet;
+        window->is_received[slot] = 1;
+    }
+
+    if (udt_seqnum_offset(window->last_seqnum, packet_get_seqnum(*packet)) > 0)
+        window->last_seqnum = packet_get_seqnum(*packet);
+
+    return 0;
+}
+
+udt_packet_t *udt_recv_window_first(udt_recv_window_t *window)
+{
+    if (window == NULL || window->packets == NULL)
+        return NULL;
+
+    if (window->is_received[window->first_slot] == 0)
+        return NULL;
+
+    return &(window->packets[window->first_slot]);
+}
+
+void udt_recv_window_advance(udt_recv_window_t *window)
+{
+    if (window == NULL)
+        return;
+
+    if (udt_seqnum_offset(window->last_seqnum, window->first_seqnum) > 0)
+        window->last_seqnum = window->first_seqnum;
+
+    if (window->size != 0)
+    {
+        window->is_received[window->first_slot] = 0;
+        window->first_slot = (window->first_slot + 1) % window->size;
+    }
+
+    window->first_seqnum = udt_seqnum_inc(window->first_seqnum);
+}
+
+size_t udt_recv_window_losses(udt_recv_window_t *window, uint32_t *loss_list, size_t max_len)
+{
+    if (window == NULL || loss_list == NULL || window->packets == NULL)
+        return 0;
+
+    // Everything between the expected packet and the largest received one that didn't arrive
+    int32_t n_packets = udt_seqnum_offset(window->first_seqnum, window->last_seqnum);
+    size_t len = 0;
+
+    for (int32_t offset = 0; offset < n_packets && offset < window->size; ++offset)
+    {
+        if (window->is_received[(window->first_slot + offset) % window->size] == 1)
+            continue;
+
+        int32_t last_offset = offset;
+        while (last_offset + 1 < n_packets && last_offset + 1 < window->size &&
+               window->is_received[(window->first_slot + last_offset + 1) % window->size] == 0)
+            last_offset++;
+
+        uint32_t first_lost = udt_seqnum_add(window->first_seqnum, offset);
+        uint32_t last_lost  = udt_seqnum_add(window->first_seqnum, last_offset);
+
+        if (first_lost == last_lost && len + 1 <= max_len)
+            loss_list[len++] = first_lost;
+        else if (first_lost != last_lost && len + 2 <= max_len)
+        {
+            loss_list[len++] = first_lost | PACKET_LOSS_RANGE_FLAG;
+            loss_list[len++] = last_lost;
+        }
+        else
+            break;
+
+        offset = last_offset;
+    }
+
+    return len;
+}
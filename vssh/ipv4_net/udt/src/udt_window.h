@@ -0,0 +1,109 @@
+#ifndef UDT_WINDOW_H_
+#define UDT_WINDOW_H_
+
+#define _UNIX03_THREADS
+
+#include "udt_packet.h"
+#include "udt_buffer.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Sequence numbers are 31-bit and wrap around, so they are compared by offsets only
+#define udt_seqnum_inc(seqnum)                    \
+    (((seqnum) + 1) & PACKET_MASK_SEQ)
+
+#define udt_seqnum_add(seqnum, n)                 \
+    (((seqnum) + (n)) & PACKET_MASK_SEQ)
+
+#define udt_seqnum_offset(seqnum1, seqnum2)       \
+    ((int32_t) (((uint32_t) (seqnum2) - (uint32_t) (seqnum1)) << 1) >> 1)
+
+/**
+ * The udt send window
+ *
+ * Keeps all packets that were sent but not acknowledged yet, so up to
+ * 'size' packets (less if congestion window is smaller) can be in flight
+ * at the same time. Packets are stored
+ * already serialized, the slot of a packet is defined by the offset of
+ * its sequence number from the oldest unacknowledged one. Packets and
+ * their retransmissions are queued to the output buffer of the connection
+ * by sequence numbers.
+ *
+ * A slot is the only copy of a packet: the application reserves the next
+ * one and writes the payload right there, sender-thread pins the slots it
+ * sends from, so they are not reused meanwhile.
+ */
+
+typedef struct
+{
+    udt_packet_t *packets;
+    uint16_t     *n_pins; // sender-thread sends from the slot
+    udt_buffer_t *output;
+
+    size_t   size;
+    size_t   cwnd;
+    size_t   first_slot;
+
+    uint32_t first_seqnum; // the oldest unacknowledged packet
+    uint32_t next_seqnum;  // the packet to be sent next
+
+    int      is_reserved;   // the next slot is being written by the application
+    size_t   n_attempts;    // retransmissions in a row without any acknowledgement
+    uint64_t timer_start;   // the last new acknowledgement, retransmission or send to empty window
+    uint64_t last_ack_time;
+    int      is_broken;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} udt_send_window_t;
+
+/**
+ * The udt receive window
+ *
+ * Holds data packets that arrived ahead of the expected one until the gap
+ * before them is filled, then they are delivered as a contiguous run.
+ * Packets are stored deserialized, the slot of a packet is defined by the
+ * offset of its sequence number from the expected one. Only receiver-thread
+ * uses it, so there is no lock.
+ */
+
+typedef struct
+{
+    udt_packet_t *packets;
+    char         *is_received;
+
+    size_t   size;
+    size_t   first_slot;
+
+    uint32_t first_seqnum; // the next expected packet
+    uint32_t last_seqnum;  // the largest received packet
+} udt_recv_window_t;
+
+int     udt_send_window_init    (udt_send_window_t *window, size_t size, uint32_t init_seqnum, udt_buffer_t *output);
+void    udt_send_window_destroy (udt_send_window_t *window);
+
+ssize_t udt_send_window_push    (udt_send_window_t *window, const udt_packet_header_t *header, const void *data, size_t len);
+char   *udt_send_window_reserve (udt_send_window_t *window);
+ssize_t udt_send_window_commit  (udt_send_window_t *window, const udt_packet_header_t *header, ssize_t len);
+size_t  udt_send_window_pin     (udt_send_window_t *window, udt_packet_t **packets, const uint32_t *seqnums, size_t n);
+void    udt_send_window_unpin   (udt_send_window_t *window, udt_packet_t **packets, size_t n);
+int     udt_send_window_ack     (udt_send_window_t *window, uint32_t ack_seqnum);
+int     udt_send_window_timeout (udt_send_window_t *window, uint64_t rto);
+int     udt_send_window_resend  (udt_send_window_t *window, const uint32_t *loss_list, size_t len);
+int     udt_send_window_flush   (udt_send_window_t *window);
+void    udt_send_window_break   (udt_send_window_t *window);
+void    udt_send_window_set_cwnd(udt_send_window_t *window, size_t cwnd);
+
+size_t  udt_send_window_n_flight(udt_send_window_t *window);
+
+int           udt_recv_window_init   (udt_recv_window_t *window, size_t size, uint32_t init_seqnum);
+void          udt_recv_window_destroy(udt_recv_window_t *window);
+void          udt_recv_window_start  (udt_recv_window_t *window, uint32_t init_seqnum);
+
+int           udt_recv_window_insert (udt_recv_window_t *window, const udt_packet_t *packet);
+udt_packet_t *udt_recv_window_first  (udt_recv_window_t *window);
+void          udt_recv_window_advance(udt_recv_window_t *window);
+size_t        udt_recv_window_losses (udt_recv_window_t *window, uint32_t *loss_list, size_t max_len);
+
+#endif // !UDT_WINDOW_H_
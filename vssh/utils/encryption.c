@@ -4,26 +4,205 @@
 #include <openssl/evp.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
-#include <openssl/aes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// Keys of files are parsed once and kept, a key is read again when its file changes
+// (checked once per CHECK_INTERVAL seconds at most) or after reload_RSA_keys()
+#define RSA_KEY_STORE_SIZE     4
+#define RSA_KEY_CHECK_INTERVAL 1 // seconds
+
+// Operations on a key of a file
+#define RSA_PUBLIC_ENCRYPT  0
+#define RSA_PRIVATE_ENCRYPT 1
+#define RSA_PUBLIC_DECRYPT  2
+#define RSA_PRIVATE_DECRYPT 3
+
+typedef struct
+{
+    char     *filename;
+    int       is_public;
+    EVP_PKEY *key;
+
+    struct timespec mtime; // of the file the key is read from
+    ino_t           inode;
+    time_t          checked_at;
+    unsigned        generation;
+} rsa_key_entry;
+
+static rsa_key_entry   RSA_KEYS[RSA_KEY_STORE_SIZE];
+static pthread_mutex_t RSA_KEYS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint     RSA_KEYS_GENERATION = 0;
 
-static RSA *create_RSA_filename(const char *filename, int is_public)
+static EVP_PKEY *read_key_file(const char *filename, int is_public, struct stat *file_stat)
 {
     FILE *fp = fopen(filename, "rb");
     if (fp == NULL)
         return NULL;
 
-    RSA *rsa = RSA_new();
- 
-    if (is_public)
-        rsa = PEM_read_RSA_PUBKEY(fp, &rsa, NULL, NULL);
-    else
-        rsa = PEM_read_RSAPrivateKey(fp, &rsa, NULL, NULL);
+    EVP_PKEY *key = NULL;
+    if (fstat(fileno(fp), file_stat) == 0)
+        key = is_public ? PEM_read_PUBKEY(fp, NULL, NULL, NULL) : PEM_read_PrivateKey(fp, NULL, NULL, NULL);
 
     fclose(fp);
- 
-    return rsa;
+
+    return key;
+}
+
+static int is_key_file_changed(const rsa_key_entry *entry)
+{
+    struct stat file_stat;
+    if (stat(entry->filename, &file_stat) == -1)
+        return 0; // keep the key while the file is away
+
+    return file_stat.st_ino != entry->inode ||
+           file_stat.st_mtim.tv_sec != entry->mtime.tv_sec || file_stat.st_mtim.tv_nsec != entry->mtime.tv_nsec;
+}
+
+// Returns a reference to the key, the caller frees it
+static EVP_PKEY *get_key_filename(const char *filename, int is_public)
+{
+    if (filename == NULL)
+        return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    unsigned generation = atomic_load(&RSA_KEYS_GENERATION);
+
+    pthread_mutex_lock(&RSA_KEYS_MUTEX);
+
+    rsa_key_entry *entry = NULL;
+    for (int i = 0; i < RSA_KEY_STORE_SIZE && entry == NULL; ++i)
+        if (RSA_KEYS[i].filename == NULL || (RSA_KEYS[i].is_public == is_public && strcmp(RSA_KEYS[i].filename, filename) == 0))
+            entry = &RSA_KEYS[i];
+
+    if (entry == NULL) // the store is full, the last key gives its place
+    {
+        entry = &RSA_KEYS[RSA_KEY_STORE_SIZE - 1];
+        EVP_PKEY_free(entry->key);
+        free(entry->filename);
+        memset(entry, 0, sizeof(rsa_key_entry));
+    }
+
+    if (entry->filename == NULL)
+    {
+        entry->filename  = strdup(filename);
+        entry->is_public = is_public;
+    }
+
+    int is_stale = entry->key == NULL || entry->generation != generation;
+    if (is_stale == 0 && now.tv_sec - entry->checked_at >= RSA_KEY_CHECK_INTERVAL)
+    {
+        entry->checked_at = now.tv_sec;
+        is_stale = is_key_file_changed(entry);
+    }
+
+    if (is_stale && entry->filename != NULL)
+    {
+        struct stat file_stat;
+        EVP_PKEY *key = read_key_file(filename, is_public, &file_stat);
+
+        if (key != NULL)
+        {
+            EVP_PKEY_free(entry->key);
+            entry->key   = key;
+            entry->mtime = file_stat.st_mtim;
+            entry->inode = file_stat.st_ino;
+        }
+        else if (entry->key != NULL)
+            syslog(LOG_WARNING, "Key \"%s\" couldn't be read again, the previous one is kept", filename);
+
+        entry->checked_at = now.tv_sec;
+        entry->generation = generation;
+    }
+
+    EVP_PKEY *key = entry->key;
+    if (key != NULL)
+        EVP_PKEY_up_ref(key);
+
+    pthread_mutex_unlock(&RSA_KEYS_MUTEX);
+
+    return key;
+}
+
+// Async-signal-safe: keys are read again on their next use
+void reload_RSA_keys(void)
+{
+    atomic_fetch_add(&RSA_KEYS_GENERATION, 1);
+}
+
+static int run_RSA_filename(int operation, const unsigned char *in, int in_len, unsigned char *out, const char *key_filename)
+{
+    int is_public = (operation == RSA_PUBLIC_ENCRYPT || operation == RSA_PUBLIC_DECRYPT);
+
+    EVP_PKEY *key = get_key_filename(key_filename, is_public);
+    if (key == NULL)
+        return -1;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    size_t out_len = EVP_PKEY_get_size(key);
+    int retval = -1;
+
+    if (ctx != NULL)
+    {
+        // Encryption with the private key is a signature of raw data and its decryption is the recovery of the data
+        int init_state = -1;
+        switch (operation)
+        {
+            case RSA_PUBLIC_ENCRYPT:
+                init_state = EVP_PKEY_encrypt_init(ctx);
+                break;
+
+            case RSA_PRIVATE_ENCRYPT:
+                init_state = EVP_PKEY_sign_init(ctx);
+                break;
+
+            case RSA_PUBLIC_DECRYPT:
+                init_state = EVP_PKEY_verify_recover_init(ctx);
+                break;
+
+            case RSA_PRIVATE_DECRYPT:
+                init_state = EVP_PKEY_decrypt_init(ctx);
+                break;
+        }
+
+        int run_state = -1;
+        if (init_state == 1 && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1)
+        {
+            switch (operation)
+            {
+                case RSA_PUBLIC_ENCRYPT:
+                    run_state = EVP_PKEY_encrypt(ctx, out, &out_len, in, in_len);
+                    break;
+
+                case RSA_PRIVATE_ENCRYPT:
+                    run_state = EVP_PKEY_sign(ctx, out, &out_len, in, in_len);
+                    break;
+
+                case RSA_PUBLIC_DECRYPT:
+                    run_state = EVP_PKEY_verify_recover(ctx, out, &out_len, in, in_len);
+                    break;
+
+                case RSA_PRIVATE_DECRYPT:
+                    run_state = EVP_PKEY_decrypt(ctx, out, &out_len, in, in_len);
+                    break;
+            }
+        }
+
+        if (run_state == 1)
+            retval = out_len;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(key);
+
+    return retval;
 }
 
 static RSA *create_RSA(const unsigned char *key, int is_public)
@@ -79,93 +258,20 @@ int private_decrypt_RSA(const unsigned char *encrypted_data, int data_len, unsig
 
 int public_encrypt_RSA_filename(const unsigned char *data, int data_len, unsigned char *encrypted_data, const char *key_filename)
 {
-    RSA *rsa = create_RSA_filename(key_filename, 1);
-    if (rsa == NULL)
-        return -1;
-
-    return RSA_public_encrypt(data_len, data, encrypted_data, rsa, RSA_PKCS1_PADDING);
+    return run_RSA_filename(RSA_PUBLIC_ENCRYPT, data, data_len, encrypted_data, key_filename);
 }
 
 int private_encrypt_RSA_filename(const unsigned char *data, int data_len, unsigned char *encrypted_data, const char *key_filename)
 {
-    RSA *rsa = create_RSA_filename(key_filename, 0);
-    if (rsa == NULL)
-        return -1;
-
-    return RSA_private_encrypt(data_len, data, encrypted_data, rsa, RSA_PKCS1_PADDING);
+    return run_RSA_filename(RSA_PRIVATE_ENCRYPT, data, data_len, encrypted_data, key_filename);
 }
 
 int public_decrypt_RSA_filename(const unsigned char *encrypted_data, int data_len, unsigned char *decrypted_data, const char *key_filename)
 {
-    RSA *rsa = create_RSA_filename(key_filename, 1);
-    if (rsa == NULL)
-        return -1;
-
-    return RSA_public_decrypt(data_len, encrypted_data, decrypted_data, rsa, RSA_PKCS1_PADDING);
+    return run_RSA_filename(RSA_PUBLIC_DECRYPT, encrypted_data, data_len, decrypted_data, key_filename);
 }
 
 int private_decrypt_RSA_filename(const unsigned char *encrypted_data, int data_len, unsigned char *decrypted_data, const char *key_filename)
 {
-    RSA *rsa = create_RSA_filename(key_filename, 0);
-    if (rsa == NULL)
-        return -1;
-
-    return RSA_private_decrypt(data_len, encrypted_data, decrypted_data, rsa, RSA_PKCS1_PADDING);
-}
-
-int encrypt_AES(const unsigned char *data, int data_len, unsigned char *encrypted_data, const unsigned char *key)
-{
-    int len = 0;
-    int encrypted_data_len = 0;
-    const unsigned char iv[] = "abdkdzZKnuih78n&";
-
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (ctx == NULL)
-        return -1;
-
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
-        return -1;
-
-    if (EVP_EncryptUpdate(ctx, encrypted_data, &len, data, data_len) != 1)
-        return -1;
-
-    encrypted_data_len = len;
-
-    if (EVP_EncryptFinal_ex(ctx, encrypted_data + len, &len) != 1)
-        return -1;
-    
-    encrypted_data_len += len;
-
-    EVP_CIPHER_CTX_free(ctx);
-
-    return encrypted_data_len;
-}
-
-int decrypt_AES(const unsigned char *encrypted_data, int encrypted_data_len, unsigned char *data, const unsigned char *key)
-{
-    int len = 0;
-    int data_len = 0;
-    const unsigned char iv[] = "abdkdzZKnuih78n&";
-
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (ctx == NULL)
-        return -1;
-
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
-        return -1;
-
-    if (EVP_DecryptUpdate(ctx, data, &len, encrypted_data, encrypted_data_len) != 1)
-        return -1;
-
-    data_len = len;
-
-    if (EVP_DecryptFinal_ex(ctx, data + len, &len) != 1)
-        return -1;
-
-    data_len += len;
-
-    EVP_CIPHER_CTX_free(ctx);
-
-    return data_len;
+    return run_RSA_filename(RSA_PRIVATE_DECRYPT, encrypted_data, data_len, decrypted_data, key_filename);
 }
-
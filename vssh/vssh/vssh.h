@@ -9,6 +9,8 @@
 #define SSH_SERVER_PORT 16161
 #define SSH_BROADCAST_PORT 11199
 
+#define VSSH_TICKET_DIR ".vssh" // in the home directory
+
 #define SSH_SECONDS_TIMEOUT_BROADCAST  1
 #define SSH_USECONDS_TIMEOUT_BROADCAST 0
 
@@ -19,4 +21,6 @@ int vssh_shell_request         (in_addr_t dest_ip, int connection_type, char *us
 int vssh_users_list_request    (in_addr_t dest_ip, int connection_type);
 int vssh_send_file             (in_addr_t dest_ip, int connection_type, char *username, char *src_file, char *dest_path);
 
+int vssh_execute_DH_protocol   (int socket_fd, in_addr_t dest_ip, int connection_type, ipv4_session *session);
+
 #endif // !VSSH_CLIENT_H_
@@ -12,16 +12,13 @@
 #include <openssl/err.h>
 #include <openssl/dh.h>
 #include <openssl/engine.h>
-#include <openssl/aes.h>
 
 extern struct termios DEFAULT_TERM;
 
 static int SOCKET_FD = -1;
 static int CONNECTION_TYPE = -1;
 static pthread_t SENDER_THREAD;
-static unsigned char *KEY = NULL;
-
-extern const char *VSSH_RSA_PRIVATE_KEY_PATH;
+static ipv4_session *SESSION = NULL;
 
 static void *vssh_shell_receiver(void *arg);
 
@@ -46,8 +43,8 @@ int vssh_send_message(in_addr_t dest_ip, const char *message, size_t len, int co
         return -1;
     }
     
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 0, VSSH_RSA_PRIVATE_KEY_PATH, connection_type);
+    ipv4_session session = {0};
+    int secret_size = vssh_execute_DH_protocol(socket_fd, dest_ip, connection_type, &session);
     if (secret_size <= 0)
     {
         close(socket_fd);
@@ -56,14 +53,14 @@ int vssh_send_message(in_addr_t dest_ip, const char *message, size_t len, int co
 
     size_t bytes_to_send = len > PACKET_DATA_SIZE ? PACKET_DATA_SIZE: len;
 
-    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, message, bytes_to_send, connection_type, secret);
+    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, message, bytes_to_send, connection_type, &session);
     if (sent_bytes == -1 || sent_bytes == 0)
     {
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
-    return ipv4_close_secure(socket_fd, connection_type, secret);
+    return ipv4_close_secure(socket_fd, connection_type, &session);
 }
 
 int vssh_shell_request(in_addr_t dest_ip, int connection_type, char *username)
@@ -109,29 +106,30 @@ int vssh_shell_request(in_addr_t dest_ip, int connection_type, char *username)
         return -1;
     }
 
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 0, VSSH_RSA_PRIVATE_KEY_PATH, connection_type);
+    ipv4_session session = {0};
+    int secret_size = vssh_execute_DH_protocol(socket_fd, dest_ip, connection_type, &session);
     if (secret_size <= 0)
     {
         close(socket_fd);
         return -1;
     }
 
-    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_SHELL_REQUEST_TYPE, 0, NULL, 0, username, username_length, NULL, 0, connection_type, secret);
+    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_SHELL_REQUEST_TYPE, 0, NULL, 0, username, username_length, NULL, 0, connection_type, &session);
     if (ctl_msg_state == -1)
     {
         fprintf(stderr, "ipv4_send_ctl_message_secure() couldn't send message\n");
         ipv4_close(socket_fd, connection_type);
+        ipv4_session_destroy(&session);
         return -1;
     }
 
     CONNECTION_TYPE = connection_type;
     SOCKET_FD       = socket_fd;
     SENDER_THREAD   = pthread_self();
-    KEY             = secret;
-    
-    int old_type = 0;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old_type);
+    SESSION         = &session;
+
+    // The receiver cancels this thread by the deferred type: only while it waits for input,
+    // never in the middle of a message holding the session
     pthread_detach(SENDER_THREAD);
 
     char buffer[BUFSIZ + 1] = {0};
@@ -156,9 +154,15 @@ int vssh_shell_request(in_addr_t dest_ip, int connection_type, char *username)
             return -1;
         }
 
-        size_t bytes_to_send = read_cmd_bytes > (PACKET_DATA_SIZE - AES_BLOCK_SIZE) ? (PACKET_DATA_SIZE - AES_BLOCK_SIZE) : read_cmd_bytes;
+        size_t bytes_to_send = read_cmd_bytes > (PACKET_DATA_SIZE - IPV4_SESSION_TAG_SIZE) ? (PACKET_DATA_SIZE - IPV4_SESSION_TAG_SIZE) : read_cmd_bytes;
+
+        int old_state = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+        ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, buffer, bytes_to_send, connection_type, &session);
+        pthread_setcancelstate(old_state, NULL);
+
+        pthread_testcancel(); // the session is left to the receiver once the message is sent
 
-        ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, buffer, bytes_to_send, connection_type, secret);
         if (sent_bytes == -1 || sent_bytes == 0)
         {
             fprintf(stderr, "ipv4_send_message() couldn't sent message\n");
@@ -171,14 +175,11 @@ int vssh_shell_request(in_addr_t dest_ip, int connection_type, char *username)
 
     pthread_cancel(recv_thread);
 
-    return ipv4_close_secure(socket_fd, connection_type, secret);
+    return ipv4_close_secure(socket_fd, connection_type, &session);
 }
 
 static void *vssh_shell_receiver(void *arg)
 {
-    int old_type = 0;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old_type);
-
     char buffer[PACKET_DATA_SIZE + 1] = {0};
     ipv4_ctl_message ctl_message = {0};
     char cancel_sign = 0x18;
@@ -187,7 +188,7 @@ static void *vssh_shell_receiver(void *arg)
 
     while (1)
     {
-        ssize_t recv_bytes_ctl = ipv4_receive_message_secure(SOCKET_FD, &ctl_message, sizeof(ipv4_ctl_message), CONNECTION_TYPE, KEY);
+        ssize_t recv_bytes_ctl = ipv4_receive_message_secure(SOCKET_FD, &ctl_message, sizeof(ipv4_ctl_message), CONNECTION_TYPE, SESSION);
         if (recv_bytes_ctl == -1)
         {
             fprintf(stderr, "ipv4_receive_message_secure() couldn't receive message\n");
@@ -197,14 +198,14 @@ static void *vssh_shell_receiver(void *arg)
         if (ctl_message.message_type == IPV4_SHUTDOWN_TYPE)
         {
             char buffer[3] = {0x17, 0};
-            ipv4_send_message_secure(SOCKET_FD, buffer, 2, CONNECTION_TYPE, KEY);
-            ipv4_send_ctl_message_secure(SOCKET_FD, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, CONNECTION_TYPE, KEY);
+            ipv4_send_message_secure(SOCKET_FD, buffer, 2, CONNECTION_TYPE, SESSION);
+            ipv4_send_ctl_message_secure(SOCKET_FD, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, CONNECTION_TYPE, SESSION);
             tcsetattr(STDIN_FILENO, TCSANOW, &DEFAULT_TERM);
 
             exit(EXIT_SUCCESS);
         }
 
-        ssize_t recv_bytes = ipv4_receive_message_secure(SOCKET_FD, buffer, ctl_message.message_length, CONNECTION_TYPE, KEY);
+        ssize_t recv_bytes = ipv4_receive_message_secure(SOCKET_FD, buffer, ctl_message.message_length, CONNECTION_TYPE, SESSION);
         if (recv_bytes == -1)
         {
             fprintf(stderr, "ipv4_receive_message_secure() couldn't receive message\n");
@@ -217,7 +218,7 @@ static void *vssh_shell_receiver(void *arg)
             pthread_cancel(SENDER_THREAD);
             fprintf(stderr, "Password is invalid or server error occured!\n");
             tcsetattr(STDIN_FILENO, TCSANOW, &DEFAULT_TERM);
-            ipv4_close_secure(SOCKET_FD, CONNECTION_TYPE, KEY);
+            ipv4_close_secure(SOCKET_FD, CONNECTION_TYPE, SESSION);
 
             exit(EXIT_FAILURE);
         }
@@ -334,38 +335,38 @@ int vssh_users_list_request(in_addr_t dest_ip, int connection_type)
         return -1;
     }
 
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 0, VSSH_RSA_PRIVATE_KEY_PATH, connection_type);
+    ipv4_session session = {0};
+    int secret_size = vssh_execute_DH_protocol(socket_fd, dest_ip, connection_type, &session);
     if (secret_size <= 0)
     {
         ipv4_close(socket_fd, connection_type);
         return -1;
     }
 
-    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_USERS_LIST_REQUEST_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, connection_type, secret);
+    int ctl_msg_state = ipv4_send_ctl_message_secure(socket_fd, IPV4_USERS_LIST_REQUEST_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, connection_type, &session);
     if (ctl_msg_state == -1)
     {
         fprintf(stderr, "ipv4_send_ctl_message() couldn't control message\n");
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
     ipv4_ctl_message ctl_message = {0};
     char buffer[PACKET_DATA_SIZE + 1];
 
-    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, secret);
+    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, &session);
     if (recv_bytes_ctl == -1)
     {
         fprintf(stderr, "ipv4_receive_message_secure() couldn't receive message\n");
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
     
-    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, buffer, ctl_message.message_length, connection_type, secret);
+    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, buffer, ctl_message.message_length, connection_type, &session);
     if (recv_bytes == -1)
     {
         fprintf(stderr, "ipv4_receive_message_secure() couldn't receive message\n");
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
@@ -373,7 +374,7 @@ int vssh_users_list_request(in_addr_t dest_ip, int connection_type)
     printf("All server users:\n"
            "%s\n", buffer);
 
-    return ipv4_close_secure(socket_fd, connection_type, secret);
+    return ipv4_close_secure(socket_fd, connection_type, &session);
 }
 
 int vssh_send_file(in_addr_t dest_ip, int connection_type, char *username, char *src_file, char *dest_path)
@@ -421,43 +422,28 @@ int vssh_send_file(in_addr_t dest_ip, int connection_type, char *username, char
         return -1;
     }
 
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 0, VSSH_RSA_PRIVATE_KEY_PATH, connection_type);
+    ipv4_session session = {0};
+    int secret_size = vssh_execute_DH_protocol(socket_fd, dest_ip, connection_type, &session);
     if (secret_size <= 0)
     {
         close(socket_fd);
         return -1;
     }
 
-    // Get ready to send file
+    // Get ready to send file, it is read chunk by chunk while being sent
     off_t file_size = get_file_size(src_file_fd);
-
-    char *file_buffer = malloc(file_size + 1);
-    if (file_buffer == NULL)
+    if (file_size == -1)
     {
-        fprintf(stderr, "malloc() error\n");
-        ipv4_close_secure(socket_fd, connection_type, secret);
         close(src_file_fd);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
-    file_buffer[file_size + 1] = 0;
-
     fprintf(stderr, "\033[0;37m"); // gray
     fprintf(stderr, "Password: ");
 
-    ssize_t read_error = read(src_file_fd, file_buffer, file_size);
-    if (read_error == -1)
-    {
-        perror("read");
-        free(file_buffer);
-        close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
-        return -1;
-    }
-
     ipv4_send_ctl_message_secure(socket_fd, IPV4_FILE_HEADER_TYPE, file_size, NULL, 0,
-                                 username, username_length, dest_path, dest_path_length, connection_type, secret);
+                                 username, username_length, dest_path, dest_path_length, connection_type, &session);
 
     char password_buffer[BUFSIZ + 1] = {0};
     ipv4_ctl_message ctl_message = {0};
@@ -467,41 +453,37 @@ int vssh_send_file(in_addr_t dest_ip, int connection_type, char *username, char
     if (read_cmd_bytes == -1)
     {
         perror("read() error");
-        free(file_buffer);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
-    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, password_buffer, read_cmd_bytes, connection_type, secret);
+    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, password_buffer, read_cmd_bytes, connection_type, &session);
     if (sent_bytes == -1 || sent_bytes == 0)
     {
         fprintf(stderr, "ipv4_send_message() couldn't sent message\n");
-        free(file_buffer);
         close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         return -1;
     }
 
     memset(password_buffer, 0, read_cmd_bytes + 1);
 
-    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, secret);
+    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, &session);
     if (recv_bytes_ctl == -1)
     {
         fprintf(stderr, "ipv4_receive_message() couldn't receive message\n");
-        free(file_buffer);
         close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
     }
 
     size_t bytes_to_read = ctl_message.message_length > BUFSIZ ? BUFSIZ: ctl_message.message_length;
 
-    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, password_buffer, bytes_to_read, connection_type, secret);
+    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, password_buffer, bytes_to_read, connection_type, &session);
     if (recv_bytes == -1)
     {
         fprintf(stderr, "ipv4_receive_message() couldn't receive message\n");
-        free(file_buffer);
         close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
     }
 
     // Check for respond
@@ -514,33 +496,36 @@ int vssh_send_file(in_addr_t dest_ip, int connection_type, char *username, char
     if (password_buffer[0] == cancel_msg)
     {
         fprintf(stderr, "Invalid password!\n");
-        free(file_buffer);
         close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
         
         return -1;
     }
     else if (password_buffer[0] == error_msg)
     {
         fprintf(stderr, "Error occured! See vsshd journal logs.\n");
-        free(file_buffer);
         close(src_file_fd);
-        ipv4_close_secure(socket_fd, connection_type, secret);
+        ipv4_close_secure(socket_fd, connection_type, &session);
 
         return -1;
     }
     else if (password_buffer[0] == file_send_request_msg)
     {
-        ipv4_send_buffer_secure(socket_fd, file_buffer, file_size, IPV4_FILE_HEADER_TYPE, NULL, 0,
-                                username, username_length, dest_path, dest_path_length, connection_type, secret);
+        sent_bytes = ipv4_send_file_secure(socket_fd, src_file_fd, NULL, 0, username, username_length,
+                                           dest_path, dest_path_length, connection_type, &session);
+        close(src_file_fd);
 
-        free(file_buffer);
-        fprintf(stdout, "Successfully sent!\n");
+        if (sent_bytes != file_size)
+        {
+            fprintf(stderr, "ipv4_send_file_secure() couldn't send file\n");
+            ipv4_close_secure(socket_fd, connection_type, &session);
+            return -1;
+        }
 
-        close(src_file_fd);
+        fprintf(stdout, "Successfully sent!\n");
     }
 
-    ipv4_close_secure(socket_fd, connection_type, secret);
+    ipv4_close_secure(socket_fd, connection_type, &session);
 
     return 0;
 }
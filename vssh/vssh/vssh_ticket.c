@@ -0,0 +1,97 @@
+#include "vssh.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <openssl/crypto.h>
+
+#define MAX_TICKET_PATH_LENGTH 512
+
+extern const char *VSSH_RSA_PRIVATE_KEY_PATH;
+
+// A ticket of a server lives in ~/.vssh/ticket_<IP>_<IPv4Type>
+static int get_ticket_path(in_addr_t dest_ip, int connection_type, char *path, int is_mkdir)
+{
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return -1;
+
+    int length = snprintf(path, MAX_TICKET_PATH_LENGTH, "%s/%s", home, VSSH_TICKET_DIR);
+    if (length < 0 || length >= MAX_TICKET_PATH_LENGTH)
+        return -1;
+
+    if (is_mkdir && mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    char ip[INET_ADDRSTRLEN] = {0};
+    struct in_addr addr = {.s_addr = dest_ip};
+    if (inet_ntop(AF_INET, &addr, ip, sizeof(ip)) == NULL)
+        return -1;
+
+    length = snprintf(path + length, MAX_TICKET_PATH_LENGTH - length, "/ticket_%s_%s", ip, (connection_type == SOCK_STREAM) ? "tcp" : "udp");
+    if (length < 0 || length >= MAX_TICKET_PATH_LENGTH)
+        return -1;
+
+    return 0;
+}
+
+static void load_ticket(in_addr_t dest_ip, int connection_type, ipv4_ticket *ticket)
+{
+    memset(ticket, 0, sizeof(ipv4_ticket));
+
+    char path[MAX_TICKET_PATH_LENGTH] = {0};
+    if (get_ticket_path(dest_ip, connection_type, path, 0) == -1)
+        return;
+
+    int ticket_fd = open(path, O_RDONLY);
+    if (ticket_fd == -1)
+        return;
+
+    if (read(ticket_fd, ticket, sizeof(ipv4_ticket)) != sizeof(ipv4_ticket) || ipv4_ticket_is_valid(ticket) == 0)
+        OPENSSL_cleanse(ticket, sizeof(ipv4_ticket));
+
+    close(ticket_fd);
+}
+
+// The new ticket replaces the old one at once, so parallel clients read either of them whole
+static void save_ticket(in_addr_t dest_ip, int connection_type, const ipv4_ticket *ticket)
+{
+    char path[MAX_TICKET_PATH_LENGTH] = {0};
+    if (get_ticket_path(dest_ip, connection_type, path, 1) == -1)
+        return;
+
+    if (ipv4_ticket_is_valid(ticket) == 0)
+    {
+        unlink(path);
+        return;
+    }
+
+    char tmp_path[MAX_TICKET_PATH_LENGTH + 16] = {0};
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+
+    int ticket_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (ticket_fd == -1)
+        return;
+
+    ssize_t written_bytes = write(ticket_fd, ticket, sizeof(ipv4_ticket));
+    close(ticket_fd);
+
+    if (written_bytes != sizeof(ipv4_ticket) || rename(tmp_path, path) == -1)
+        unlink(tmp_path);
+}
+
+// The handshake resumes the last session with the server when there is a ticket for it
+int vssh_execute_DH_protocol(int socket_fd, in_addr_t dest_ip, int connection_type, ipv4_session *session)
+{
+    ipv4_ticket ticket;
+    load_ticket(dest_ip, connection_type, &ticket);
+
+    int secret_size = ipv4_execute_DH_protocol(socket_fd, session, &ticket, 0, VSSH_RSA_PRIVATE_KEY_PATH, connection_type);
+    if (secret_size > 0)
+        save_ticket(dest_ip, connection_type, &ticket);
+
+    OPENSSL_cleanse(&ticket, sizeof(ticket));
+
+    return secret_size;
+}
@@ -0,0 +1,191 @@
+#include "server.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+extern const char *VSSH_RSA_PUBLIC_KEY_PATH;
+
+// A step of a handshake taking CPU time, its connection thread waits for it
+typedef struct
+{
+    void (*step)(void *);
+    void  *arg;
+    int   *is_done;
+} crypto_job;
+
+typedef struct
+{
+    crypto_job      jobs[VSSHD_HANDSHAKE_QUEUE_SIZE];
+    size_t          head;  // the next job to run
+    size_t          depth; // jobs in the queue
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;  // a job is queued
+    pthread_cond_t  done;  // a job is done
+
+    // Metrics reported to syslog
+    size_t   peak_depth;
+    uint64_t n_done;
+    uint64_t n_failed;
+    uint64_t n_rejected;
+} handshake_pool;
+
+static handshake_pool POOL = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static pthread_once_t POOL_ONCE = PTHREAD_ONCE_INIT;
+
+// Nothing is sent to a client that may be gone already
+static void close_connection(int socket_fd, int connection_type)
+{
+    if (connection_type == SOCK_STREAM)
+        close(socket_fd);
+    else
+        ipv4_close(socket_fd, connection_type);
+}
+
+// The handshake doesn't wait for a silent client longer than TIMEOUT
+static void set_handshake_timeout(int socket_fd, int connection_type, time_t seconds)
+{
+    struct timeval timeout = {.tv_sec = seconds, .tv_usec = 0};
+
+    if (connection_type == SOCK_STREAM)
+    {
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    else if (connection_type == SOCK_STREAM_UDT)
+        udt_setsockopt(socket_fd, UDT_RECV_TIMEOUT, &timeout, sizeof(timeout)); // messages of the handshake never wait for the window
+}
+
+static void *handshake_worker(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&(POOL.mutex));
+
+        while (POOL.depth == 0)
+            pthread_cond_wait(&(POOL.cond), &(POOL.mutex));
+
+        crypto_job job = POOL.jobs[POOL.head];
+        POOL.head = (POOL.head + 1) % VSSHD_HANDSHAKE_QUEUE_SIZE;
+        POOL.depth--;
+
+        pthread_mutex_unlock(&(POOL.mutex));
+
+        job.step(job.arg);
+
+        pthread_mutex_lock(&(POOL.mutex));
+        *(job.is_done) = 1;
+        pthread_mutex_unlock(&(POOL.mutex));
+
+        pthread_cond_broadcast(&(POOL.done));
+    }
+
+    return NULL;
+}
+
+// The crypto runner of the key exchange: the step waits in the queue for a worker
+static int run_crypto_step(void (*step)(void *), void *arg)
+{
+    pthread_mutex_lock(&(POOL.mutex));
+
+    if (POOL.depth == VSSHD_HANDSHAKE_QUEUE_SIZE)
+    {
+        POOL.n_rejected++;
+        pthread_mutex_unlock(&(POOL.mutex));
+
+        ipv4_syslog(LOG_WARNING, "[HANDSHAKE]: queue is full, connection is turned away");
+        return -1;
+    }
+
+    int is_done = 0;
+
+    size_t tail = (POOL.head + POOL.depth) % VSSHD_HANDSHAKE_QUEUE_SIZE;
+    POOL.jobs[tail] = (crypto_job) {.step = step, .arg = arg, .is_done = &is_done};
+    POOL.depth++;
+
+    if (POOL.depth > POOL.peak_depth)
+        POOL.peak_depth = POOL.depth;
+
+    pthread_cond_signal(&(POOL.cond));
+
+    while (is_done == 0)
+        pthread_cond_wait(&(POOL.done), &(POOL.mutex));
+
+    pthread_mutex_unlock(&(POOL.mutex));
+
+    return 0;
+}
+
+static void launch_handshake_pool(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long n_workers = (n_cpus > 0) ? n_cpus * VSSHD_HANDSHAKE_WORKERS_PER_CPU : VSSHD_HANDSHAKE_MIN_WORKERS;
+    if (n_workers < VSSHD_HANDSHAKE_MIN_WORKERS)
+        n_workers = VSSHD_HANDSHAKE_MIN_WORKERS;
+
+    long n_launched = 0;
+    for (long i = 0; i < n_workers; ++i)
+    {
+        pthread_t worker = {0};
+        if (pthread_create(&worker, NULL, handshake_worker, NULL) != 0)
+            continue;
+
+        pthread_detach(worker);
+        n_launched++;
+    }
+
+    // Steps are run by the connection threads themselves if there is no worker
+    if (n_launched > 0)
+        ipv4_set_crypto_runner(run_crypto_step);
+
+    ipv4_syslog(LOG_INFO, "[HANDSHAKE]: %ld workers, queue of %d steps", n_launched, VSSHD_HANDSHAKE_QUEUE_SIZE);
+}
+
+// Runs in the thread of the connection, which owns the connection with its session after it
+vsshd_connection *handshake_run(int socket_fd, int connection_type)
+{
+    pthread_once(&POOL_ONCE, launch_handshake_pool);
+
+    vsshd_connection *connection = calloc(1, sizeof(vsshd_connection));
+    if (connection == NULL)
+    {
+        close_connection(socket_fd, connection_type);
+        return NULL;
+    }
+
+    connection->socket_fd       = socket_fd;
+    connection->connection_type = connection_type;
+
+    set_handshake_timeout(socket_fd, connection_type, VSSHD_HANDSHAKE_TIMEOUT);
+    int secret_size = ipv4_execute_DH_protocol(socket_fd, &(connection->session), NULL, 1, VSSH_RSA_PUBLIC_KEY_PATH, connection_type);
+    set_handshake_timeout(socket_fd, connection_type, 0);
+
+    pthread_mutex_lock(&(POOL.mutex));
+
+    if (secret_size > 0)
+        POOL.n_done++;
+    else
+        POOL.n_failed++;
+
+    if ((POOL.n_done + POOL.n_failed) % VSSHD_HANDSHAKE_STATS_INTERVAL == 0)
+    {
+        ipv4_syslog(LOG_INFO, "[HANDSHAKE]: %lu done, %lu failed, %lu turned away, queue depth %zu (peak %zu)",
+                    (unsigned long) POOL.n_done, (unsigned long) POOL.n_failed, (unsigned long) POOL.n_rejected, POOL.depth, POOL.peak_depth);
+
+        uint64_t n_hits = 0, n_misses = 0;
+        ipv4_pool_stats(&n_hits, &n_misses);
+        ipv4_syslog(LOG_INFO, "[POOL]: %lu hits, %lu misses of packet buffers", (unsigned long) n_hits, (unsigned long) n_misses);
+    }
+
+    pthread_mutex_unlock(&(POOL.mutex));
+
+    if (secret_size <= 0)
+    {
+        ipv4_syslog(LOG_ERR, "[HANDSHAKE]: Diffie-Hellman protocol failed");
+
+        close_connection(socket_fd, connection_type);
+        free(connection);
+        return NULL;
+    }
+
+    return connection;
+}
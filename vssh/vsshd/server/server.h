@@ -2,6 +2,7 @@
 #define SERVER_H_
 
 #include "ipv4_net.h"
+#include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -34,14 +35,47 @@
 
 #define SSH_SERVER_PORT 16161
 
+// Handshake pool parameters
+// Steps of handshakes taking CPU time run on WORKERS_PER_CPU workers per online CPU (MIN_WORKERS
+// at least), up to QUEUE_SIZE steps wait for a worker and connections of the next ones are turned
+// away, the queue depth is reported to syslog every STATS_INTERVAL handshakes
+#define VSSHD_HANDSHAKE_WORKERS_PER_CPU 2
+#define VSSHD_HANDSHAKE_MIN_WORKERS     4
+#define VSSHD_HANDSHAKE_QUEUE_SIZE      256
+#define VSSHD_HANDSHAKE_TIMEOUT         10 // seconds of a client to answer
+#define VSSHD_HANDSHAKE_STATS_INTERVAL  64
+
+#define VSSHD_TERMINAL_HANGUP_TIMEOUT   2 // seconds for bash to exit when its client is gone
+
+/**
+ * Handshakes of new connections
+ *
+ * Every connection runs its handshake in a thread of its own and waits
+ * there for the messages of its client. Only key generation, RSA and the
+ * derivation of the secret are handed to a fixed number of workers
+ * through a queue of bounded size, a connection finding the queue full is
+ * turned away at once. A wave of new connections takes CPU time from
+ * established sessions only through the workers, while a slow or silent
+ * client holds nothing but its own thread.
+ */
+
+typedef struct
+{
+    int          socket_fd;
+    int          connection_type;
+    ipv4_session session;
+} vsshd_connection;
+
+vsshd_connection *handshake_run(int socket_fd, int connection_type);
+
 int launch_vssh_tcp_server(in_addr_t ip);
 void *tcp_server_handler(void *connection_socket);
 
 int launch_vssh_udp_server(in_addr_t ip);
 void *udt_server_handler(void *connection_socket);
 
-int handle_terminal_request(int socket_fd, int connection_type, char *username, unsigned char *key);
-int handle_users_list_request(int socket_fd, int connection_type, unsigned char *key);
-int handle_file(int socket_fd, int connection_type, size_t file_size, char *username, char *dest_file_path, unsigned char *key);
+int handle_terminal_request(int socket_fd, int connection_type, char *username, ipv4_session *session);
+int handle_users_list_request(int socket_fd, int connection_type, ipv4_session *session);
+int handle_file(int socket_fd, int connection_type, size_t file_size, char *username, char *dest_file_path, ipv4_session *session);
 
 #endif // !SERVER_H_
@@ -1,30 +1,31 @@
 #include "server.h"
 
-extern const char *VSSH_RSA_PUBLIC_KEY_PATH;
+static void tcp_session_cleanup(void *connection)
+{
+    vsshd_connection *tcp_connection = (vsshd_connection *) connection;
 
-void *tcp_server_handler(void *connection_socket)
+    ipv4_session_destroy(&(tcp_connection->session));
+    close(tcp_connection->socket_fd);
+    free(tcp_connection);
+}
+
+// Runs once the handshake of the connection is over
+static void *tcp_session_handler(void *connection)
 {
-    int socket_fd = (int) connection_socket;
+    int socket_fd = ((vsshd_connection *) connection)->socket_fd;
+    ipv4_session *session = &(((vsshd_connection *) connection)->session);
 
     ipv4_ctl_message ctl_message;
     char message[PACKET_DATA_SIZE + 1] = {0};
 
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 1, VSSH_RSA_PUBLIC_KEY_PATH, SOCK_STREAM);
-    if (secret_size <= 0)
-    {
-        ipv4_tcp_syslog(LOG_ERR, "Diffie-Hellman protocol failed");
-
-        void *retval = NULL;
-        pthread_exit(retval);
-    }
+    pthread_cleanup_push(tcp_session_cleanup, connection);
 
     ipv4_tcp_syslog(LOG_INFO, "Diffie-Hellman protocol succeed");
     ipv4_tcp_syslog(LOG_INFO, "new thread is ready to work");
 
     while (1)
     {
-        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), SOCK_STREAM, secret);
+        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), SOCK_STREAM, session);
         if (recv_bytes != -1 && recv_bytes != 0)
         {
             switch (ctl_message.message_type)
@@ -39,7 +40,7 @@ void *tcp_server_handler(void *connection_socket)
                     
                 case IPV4_MSG_HEADER_TYPE:
                 {
-                    recv_bytes = ipv4_receive_message_secure(socket_fd, message, ctl_message.message_length, SOCK_STREAM, secret);
+                    recv_bytes = ipv4_receive_message_secure(socket_fd, message, ctl_message.message_length, SOCK_STREAM, session);
                     if (recv_bytes == -1 || recv_bytes == 0)
                         ipv4_tcp_syslog(LOG_ERR, "couldn't receive message after getting msg header");
                     message[ctl_message.message_length] = 0;
@@ -53,7 +54,7 @@ void *tcp_server_handler(void *connection_socket)
                 case IPV4_SHELL_REQUEST_TYPE:
                 {
                     ipv4_tcp_syslog(LOG_INFO, "get shell request");
-                    handle_terminal_request(socket_fd, SOCK_STREAM, ctl_message.spare_buffer1, secret);
+                    handle_terminal_request(socket_fd, SOCK_STREAM, ctl_message.spare_buffer1, session);
 
                     break;
                 }
@@ -61,7 +62,7 @@ void *tcp_server_handler(void *connection_socket)
                 case IPV4_FILE_HEADER_TYPE:
                 {
                     ipv4_tcp_syslog(LOG_INFO, "get file \"%s\" to user \"%s\"", ctl_message.spare_buffer2, ctl_message.spare_buffer1);
-                    handle_file(socket_fd, SOCK_STREAM, ctl_message.message_length, ctl_message.spare_buffer1, ctl_message.spare_buffer2, secret);
+                    handle_file(socket_fd, SOCK_STREAM, ctl_message.message_length, ctl_message.spare_buffer1, ctl_message.spare_buffer2, session);
 
                     break;
                 }
@@ -69,7 +70,7 @@ void *tcp_server_handler(void *connection_socket)
                 case IPV4_USERS_LIST_REQUEST_TYPE:
                 {
                     ipv4_tcp_syslog(LOG_INFO, "get users list request");
-                    handle_users_list_request(socket_fd, SOCK_STREAM, secret);
+                    handle_users_list_request(socket_fd, SOCK_STREAM, session);
                     
                     break;
                 }
@@ -88,10 +89,22 @@ void *tcp_server_handler(void *connection_socket)
             
     }
 
+    pthread_cleanup_pop(1);
+
     void *retval = NULL;
     pthread_exit(retval);
 }
 
+// Runs the handshake of a new connection and serves it
+void *tcp_server_handler(void *connection_socket)
+{
+    vsshd_connection *connection = handshake_run((int) (intptr_t) connection_socket, SOCK_STREAM);
+    if (connection == NULL)
+        return NULL;
+
+    return tcp_session_handler(connection);
+}
+
 int launch_vssh_tcp_server(in_addr_t ip)
 {
     int socket_fd = ipv4_socket(SOCK_STREAM, SO_REUSEADDR);
@@ -137,18 +150,19 @@ int launch_vssh_tcp_server(in_addr_t ip)
         ipv4_tcp_syslog(LOG_NOTICE, "new connection: IP = %s, port = %d!\n", 
                         inet_ntoa(accept_addr.sin_addr), (int) ntohs(accept_addr.sin_port));
 
-        pthread_t new_thread = {0}; 
-        int pthread_error = pthread_create(&new_thread, NULL, tcp_server_handler, (void *) accepted_socket_fd);
-        if (pthread_error == -1)
+        pthread_t new_thread = {0};
+        int pthread_error = pthread_create(&new_thread, NULL, tcp_server_handler, (void *) (intptr_t) accepted_socket_fd);
+        if (pthread_error != 0)
         {
-            ipv4_tcp_syslog(LOG_ERR, "error in pthread_create(): %s", strerror(errno));
+            ipv4_tcp_syslog(LOG_ERR, "error in pthread_create(): %s", strerror(pthread_error));
             ipv4_tcp_syslog(LOG_ERR, "cannot connnect with client because of pthread_create() error");
+            close(accepted_socket_fd);
             continue;
         }
 
         pthread_error = pthread_detach(new_thread);
-        if (pthread_error == -1)
-            ipv4_tcp_syslog(LOG_WARNING, "error in pthread_detach(): %s", strerror(errno));
+        if (pthread_error != 0)
+            ipv4_tcp_syslog(LOG_WARNING, "error in pthread_detach(): %s", strerror(pthread_error));
     }
 
     return 0;
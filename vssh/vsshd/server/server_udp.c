@@ -1,37 +1,39 @@
 #include "server.h"
 
-extern const char *VSSH_RSA_PUBLIC_KEY_PATH;
+static void udt_session_cleanup(void *connection)
+{
+    vsshd_connection *udt_connection = (vsshd_connection *) connection;
 
-void *udt_server_handler(void *connection_socket)
+    // All clients are served by one process, the connection must be released
+    ipv4_session_destroy(&(udt_connection->session));
+    ipv4_close(udt_connection->socket_fd, SOCK_STREAM_UDT);
+    free(udt_connection);
+}
+
+// Runs once the handshake of the connection is over
+static void *udt_session_handler(void *connection)
 {
-    int socket_fd = (int) connection_socket;
-    
+    int socket_fd = ((vsshd_connection *) connection)->socket_fd;
+    ipv4_session *session = &(((vsshd_connection *) connection)->session);
+
     ipv4_ctl_message ctl_message;
     char message[PACKET_DATA_SIZE + 1] = {0};
 
-    unsigned char secret[IPV4_SPARE_BUFFER_LENGTH] = {0};
-    int secret_size = ipv4_execute_DH_protocol(socket_fd, secret, 1, VSSH_RSA_PUBLIC_KEY_PATH, SOCK_STREAM_UDT);
-    if (secret_size <= 0)
-    {
-        ipv4_udt_syslog(LOG_ERR, "Diffie-Hellman protocol failed");
-
-        void *retval = NULL;
-        pthread_exit(retval);
-    }
+    pthread_cleanup_push(udt_session_cleanup, connection);
 
     ipv4_udt_syslog(LOG_INFO, "Diffie-Hellman protocol succeed");
     ipv4_udt_syslog(LOG_INFO, "is ready to work");
 
     while(1)
     {
-        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), SOCK_STREAM_UDT, secret);
+        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), SOCK_STREAM_UDT, session);
         if (recv_bytes != -1 && recv_bytes != 0)
         {
             switch (ctl_message.message_type)
             {
                 case IPV4_MSG_HEADER_TYPE:
                 {
-                    recv_bytes = ipv4_receive_message_secure(socket_fd, message, ctl_message.message_length, SOCK_STREAM_UDT, secret);
+                    recv_bytes = ipv4_receive_message_secure(socket_fd, message, ctl_message.message_length, SOCK_STREAM_UDT, session);
                     if (recv_bytes == -1 || recv_bytes == 0)
                         ipv4_udt_syslog(LOG_ERR, "couldn't receive message after getting msg header");
 
@@ -44,7 +46,7 @@ void *udt_server_handler(void *connection_socket)
                 case IPV4_SHELL_REQUEST_TYPE:
                 {
                     ipv4_udt_syslog(LOG_INFO, "get shell request");
-                    handle_terminal_request(socket_fd, SOCK_STREAM_UDT, ctl_message.spare_buffer1, secret);
+                    handle_terminal_request(socket_fd, SOCK_STREAM_UDT, ctl_message.spare_buffer1, session);
 
                     break;
                 }
@@ -52,7 +54,7 @@ void *udt_server_handler(void *connection_socket)
                 case IPV4_FILE_HEADER_TYPE:
                 {
                     ipv4_udt_syslog(LOG_INFO, "get file \"%s\" to user \"%s\"", ctl_message.spare_buffer2, ctl_message.spare_buffer1);
-                    handle_file(socket_fd, SOCK_STREAM_UDT, ctl_message.message_length, ctl_message.spare_buffer1, ctl_message.spare_buffer2, secret);
+                    handle_file(socket_fd, SOCK_STREAM_UDT, ctl_message.message_length, ctl_message.spare_buffer1, ctl_message.spare_buffer2, session);
 
                     break;
                 }
@@ -60,7 +62,7 @@ void *udt_server_handler(void *connection_socket)
                 case IPV4_USERS_LIST_REQUEST_TYPE:
                 {
                     ipv4_udt_syslog(LOG_INFO, "get users list request");
-                    handle_users_list_request(socket_fd, SOCK_STREAM_UDT, secret);
+                    handle_users_list_request(socket_fd, SOCK_STREAM_UDT, session);
                     
                     break;
                 }
@@ -71,12 +73,29 @@ void *udt_server_handler(void *connection_socket)
 
             memset(message, 0, sizeof(message));
         }
+        else
+        {
+            ipv4_udt_syslog(LOG_NOTICE, "connection is closed");
+            break;
+        }
     }
 
+    pthread_cleanup_pop(1);
+
     void *retval = 0;
     pthread_exit(retval);
 }
 
+// The thread made for a new connection by the listener runs its handshake and serves it
+void *udt_server_handler(void *connection_socket)
+{
+    vsshd_connection *connection = handshake_run((int) (intptr_t) connection_socket, SOCK_STREAM_UDT);
+    if (connection == NULL)
+        return NULL;
+
+    return udt_session_handler(connection);
+}
+
 int launch_vssh_udp_server(in_addr_t ip)
 {
     int socket_fd = ipv4_socket(SOCK_DGRAM, SO_REUSEADDR);
@@ -9,7 +9,6 @@
 #include <unistd.h>
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
-#include <openssl/aes.h>
 #include <sys/select.h>
 #include <errno.h>
 #include <signal.h>
@@ -17,14 +16,25 @@
 #include <sys/resource.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Every shell of the process has its own terminal, the sender thread gets it by pointer
+typedef struct
+{
+    int           socket_fd;
+    int           master_fd;
+    int           connection_type;
+    ipv4_session *session;
+    pid_t         bash_pid;
+    int           bash_pidfd;  // -1 if the kernel has no pidfd_open()
+    atomic_int    is_closing;  // the client is gone, bash exit isn't reported
+} terminal_session;
 
-static int SOCKET_FD = -1;
-static int MASTER_FD = -1;
-static int CONNECTION_TYPE = -1;
-static unsigned char *KEY = NULL;
-static pid_t BASH_PID = -2;
 static const char *VSSH_CGROUP_PATH       = "/sys/fs/cgroup/vsshd";
 static const char *VSSH_CGROUP_PROCS_PATH = "/sys/fs/cgroup/vsshd/cgroup.procs";
 
@@ -34,8 +44,9 @@ static struct pam_conv conv =
     NULL
 };
 
-int handle_terminal_commands(int socket_fd, int master_fd, int connection_type, unsigned char *key);
+int handle_terminal_commands(int socket_fd, int master_fd, pid_t bash_pid, int connection_type, ipv4_session *session);
 static void *handle_terminal_sender(void *arg);
+static void close_terminal(terminal_session *terminal, pthread_t send_thread);
 static int write_pid_to_vsshd_cgroup(pid_t pid_to_write);
 int login_into_user(char *username);
 
@@ -68,7 +79,7 @@ int write_pid_to_vsshd_cgroup(pid_t pid_to_write)
     return 0;
 }
 
-int handle_terminal_request(int socket_fd, int connection_type, char *username, unsigned char *key)
+int handle_terminal_request(int socket_fd, int connection_type, char *username, ipv4_session *session)
 {
     int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (master_fd == -1)
@@ -126,8 +137,6 @@ int handle_terminal_request(int socket_fd, int connection_type, char *username,
         return -1;
     }
 
-    BASH_PID = child_pid;
-
     #undef CLOSE_MASTER_AND_LOG
 
     if (child_pid == 0)
@@ -209,7 +218,7 @@ int handle_terminal_request(int socket_fd, int connection_type, char *username,
 
     ipv4_syslog(LOG_INFO, "[TERMINAL]: successfully create terminal with bash");
 
-    return handle_terminal_commands(socket_fd, master_fd, connection_type, key);
+    return handle_terminal_commands(socket_fd, master_fd, child_pid, connection_type, session);
 }
 
 int login_into_user(char *username)
@@ -251,37 +260,41 @@ int login_into_user(char *username)
     return 0;
 }
 
-static void handle_bash_exit()
+int handle_terminal_commands(int socket_fd, int master_fd, pid_t bash_pid, int connection_type, ipv4_session *session)
 {
-    ipv4_send_ctl_message_secure(SOCKET_FD, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, CONNECTION_TYPE, KEY);
-}
-
-int handle_terminal_commands(int socket_fd, int master_fd, int connection_type, unsigned char *key)
-{
-    CONNECTION_TYPE = connection_type;
-    SOCKET_FD       = socket_fd;
-    MASTER_FD       = master_fd;
-    KEY             = key;
+    terminal_session terminal =
+    {
+        .socket_fd       = socket_fd,
+        .master_fd       = master_fd,
+        .connection_type = connection_type,
+        .session         = session,
+        .bash_pid        = bash_pid,
+        .bash_pidfd      = syscall(SYS_pidfd_open, bash_pid, 0),
+        .is_closing      = 0
+    };
 
-    sighandler_t old_handler = signal(SIGCHLD, handle_bash_exit);
     int return_value = 0;
 
     ipv4_ctl_message ctl_message = {0};
     char bash_command[PACKET_DATA_SIZE + 1] = {0};
 
     pthread_t send_thread;
-    int send_pthread_error = pthread_create(&send_thread, NULL, handle_terminal_sender, NULL);
-    if (send_pthread_error == -1)
+    int send_pthread_error = pthread_create(&send_thread, NULL, handle_terminal_sender, &terminal);
+    if (send_pthread_error != 0)
     {
-        ipv4_syslog(LOG_ERR, "[TERMINAL]: pthread_create() couldn't control message: %s\n", strerror(errno));
+        ipv4_syslog(LOG_ERR, "[TERMINAL]: pthread_create() couldn't control message: %s\n", strerror(send_pthread_error));
+
+        kill(bash_pid, SIGKILL);
+        waitpid(bash_pid, NULL, 0);
+        if (terminal.bash_pidfd != -1)
+            close(terminal.bash_pidfd);
+        close(master_fd);
         return -1;
     }
 
-    pthread_detach(send_thread);
-
     while (1)
     {
-        ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, key);
+        ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, session);
         if (recv_bytes_ctl == -1)
         {
             ipv4_syslog(LOG_ERR, "[TERMINAL]: error during ipv4_receive_message_secure(): %s", strerror(errno));
@@ -291,14 +304,14 @@ int handle_terminal_commands(int socket_fd, int master_fd, int connection_type,
 
         if (connection_type == SOCK_STREAM && recv_bytes_ctl == 0)
         {
-            pthread_cancel(send_thread);
+            close_terminal(&terminal, send_thread);
             pthread_exit(NULL);
         }
 
         if (ctl_message.message_type == IPV4_SHUTDOWN_TYPE)
         {
             ipv4_syslog(LOG_NOTICE, "successfully finish job and exit");
-            pthread_cancel(send_thread);
+            close_terminal(&terminal, send_thread);
 
             void *retval = 0;
             pthread_exit(retval);
@@ -306,7 +319,7 @@ int handle_terminal_commands(int socket_fd, int master_fd, int connection_type,
 
         // ipv4_syslog(LOG_INFO, "[TERMINAL]: received bytes from client (ctl): %zu\n", recv_bytes_ctl);
 
-        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, bash_command, ctl_message.message_length, connection_type, key);
+        ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, bash_command, ctl_message.message_length, connection_type, session);
         if (recv_bytes == -1)
         {
             ipv4_syslog(LOG_ERR, "[TERMINAL]: error during ipv4_receive_message_secure(): %s", strerror(errno));
@@ -315,7 +328,7 @@ int handle_terminal_commands(int socket_fd, int master_fd, int connection_type,
         }
         if (connection_type == SOCK_STREAM && recv_bytes_ctl == 0)
         {
-            pthread_cancel(send_thread);
+            close_terminal(&terminal, send_thread);
             pthread_exit(NULL);
         }
         bash_command[ctl_message.message_length] = 0;
@@ -334,8 +347,7 @@ int handle_terminal_commands(int socket_fd, int master_fd, int connection_type,
         memset(bash_command, 0, ctl_message.message_length + 1);
     }
 
-    pthread_cancel(send_thread);
-    signal(SIGCHLD, old_handler);
+    close_terminal(&terminal, send_thread);
 
     if (return_value == 0)
         ipv4_syslog(LOG_INFO, "[TERMINAL]: successfully finish bash session");
@@ -343,35 +355,88 @@ int handle_terminal_commands(int socket_fd, int master_fd, int connection_type,
     return return_value;
 }
 
+// Hangs up bash of the terminal and waits for the sender thread, which reaps it
+static void close_terminal(terminal_session *terminal, pthread_t send_thread)
+{
+    atomic_store(&(terminal->is_closing), 1);
+    kill(terminal->bash_pid, SIGHUP);
+
+    struct timespec deadline = {0};
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += VSSHD_TERMINAL_HANGUP_TIMEOUT;
+
+    if (pthread_timedjoin_np(send_thread, NULL, &deadline) != 0)
+    {
+        ipv4_syslog(LOG_WARNING, "[TERMINAL]: bash doesn't exit on hangup, kill it");
+        kill(terminal->bash_pid, SIGKILL);
+        pthread_join(send_thread, NULL);
+    }
+
+    if (terminal->bash_pidfd != -1)
+        close(terminal->bash_pidfd);
+    close(terminal->master_fd);
+}
+
+// Sends the output of bash to the client until bash exits, then reaps it and tells the client
 static void *handle_terminal_sender(void *arg)
 {
-    int old_type = 0;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old_type);
+    terminal_session *terminal = (terminal_session *) arg;
 
     char buffer[PACKET_DATA_SIZE + 1] = {0};
 
+    struct pollfd poll_fds[2] =
+    {
+        {.fd = terminal->master_fd,  .events = POLLIN},
+        {.fd = terminal->bash_pidfd, .events = POLLIN} // ignored by poll() when -1
+    };
+
     while (1)
     {
-        ssize_t read_master_bytes = read(MASTER_FD, buffer, sizeof(buffer));
-        if (read_master_bytes == -1)
+        if (poll(poll_fds, 2, -1) == -1)
         {
-            ipv4_syslog(LOG_ERR, "[TERMINAL]: error during read() from master_fd: %s", strerror(errno));
-            pthread_exit(NULL);
+            if (errno == EINTR)
+                continue;
+
+            ipv4_syslog(LOG_ERR, "[TERMINAL]: error during poll(): %s", strerror(errno));
+            break;
+        }
+
+        // The output left after the exit of bash is sent before the exit notice
+        if ((poll_fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+        {
+            if (poll_fds[1].revents != 0)
+                break;
+
+            continue;
         }
 
+        ssize_t read_master_bytes = read(terminal->master_fd, buffer, sizeof(buffer));
+        if (read_master_bytes <= 0) // EIO when the slave side is closed
+            break;
+
         // ipv4_syslog(LOG_INFO, "[TERMINAL]: read bytes from master = %zu", read_master_bytes);
         size_t bytes_to_send = read_master_bytes > PACKET_DATA_SIZE ? PACKET_DATA_SIZE : read_master_bytes;
-        
-        ssize_t sent_bytes = ipv4_send_message_secure(SOCKET_FD, buffer, bytes_to_send, CONNECTION_TYPE, KEY);
+
+        ssize_t sent_bytes = ipv4_send_message_secure(terminal->socket_fd, buffer, bytes_to_send, terminal->connection_type, terminal->session);
         if (sent_bytes == -1 || sent_bytes == 0)
         {
             ipv4_syslog(LOG_ERR, "[TERMINAL]: error during ipv4_send_message_secure(): %s", strerror(errno));
-            pthread_exit(NULL);
+
+            // Nothing more can be sent, bash is hung up as if the client closed the terminal
+            atomic_store(&(terminal->is_closing), 1);
+            kill(terminal->bash_pid, SIGHUP);
+            break;
         }
 
         // ipv4_syslog(LOG_INFO, "[TERMINAL]: sent bytes to client: %zu\n", sent_bytes);
         memset(buffer, 0, read_master_bytes + 1);
     }
 
+    waitpid(terminal->bash_pid, NULL, 0);
+    ipv4_syslog(LOG_INFO, "[TERMINAL]: bash %ld exited", (long) terminal->bash_pid);
+
+    if (atomic_load(&(terminal->is_closing)) == 0)
+        ipv4_send_ctl_message_secure(terminal->socket_fd, IPV4_SHUTDOWN_TYPE, 0, NULL, 0, NULL, 0, NULL, 0, terminal->connection_type, terminal->session);
+
     return NULL;
 }
@@ -9,12 +9,11 @@
 #include <sys/wait.h>
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
-#include <openssl/aes.h>
 
 extern int login_into_user(char *username);
 extern int handle_terminal_commands(int socket_fd, int master_fd, int connection_type);
 
-int handle_users_list_request(int socket_fd, int connection_type, unsigned char *key)
+int handle_users_list_request(int socket_fd, int connection_type, ipv4_session *session)
 {
     char buffer[BUFSIZ + 1] = {0};
     char *cur_pos = buffer;
@@ -46,10 +45,10 @@ int handle_users_list_request(int socket_fd, int connection_type, unsigned char
     size_t written_bytes = BUFSIZ - n_max_bytes_to_write;
     size_t bytes_to_send = written_bytes > PACKET_DATA_SIZE ? PACKET_DATA_SIZE : written_bytes;
 
-    return ipv4_send_message_secure(socket_fd, buffer, bytes_to_send, connection_type, key);
+    return ipv4_send_message_secure(socket_fd, buffer, bytes_to_send, connection_type, session);
 }
 
-int handle_file(int socket_fd, int connection_type, size_t file_size, char *username, char *dest_file_path, unsigned char *key)
+int handle_file(int socket_fd, int connection_type, size_t file_size, char *username, char *dest_file_path, ipv4_session *session)
 {
     int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (master_fd == -1)
@@ -164,7 +163,7 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
     char password[BUFSIZ + 1]    = {0};
     char file_message[PACKET_DATA_SIZE + 1] = {0};
 
-    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, key);
+    ssize_t recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, session);
     if (recv_bytes_ctl == -1)
     {
         ipv4_syslog(LOG_ERR, "[TERMINAL]: error during ipv4_receive_message(): %s", strerror(errno));
@@ -176,7 +175,7 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
         return -1;
     }
         
-    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, password, ctl_message.message_length, connection_type, key);
+    ssize_t recv_bytes = ipv4_receive_message_secure(socket_fd, password, ctl_message.message_length, connection_type, session);
     if (recv_bytes == -1)
     {
         ipv4_syslog(LOG_ERR, "[TERMINAL]: error during ipv4_receive_message(): %s", strerror(errno));
@@ -194,7 +193,6 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
     waitpid(child_pid, &exit_state, 0);
     close(master_fd);
 
-    char *buffer = NULL;
     int fd = -1;
 
     if (exit_state == 0) // right password
@@ -212,16 +210,6 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
         seteuid(user_info->pw_uid);
         setegid(user_info->pw_gid);
 
-        buffer = malloc(file_size + 1);
-        if (buffer == NULL)
-        {
-            ipv4_syslog(LOG_INFO, "[FILE TRANSFER]: malloc() error");
-            seteuid(getuid());
-            setegid(getgid());
-            snprintf(file_message, 2, "%c", 0x17);
-            exit_state = 1;
-        }
-
         fd = open(dest_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
         if (fd == -1)
         {
@@ -229,7 +217,6 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
             seteuid(getuid());
             setegid(getgid());
             snprintf(file_message, 2, "%c", 0x17);
-            free(buffer);
             exit_state = 1;
         }
     }
@@ -238,11 +225,10 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
         snprintf(file_message, 2, "%c", 0x18);
     }
 
-    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, file_message, 2, connection_type, key);
+    ssize_t sent_bytes = ipv4_send_message_secure(socket_fd, file_message, 2, connection_type, session);
     if (sent_bytes == -1 || sent_bytes == 0)
     {
         ipv4_syslog(LOG_ERR, "[FILE TRANSFER] ipv4_send_message() couldn't sent message\n");
-        free(buffer);
         close(fd);
         seteuid(getuid());
         setegid(getgid());
@@ -256,11 +242,10 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
         return -1;
     }
 
-    recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, key);
+    recv_bytes_ctl = ipv4_receive_message_secure(socket_fd, &ctl_message, sizeof(ipv4_ctl_message), connection_type, session);
     if (recv_bytes_ctl == -1)
     {
         ipv4_syslog(LOG_ERR, "[FILE TRANSFER] ipv4_receive_message() couldn't receive message\n");
-        free(buffer);
         close(fd);
         seteuid(getuid());
         setegid(getgid());
@@ -271,16 +256,16 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
     {
         ipv4_syslog(LOG_INFO, "[FILE TRANSFER] begin to receive file (size = %zu)", file_size);
 
-        ssize_t recv_bytes = ipv4_receive_buffer_secure(socket_fd, buffer, file_size, connection_type, key);
+        // Chunks are written as they arrive
+        ssize_t recv_bytes = ipv4_receive_file_secure(socket_fd, fd, file_size, connection_type, session);
         if (recv_bytes == -1)
         {
-            ipv4_syslog(LOG_ERR, "[FILE TRANSFER] ipv4_receive_buffer() error\n");
-            free(buffer);
+            ipv4_syslog(LOG_ERR, "[FILE TRANSFER] ipv4_receive_file_secure() error\n");
             close(fd);
+            seteuid(getuid());
+            setegid(getgid());
             return -1;
         }
-
-        write(fd, buffer, file_size);
     }
 
     ipv4_syslog(LOG_NOTICE, "[FILE TRANSFER] successfully finish job and exit");
@@ -288,7 +273,6 @@ int handle_file(int socket_fd, int connection_type, size_t file_size, char *user
     seteuid(getuid());
     setegid(getgid());
 
-    free(buffer);
     close(fd);
 
     return 0;
@@ -3,6 +3,30 @@
 
 static const char *VSSHD_PID_FILE_NAME = "/var/run/vsshd.pid";
 
+// The RSA key is read again on its next use
+static void handle_sighup(int signum)
+{
+    reload_RSA_keys();
+}
+
+// Record ciphers are offered by clients and chosen by the CPU the server runs on
+static void log_record_ciphers(void)
+{
+    unsigned cpu_features = ipv4_session_cpu_features();
+
+    syslog(LOG_INFO, "CPU features:%s%s%s%s",
+           (cpu_features & IPV4_CPU_AES)    ? " aes"    : "",
+           (cpu_features & IPV4_CPU_PCLMUL) ? " pclmul" : "",
+           (cpu_features & IPV4_CPU_VAES)   ? " vaes"   : "",
+           (cpu_features & IPV4_CPU_AVX2)   ? " avx2"   : "");
+
+    uint32_t ciphers[IPV4_N_CIPHERS] = {0};
+    size_t n_ciphers = ipv4_session_ciphers(ciphers, IPV4_N_CIPHERS);
+
+    for (size_t i = 0; i < n_ciphers; ++i)
+        syslog(LOG_INFO, "Record cipher %zu: %s", i + 1, ipv4_session_cipher_name(ciphers[i]));
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 2)
@@ -23,6 +47,10 @@ int main(int argc, char *argv[])
 
     syslog(LOG_INFO, "Unique PID file \"%s\" is created", VSSHD_PID_FILE_NAME);
 
+    log_record_ciphers();
+
+    signal(SIGHUP, handle_sighup);
+
     int connection_type = SOCK_STREAM;
     if (strcmp(argv[1], "--udp") == 0)
         connection_type = SOCK_DGRAM;